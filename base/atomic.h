@@ -0,0 +1,72 @@
+/*
+ * Copyright 2022 wtcat
+ */
+#ifndef BASE_ATOMIC_H_
+#define BASE_ATOMIC_H_
+
+#include <stddef.h>
+
+#if defined(_MSC_VER)
+#include <windows.h>
+#endif
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define ATOMIC_LOAD(_p) \
+    __atomic_load_n(_p, __ATOMIC_ACQUIRE)
+#define ATOMIC_STORE(_p, _v) \
+    __atomic_store_n(_p, _v, __ATOMIC_RELEASE)
+#define ATOMIC_LOAD_RELAXED(_p) \
+    __atomic_load_n(_p, __ATOMIC_RELAXED)
+#define ATOMIC_STORE_RELAXED(_p, _v) \
+    __atomic_store_n(_p, _v, __ATOMIC_RELAXED)
+#define ATOMIC_ADD(_p, _v) \
+    __atomic_add_fetch(_p, _v, __ATOMIC_RELAXED)
+#define ATOMIC_SUB(_p, _v) \
+    __atomic_sub_fetch(_p, _v, __ATOMIC_RELAXED)
+#define ATOMIC_CAS(_p, _old, _new) \
+    __atomic_compare_exchange_n(_p, _old, _new, 0, \
+        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+
+#elif defined(_MSC_VER)
+/* Aligned accesses are atomic on x86/x64, only the compiler must be fenced */
+#define ATOMIC_LOAD(_p) (_ReadWriteBarrier(), *(_p))
+#define ATOMIC_STORE(_p, _v) do { _ReadWriteBarrier(); *(_p) = (_v); } while (0)
+#define ATOMIC_LOAD_RELAXED(_p) ATOMIC_LOAD(_p)
+#define ATOMIC_STORE_RELAXED(_p, _v) ATOMIC_STORE(_p, _v)
+/* 32 bit counters (LONG) and size_t ones, chosen by the width of *_p */
+#define ATOMIC_ADD(_p, _v) \
+    (sizeof(*(_p)) == sizeof(LONG)? \
+        _atomic_add32((_p), (ULONG)(_v)): \
+        _atomic_add_size((_p), (size_t)(_v)))
+#define ATOMIC_SUB(_p, _v) \
+    (sizeof(*(_p)) == sizeof(LONG)? \
+        _atomic_add32((_p), -(ULONG)(_v)): \
+        _atomic_add_size((_p), -(size_t)(_v)))
+#define ATOMIC_CAS(_p, _old, _new) \
+    _atomic_cas_ptr((void *volatile *)(_p), (void **)(_old), (void *)(_new))
+
+static inline size_t _atomic_add32(volatile void *p, ULONG v) {
+    return (ULONG)InterlockedExchangeAdd((volatile LONG *)p, (LONG)v) + v;
+}
+
+static inline size_t _atomic_add_size(volatile void *p, size_t v) {
+    return InterlockedExchangeAddSizeT((volatile size_t *)p, v) + v;
+}
+
+static inline int _atomic_cas_ptr(void *volatile *p, void **old, void *nv) {
+    void *prev = InterlockedCompareExchangePointer(p, nv, *old);
+    if (prev == *old)
+        return 1;
+    *old = prev;
+    return 0;
+}
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* BASE_ATOMIC_H_ */
@@ -2,14 +2,34 @@
  * Copyright 2022 wtcat
  */
 
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "base/assert.h"
+#include "base/mutex.h"
 #include "base/utils.h"
 #include "base/backtrace.h"
 
+struct symbol_entry {
+    void *ip;
+    char *name;
+    size_t len;
+};
+
+struct symbol_cache {
+#define SYMBOL_CACHE_MIN_ENTRIES 256
+#define SYMBOL_CACHE_AVG_SYMBOL  128
+    struct symbol_entry *entries;
+    size_t mask;
+    size_t max_bytes;
+    struct symbol_cache_stats stats;
+    MUTEX_LOCK_DECLARE(lock);
+};
+
 static inline void user_backtrace_begin(struct backtrace_callbacks *cb, 
     struct backtrace_class *cls, void *user) {
     if (cb->begin)
@@ -38,6 +58,166 @@ static inline void bactrace_symbol_deinit(struct backtrace_class *cls) {
         cls->transform_post(cls);
 }
 
+static inline size_t symbol_cache_index(struct symbol_cache *sc, void *ip) {
+    uint64_t key = (uint64_t)(uintptr_t)ip * 0x9E3779B97F4A7C15ULL;
+    return (size_t)(key >> 32) & sc->mask;
+}
+
+static struct symbol_entry *symbol_cache_find(struct symbol_cache *sc, void *ip) {
+    size_t i = symbol_cache_index(sc, ip);
+    while (sc->entries[i].ip != NULL) {
+        if (sc->entries[i].ip == ip)
+            return &sc->entries[i];
+        i = (i + 1) & sc->mask;
+    }
+    return NULL;
+}
+
+static void symbol_cache_clear(struct symbol_cache *sc) {
+    for (size_t i = 0; i <= sc->mask; i++) {
+        struct symbol_entry *e = &sc->entries[i];
+        if (e->ip != NULL) {
+            free(e->name);
+            memset(e, 0, sizeof(*e));
+        }
+    }
+    sc->stats.memory_size = (sc->mask + 1) * sizeof(struct symbol_entry);
+    sc->stats.entries = 0;
+}
+
+/*
+ * When the table or the string budget is exhausted the whole cache is 
+ * dropped, which keeps memory bounded without per-entry bookkeeping.
+ */
+static void symbol_cache_insert(struct symbol_cache *sc, void *ip, 
+    const char *name, ssize_t len) {
+    size_t size = len > 0? (size_t)len + 1: 0;
+    struct symbol_entry *e;
+    size_t i;
+
+    if ((sc->stats.entries + 1) * 4 > (sc->mask + 1) * 3 || 
+        sc->stats.memory_size + size > sc->max_bytes) {
+        sc->stats.evictions += sc->stats.entries;
+        symbol_cache_clear(sc);
+    }
+    i = symbol_cache_index(sc, ip);
+    while (sc->entries[i].ip != NULL)
+        i = (i + 1) & sc->mask;
+    e = &sc->entries[i];
+    if (size > 0) {
+        e->name = malloc(size);
+        if (e->name == NULL)
+            return;
+        memcpy(e->name, name, size - 1);
+        e->name[size - 1] = '\0';
+        e->len = len;
+    }
+    e->ip = ip;
+    sc->stats.entries++;
+    sc->stats.memory_size += size;
+}
+
+static ssize_t backtrace_cached_symbol(struct backtrace_class *cls, void *ip, 
+    char *buf, size_t maxlen, bool *prepared) {
+    struct symbol_cache *sc = cls->cache;
+    ssize_t ret;
+
+    if (sc != NULL) {
+        MUTEX_LOCK(sc);
+        struct symbol_entry *e = symbol_cache_find(sc, ip);
+        if (e != NULL) {
+            sc->stats.hits++;
+            ret = -ENOENT;
+            if (e->name != NULL && maxlen > 0) {
+                ret = MIN(e->len, maxlen - 1);
+                memcpy(buf, e->name, ret);
+                buf[ret] = '\0';
+            }
+            MUTEX_UNLOCK(sc);
+            return ret;
+        }
+        sc->stats.misses++;
+        MUTEX_UNLOCK(sc);
+    }
+    if (!*prepared) {
+        ret = bactrace_symbol_init(cls);
+        if (ret)
+            return ret;
+        *prepared = true;
+    }
+    ret = backtrace_addr2symbol(cls, ip, buf, maxlen);
+    /* Truncated names are not worth keeping */
+    if (sc != NULL && (ret <= 0 || (size_t)ret + 1 < maxlen)) {
+        MUTEX_LOCK(sc);
+        if (symbol_cache_find(sc, ip) == NULL)
+            symbol_cache_insert(sc, ip, buf, ret);
+        MUTEX_UNLOCK(sc);
+    }
+    return ret;
+}
+
+int backtrace_symbol_cache_enable(struct backtrace_class *cls, size_t max_bytes) {
+    struct symbol_cache *sc;
+    size_t n = SYMBOL_CACHE_MIN_ENTRIES;
+    if (cls == NULL)
+        return -EINVAL;
+    backtrace_symbol_cache_disable(cls);
+    while (n * (sizeof(struct symbol_entry) + SYMBOL_CACHE_AVG_SYMBOL) < max_bytes)
+        n <<= 1;
+    sc = calloc(1, sizeof(*sc));
+    if (sc == NULL)
+        return -ENOMEM;
+    sc->entries = calloc(n, sizeof(struct symbol_entry));
+    if (sc->entries == NULL) {
+        free(sc);
+        return -ENOMEM;
+    }
+    sc->mask = n - 1;
+    sc->max_bytes = MAX(max_bytes, n * sizeof(struct symbol_entry));
+    sc->stats.memory_size = n * sizeof(struct symbol_entry);
+    MUTEX_INIT(sc);
+    cls->cache = sc;
+    return 0;
+}
+
+void backtrace_symbol_cache_disable(struct backtrace_class *cls) {
+    struct symbol_cache *sc = cls->cache;
+    if (sc == NULL)
+        return;
+    cls->cache = NULL;
+    symbol_cache_clear(sc);
+    MUTEX_DEINIT(sc);
+    free(sc->entries);
+    free(sc);
+}
+
+void backtrace_symbol_cache_flush(struct backtrace_class *cls) {
+    struct symbol_cache *sc = cls->cache;
+    if (sc == NULL)
+        return;
+    MUTEX_LOCK(sc);
+    symbol_cache_clear(sc);
+    MUTEX_UNLOCK(sc);
+}
+
+void backtrace_symbol_cache_stats(struct backtrace_class *cls, 
+    struct symbol_cache_stats *stats) {
+    struct symbol_cache *sc = cls->cache;
+    if (stats == NULL)
+        return;
+    memset(stats, 0, sizeof(*stats));
+    if (sc == NULL)
+        return;
+    MUTEX_LOCK(sc);
+    *stats = sc->stats;
+    MUTEX_UNLOCK(sc);
+}
+
+void backtrace_deinit(struct backtrace_class *cls) {
+    if (cls != NULL)
+        backtrace_symbol_cache_disable(cls);
+}
+
 int backtrace_set_path_window(struct backtrace_class *cls, 
     int min_limit, int max_limit) {
     if (cls == NULL)
@@ -58,14 +238,48 @@ int backtrace_set_path_separator(struct backtrace_class *cls, const char *separa
     return 0;
 }
 
+int backtrace_set_path_skip(struct backtrace_class *cls, 
+    uintptr_t start, uintptr_t end) {
+    if (cls == NULL || start > end)
+        return -EINVAL;
+    cls->skip_start = start;
+    cls->skip_end = end;
+    return 0;
+}
+
+struct skip_context {
+    struct backtrace_class *cls;
+    struct backtrace_callbacks *cb;
+    void *user;
+};
+
+/* At least one frame is kept, even when the whole path is skipped */
+static void skip_entry(const struct backtrace_entry *entry, void *user) {
+    struct skip_context *sc = (struct skip_context *)user;
+    struct backtrace_entry e = *entry;
+    while (e.n > 1 && (uintptr_t)e.ip[0] >= sc->cls->skip_start && 
+        (uintptr_t)e.ip[0] < sc->cls->skip_end) {
+        e.ip++;
+        e.n--;
+    }
+    sc->cb->callback(&e, sc->user);
+}
+
 int backtrace_extract_path(struct backtrace_class *cls, 
     struct backtrace_callbacks *cb, void *user) {
     ASSERT_TRUE(cls != NULL);
     ASSERT_TRUE(cb != NULL);
+    int ret;
     if (cb->callback == NULL)
         return -EINVAL;
     user_backtrace_begin(cb, cls, user);
-    int ret = do_backtrace(cls, cb, user);
+    if (cls->skip_end > cls->skip_start) {
+        struct skip_context sc = {cls, cb, user};
+        struct backtrace_callbacks skip_cb = {.callback = skip_entry};
+        ret = do_backtrace(cls, &skip_cb, &sc);
+    } else {
+        ret = do_backtrace(cls, cb, user);
+    }
     user_backtrace_end(cb, cls, user, ret);
     return ret;
 }
@@ -81,22 +295,18 @@ ssize_t backtrace_transform_path(struct backtrace_class *cls, struct ip_array *i
     size_t slen = strlen(separator);
     size_t remain = maxlen - 1;
     size_t offset, i;
+    bool prepared = false;
     int splen;
     int ret;
 
-    if (slen >= remain) {
-        ret = -EINVAL;
-        goto _end;
-    }
-    ret = bactrace_symbol_init(cls);
-    if (ret)
-        goto _end;
+    if (slen >= remain)
+        return -EINVAL;
     memcpy(buffer, separator, slen);
     offset = slen;
     remain -= slen;
     for (i = 0; i < n && remain > 0; i++) {
-        int ret = backtrace_addr2symbol(cls, ip[i], buffer+offset, 
-            remain);
+        int ret = backtrace_cached_symbol(cls, ip[i], buffer+offset, 
+            remain, &prepared);
         if (ret > 0) {
             offset += ret;
             if (offset + slen >= maxlen) 
@@ -113,7 +323,33 @@ ssize_t backtrace_transform_path(struct backtrace_class *cls, struct ip_array *i
     }
     buffer[offset] = '\0';
     ret = offset;
-_end:
-    bactrace_symbol_deinit(cls);
+    if (prepared)
+        bactrace_symbol_deinit(cls);
     return ret;
 }
+
+ssize_t backtrace_transform_symbol(struct backtrace_class *cls, void *ip, 
+    char *buffer, size_t maxlen) {
+    ASSERT_TRUE(cls != NULL);
+    bool prepared = false;
+    ssize_t ret;
+    if (buffer == NULL || maxlen == 0)
+        return -EINVAL;
+    ret = backtrace_cached_symbol(cls, ip, buffer, maxlen, &prepared);
+    if (prepared)
+        bactrace_symbol_deinit(cls);
+    return ret;
+}
+
+/*
+ * Symbols come as "module(name+offset) [address]" or as a bare 
+ * "name+offset", pick the name out of either form.
+ */
+size_t backtrace_symbol_name(const char *symbol, const char **name) {
+    const char *start = strchr(symbol, '(');
+    size_t len;
+    start = start? start + 1: symbol;
+    len = strcspn(start, "+)");
+    *name = start;
+    return len;
+}
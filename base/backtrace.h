@@ -19,10 +19,17 @@ extern "C"{
 #define BACKTRACE_SEPARATOR_SIZE 16
 
 struct backtrace_class;
+struct symbol_cache;
 
 enum bracktrace_type {
     FAST_BACKTRACE,
-    UNWIND_BACKTRACE
+    UNWIND_BACKTRACE,
+    FRAMEPOINTER_BACKTRACE
+};
+
+enum backtrace_symbolizer {
+    DEFAULT_SYMBOLIZER,
+    ELF_SYMBOLIZER
 };
 
 struct backtrace_entry {
@@ -36,6 +43,30 @@ struct backtrace_callbacks {
     void (*callback)(const struct backtrace_entry *entry, void *user);
 }; 
 
+struct symbol_cache_stats {
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+    size_t entries;
+    size_t memory_size;
+};
+
+/*
+ * Executable segment of a loaded module, run-time addresses minus 
+ * @bias are the link-time addresses of the file. @offset is the file 
+ * offset of the segment.
+ */
+struct backtrace_module {
+#define BACKTRACE_BUILD_ID_SIZE 20
+    uintptr_t start;
+    uintptr_t end;
+    uintptr_t bias;
+    uint64_t offset;
+    const char *path;
+    uint8_t build_id[BACKTRACE_BUILD_ID_SIZE];
+    size_t build_id_size;
+};
+
 struct backtrace_class {
     int (*backtrace)(struct backtrace_class *cls, struct backtrace_callbacks *cb, void *user);
     ssize_t (*transform)(struct backtrace_class *cls, void *ip, char *buf, size_t maxlen);
@@ -46,6 +77,10 @@ struct backtrace_class {
     int max_limit;
     size_t ctx_size;
     void *context;
+    struct symbol_cache *cache;
+    /* Leading frames inside [skip_start, skip_end) are dropped */
+    uintptr_t skip_start;
+    uintptr_t skip_end;
 };
 
 static inline void user_backtrace_entry(struct backtrace_callbacks *cb, 
@@ -66,11 +101,38 @@ static inline size_t backtrace_context_size(struct backtrace_class *cls) {
 int backtrace_set_path_window(struct backtrace_class *cls, 
     int min_limit, int max_limit);
 int backtrace_set_path_separator(struct backtrace_class *tracer, const char *separator);
+int backtrace_set_path_skip(struct backtrace_class *cls, 
+    uintptr_t start, uintptr_t end);
 int backtrace_extract_path(struct backtrace_class *tracer, 
     struct backtrace_callbacks *cb, void *user);
 ssize_t backtrace_transform_path(struct backtrace_class *tracer, struct ip_array *ips, 
     char *buffer, size_t maxlen);
+ssize_t backtrace_transform_symbol(struct backtrace_class *cls, void *ip, 
+    char *buffer, size_t maxlen);
+size_t backtrace_symbol_name(const char *symbol, const char **name);
 int backtrace_init(enum bracktrace_type type, struct backtrace_class *cls);
+void backtrace_deinit(struct backtrace_class *cls);
+int backtrace_set_symbolizer(struct backtrace_class *cls, 
+    enum backtrace_symbolizer type);
+int backtrace_module_iterate(
+    int (*iterator)(const struct backtrace_module *m, void *arg), void *arg);
+/*
+ * Roots of a conservative pointer scan: the writable segments of the 
+ * loaded modules and the stack of the calling thread above the caller, 
+ * with the callee saved registers spilled onto it.
+ */
+int backtrace_root_iterate(
+    int (*iterator)(const void *start, const void *end, void *arg), void *arg);
+
+/*
+ * Symbol cache keyed by instruction pointer, shared by every path that 
+ * is transformed through @cls. Memory use stays below @max_bytes.
+ */
+int backtrace_symbol_cache_enable(struct backtrace_class *cls, size_t max_bytes);
+void backtrace_symbol_cache_disable(struct backtrace_class *cls);
+void backtrace_symbol_cache_flush(struct backtrace_class *cls);
+void backtrace_symbol_cache_stats(struct backtrace_class *cls, 
+    struct symbol_cache_stats *stats);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,188 @@
+/*
+ * Copyright 2022 wtcat
+ */
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_MSC_VER)
+#include <io.h>
+#define write _write
+#else
+#include <unistd.h>
+#endif
+
+#if defined(HAVE_ZLIB)
+#include <zlib.h>
+#endif
+
+#include "base/utils.h"
+#include "base/gzip.h"
+
+static int gzip_raw_write(struct gzip_writer *gz, const void *buf, size_t len) {
+    const char *p = (const char *)buf;
+    while (len > 0 && !gz->err) {
+        long n = (long)write(gz->fd, p, (unsigned int)len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            gz->err = -errno;
+            break;
+        }
+        p += n;
+        len -= n;
+    }
+    return gz->err;
+}
+
+#if defined(HAVE_ZLIB)
+static int gzip_deflate(struct gzip_writer *gz, int flush) {
+    z_stream *zs = (z_stream *)gz->stream;
+    unsigned char out[16 * 1024];
+    int ret;
+
+    zs->next_in = gz->buffer;
+    zs->avail_in = (uInt)gz->len;
+    do {
+        zs->next_out = out;
+        zs->avail_out = sizeof(out);
+        ret = deflate(zs, flush);
+        if (ret == Z_STREAM_ERROR)
+            return gz->err = -EIO;
+        if (gzip_raw_write(gz, out, sizeof(out) - zs->avail_out))
+            return gz->err;
+    } while (zs->avail_out == 0);
+    gz->len = 0;
+    return 0;
+}
+
+int gzip_writer_open(struct gzip_writer *gz, int fd) {
+    z_stream *zs;
+    memset(gz, 0, offsetof(struct gzip_writer, buffer));
+    gz->fd = fd;
+    zs = calloc(1, sizeof(*zs));
+    if (zs == NULL)
+        return -ENOMEM;
+    /* 16 + MAX_WBITS selects the gzip wrapper */
+    if (deflateInit2(zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS,
+        8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        free(zs);
+        return -ENOMEM;
+    }
+    gz->stream = zs;
+    return 0;
+}
+
+static inline int gzip_flush(struct gzip_writer *gz) {
+    return gzip_deflate(gz, Z_NO_FLUSH);
+}
+
+int gzip_writer_close(struct gzip_writer *gz) {
+    z_stream *zs = (z_stream *)gz->stream;
+    if (zs == NULL)
+        return -EINVAL;
+    if (!gz->err)
+        gzip_deflate(gz, Z_FINISH);
+    deflateEnd(zs);
+    free(zs);
+    gz->stream = NULL;
+    return gz->err;
+}
+
+#else /* !HAVE_ZLIB */
+
+static void crc32_init(uint32_t *table) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = (c & 1)? 0xEDB88320u ^ (c >> 1): c >> 1;
+        table[i] = c;
+    }
+}
+
+static uint32_t crc32_update(const uint32_t *table, uint32_t crc, 
+    const unsigned char *p, size_t len) {
+    crc = ~crc;
+    while (len--)
+        crc = table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+/* One stored deflate block per buffer, at most 64KB - 1 each */
+static int gzip_store(struct gzip_writer *gz, int final) {
+    const unsigned char *p = gz->buffer;
+    size_t len = gz->len;
+    do {
+        size_t n = MIN(len, 0xFFFF);
+        unsigned char hdr[5];
+        hdr[0] = (final && n == len)? 1: 0;
+        hdr[1] = n & 0xFF;
+        hdr[2] = (n >> 8) & 0xFF;
+        hdr[3] = ~n & 0xFF;
+        hdr[4] = (~n >> 8) & 0xFF;
+        if (gzip_raw_write(gz, hdr, sizeof(hdr)) || gzip_raw_write(gz, p, n))
+            return gz->err;
+        p += n;
+        len -= n;
+    } while (len > 0);
+    gz->len = 0;
+    return 0;
+}
+
+int gzip_writer_open(struct gzip_writer *gz, int fd) {
+    static const unsigned char hdr[10] = {
+        0x1F, 0x8B, 8, 0, 0, 0, 0, 0, 0, 0xFF
+    };
+    memset(gz, 0, offsetof(struct gzip_writer, buffer));
+    gz->fd = fd;
+    /* The stream handle holds the CRC table in this variant */
+    gz->stream = malloc(256 * sizeof(uint32_t));
+    if (gz->stream == NULL)
+        return -ENOMEM;
+    crc32_init((uint32_t *)gz->stream);
+    if (gzip_raw_write(gz, hdr, sizeof(hdr))) {
+        free(gz->stream);
+        gz->stream = NULL;
+    }
+    return gz->err;
+}
+
+static inline int gzip_flush(struct gzip_writer *gz) {
+    return gzip_store(gz, 0);
+}
+
+int gzip_writer_close(struct gzip_writer *gz) {
+    unsigned char trailer[8];
+    if (gz->stream == NULL)
+        return -EINVAL;
+    if (!gz->err && !gzip_store(gz, 1)) {
+        for (int i = 0; i < 4; i++) {
+            trailer[i] = (gz->crc >> (8 * i)) & 0xFF;
+            trailer[4 + i] = (gz->isize >> (8 * i)) & 0xFF;
+        }
+        gzip_raw_write(gz, trailer, sizeof(trailer));
+    }
+    free(gz->stream);
+    gz->stream = NULL;
+    return gz->err;
+}
+#endif /* HAVE_ZLIB */
+
+int gzip_write(struct gzip_writer *gz, const void *data, size_t len) {
+    const unsigned char *p = (const unsigned char *)data;
+    while (len > 0 && !gz->err) {
+        size_t n = MIN(len, GZIP_BUFFER_SIZE - gz->len);
+        memcpy(gz->buffer + gz->len, p, n);
+#if !defined(HAVE_ZLIB)
+        gz->crc = crc32_update((const uint32_t *)gz->stream, gz->crc, p, n);
+#endif
+        gz->isize += (uint32_t)n;
+        gz->len += n;
+        p += n;
+        len -= n;
+        if (gz->len == GZIP_BUFFER_SIZE)
+            gzip_flush(gz);
+    }
+    return gz->err;
+}
@@ -0,0 +1,37 @@
+/*
+ * Copyright 2022 wtcat
+ */
+#ifndef BASE_GZIP_H_
+#define BASE_GZIP_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+/*
+ * Streaming gzip writer on a file descriptor. Data is deflated with
+ * zlib when it is available (HAVE_ZLIB), otherwise it goes out in
+ * stored blocks, which every gzip reader accepts.
+ */
+struct gzip_writer {
+#define GZIP_BUFFER_SIZE (64 * 1024)
+    int fd;
+    int err;
+    uint32_t crc;
+    uint32_t isize;
+    size_t len;
+    void *stream;
+    unsigned char buffer[GZIP_BUFFER_SIZE];
+};
+
+int gzip_writer_open(struct gzip_writer *gz, int fd);
+int gzip_write(struct gzip_writer *gz, const void *data, size_t len);
+int gzip_writer_close(struct gzip_writer *gz);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* BASE_GZIP_H_ */
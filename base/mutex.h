@@ -0,0 +1,43 @@
+/*
+ * Copyright 2022 wtcat
+ */
+#ifndef BASE_MUTEX_H_
+#define BASE_MUTEX_H_
+
+#if !defined(_MSC_VER)
+#include <threads.h>
+#else
+#include <windows.h>
+#endif
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+/* For thread safe */
+#if !defined(_MSC_VER)
+#define MUTEX_LOCK_DECLARE(name) mtx_t name
+#define MUTEX_INIT(_path) \
+    mtx_init(&(_path)->lock, mtx_plain)
+#define MUTEX_LOCK(_path) \
+    mtx_lock(&(_path)->lock)
+#define MUTEX_UNLOCK(_path) \
+    mtx_unlock(&(_path)->lock)
+#define MUTEX_DEINIT(_path) \
+    (void) (_path)
+#else
+#define MUTEX_LOCK_DECLARE(name) HANDLE name
+#define MUTEX_INIT(_path) \
+    (_path)->lock = CreateMutex(NULL, FALSE, NULL)
+#define MUTEX_LOCK(_path) \
+    WaitForSingleObject((_path)->lock, INFINITE)
+#define MUTEX_UNLOCK(_path) \
+    ReleaseMutex((_path)->lock)
+#define MUTEX_DEINIT(_path) \
+    CloseHandle((_path)->lock)
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* BASE_MUTEX_H_ */
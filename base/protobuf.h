@@ -0,0 +1,90 @@
+/*
+ * Copyright 2022 wtcat
+ */
+#ifndef BASE_PROTOBUF_H_
+#define BASE_PROTOBUF_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+/*
+ * Minimal protobuf encoder on a caller supplied buffer. Writes past 
+ * the end are dropped and flagged in @overflow.
+ */
+#define PB_WIRE_VARINT 0
+#define PB_WIRE_BYTES  2
+
+struct pb_buffer {
+    uint8_t *data;
+    size_t len;
+    size_t size;
+    int overflow;
+};
+
+static inline void pb_init(struct pb_buffer *pb, void *data, size_t size) {
+    pb->data = (uint8_t *)data;
+    pb->len = 0;
+    pb->size = size;
+    pb->overflow = 0;
+}
+
+static inline size_t pb_varint_size(uint64_t v) {
+    size_t n = 1;
+    while (v >= 0x80) {
+        v >>= 7;
+        n++;
+    }
+    return n;
+}
+
+static inline void pb_put_varint(struct pb_buffer *pb, uint64_t v) {
+    if (pb->len + pb_varint_size(v) > pb->size) {
+        pb->overflow = 1;
+        return;
+    }
+    while (v >= 0x80) {
+        pb->data[pb->len++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    pb->data[pb->len++] = (uint8_t)v;
+}
+
+static inline void pb_put_tag(struct pb_buffer *pb, unsigned int field, 
+    unsigned int wire) {
+    pb_put_varint(pb, ((uint64_t)field << 3) | wire);
+}
+
+static inline void pb_put_uint64(struct pb_buffer *pb, unsigned int field, 
+    uint64_t v) {
+    pb_put_tag(pb, field, PB_WIRE_VARINT);
+    pb_put_varint(pb, v);
+}
+
+static inline void pb_put_bytes(struct pb_buffer *pb, unsigned int field, 
+    const void *data, size_t len) {
+    pb_put_tag(pb, field, PB_WIRE_BYTES);
+    pb_put_varint(pb, len);
+    if (pb->len + len > pb->size) {
+        pb->overflow = 1;
+        return;
+    }
+    memcpy(pb->data + pb->len, data, len);
+    pb->len += len;
+}
+
+/* Embedded message or packed field already encoded in @sub */
+static inline void pb_put_message(struct pb_buffer *pb, unsigned int field, 
+    const struct pb_buffer *sub) {
+    pb->overflow |= sub->overflow;
+    pb_put_bytes(pb, field, sub->data, sub->len);
+}
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* BASE_PROTOBUF_H_ */
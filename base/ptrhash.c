@@ -0,0 +1,182 @@
+/*
+ * Copyright 2022 wtcat
+ */
+#include <errno.h>
+#include <string.h>
+
+#include "base/assert.h"
+#include "base/ptrhash.h"
+
+#define PTRHASH_EMPTY 0
+#define PTRHASH_TOMB  1
+#define PTRHASH_MIN_SHIFT 6
+#define PTRHASH_MIGRATE_STEP 32
+
+static inline size_t ptrhash_home(const struct ptrhash_table *t, uintptr_t key) {
+    return (size_t)(((uint64_t)key * 0x9E3779B97F4A7C15ULL) >> t->shift);
+}
+
+static inline int ptrhash_overload(const struct ptrhash_table *t) {
+    return (t->count + 1) * 4 > (t->mask + 1) * 3;
+}
+
+static int ptrhash_table_alloc(struct ptrhash *h, struct ptrhash_table *t, 
+    unsigned int bits) {
+    size_t size = ((size_t)1 << bits) * sizeof(struct ptrhash_slot);
+    t->slots = memory_allocate(h->allocator, size, NULL);
+    if (t->slots == NULL)
+        return -ENOMEM;
+    memset(t->slots, 0, size);
+    t->mask = ((size_t)1 << bits) - 1;
+    t->count = 0;
+    t->shift = 64 - bits;
+    return 0;
+}
+
+static void ptrhash_table_free(struct ptrhash *h, struct ptrhash_table *t) {
+    if (t->slots)
+        memory_free(h->allocator, t->slots, NULL);
+    memset(t, 0, sizeof(*t));
+}
+
+static void ptrhash_table_put(struct ptrhash_table *t, uintptr_t key, void *value) {
+    size_t i = ptrhash_home(t, key);
+    while (t->slots[i].key != PTRHASH_EMPTY)
+        i = (i + 1) & t->mask;
+    t->slots[i].key = key;
+    t->slots[i].value = value;
+    t->count++;
+}
+
+static struct ptrhash_slot *ptrhash_table_find(const struct ptrhash_table *t, 
+    uintptr_t key) {
+    size_t i = ptrhash_home(t, key);
+    for (size_t n = 0; n <= t->mask; n++) {
+        struct ptrhash_slot *s = &t->slots[i];
+        if (s->key == key)
+            return s;
+        if (s->key == PTRHASH_EMPTY)
+            return NULL;
+        i = (i + 1) & t->mask;
+    }
+    return NULL;
+}
+
+/*
+ * Backward shift deletion keeps the current table free of tombstones
+ */
+static void ptrhash_table_erase(struct ptrhash_table *t, struct ptrhash_slot *s) {
+    size_t i = s - t->slots;
+    size_t j = i;
+    for ( ; ; ) {
+        j = (j + 1) & t->mask;
+        if (t->slots[j].key == PTRHASH_EMPTY)
+            break;
+        size_t k = ptrhash_home(t, t->slots[j].key);
+        if ((j > i && (k <= i || k > j)) || (j < i && (k <= i && k > j))) {
+            t->slots[i] = t->slots[j];
+            i = j;
+        }
+    }
+    t->slots[i].key = PTRHASH_EMPTY;
+    t->slots[i].value = NULL;
+    t->count--;
+}
+
+/*
+ * Entries moved out of the old table leave tombstones, so probe 
+ * sequences that run across them still reach later entries. Empty 
+ * slots stay empty: the old table takes no inserts, so they are what 
+ * ends a missed lookup.
+ */
+static void ptrhash_migrate(struct ptrhash *h, size_t nslots) {
+    struct ptrhash_table *old = &h->old;
+    if (old->slots == NULL)
+        return;
+    while (nslots-- > 0 && h->migrate_pos <= old->mask) {
+        struct ptrhash_slot *s = &old->slots[h->migrate_pos++];
+        if (s->key > PTRHASH_TOMB) {
+            ptrhash_table_put(&h->cur, s->key, s->value);
+            old->count--;
+            s->key = PTRHASH_TOMB;
+        }
+    }
+    if (h->migrate_pos > old->mask) {
+        ptrhash_table_free(h, old);
+        h->migrate_pos = 0;
+    }
+}
+
+static int ptrhash_grow(struct ptrhash *h) {
+    unsigned int bits = 64 - h->cur.shift + 1;
+    /* Only one table can be in migration */
+    ptrhash_migrate(h, (size_t)-1);
+    h->old = h->cur;
+    if (ptrhash_table_alloc(h, &h->cur, bits)) {
+        h->cur = h->old;
+        memset(&h->old, 0, sizeof(h->old));
+        return -ENOMEM;
+    }
+    h->migrate_pos = 0;
+    ptrhash_migrate(h, PTRHASH_MIGRATE_STEP);
+    return 0;
+}
+
+void ptrhash_init(struct ptrhash *h, struct mem_allocator *alloc) {
+    ASSERT_TRUE(h != NULL);
+    memset(h, 0, sizeof(*h));
+    h->allocator = alloc;
+}
+
+void ptrhash_destroy(struct ptrhash *h) {
+    ptrhash_table_free(h, &h->cur);
+    ptrhash_table_free(h, &h->old);
+    h->migrate_pos = 0;
+}
+
+int ptrhash_insert(struct ptrhash *h, uintptr_t key, void *value) {
+    ASSERT_TRUE(key > PTRHASH_TOMB);
+    if (h->cur.slots == NULL) {
+        if (ptrhash_table_alloc(h, &h->cur, PTRHASH_MIN_SHIFT))
+            return -ENOMEM;
+    }
+    ptrhash_migrate(h, PTRHASH_MIGRATE_STEP);
+    if (ptrhash_overload(&h->cur)) {
+        if (ptrhash_grow(h) && h->cur.count >= h->cur.mask)
+            return -ENOMEM;
+    }
+    ptrhash_table_put(&h->cur, key, value);
+    return 0;
+}
+
+void *ptrhash_find(struct ptrhash *h, uintptr_t key) {
+    struct ptrhash_slot *s;
+    if (h->cur.slots == NULL)
+        return NULL;
+    s = ptrhash_table_find(&h->cur, key);
+    if (s == NULL && h->old.slots != NULL)
+        s = ptrhash_table_find(&h->old, key);
+    return s? s->value: NULL;
+}
+
+void *ptrhash_remove(struct ptrhash *h, uintptr_t key) {
+    struct ptrhash_slot *s;
+    void *value;
+    if (h->cur.slots == NULL)
+        return NULL;
+    s = ptrhash_table_find(&h->cur, key);
+    if (s != NULL) {
+        value = s->value;
+        ptrhash_table_erase(&h->cur, s);
+    } else if (h->old.slots != NULL && 
+        (s = ptrhash_table_find(&h->old, key)) != NULL) {
+        value = s->value;
+        s->key = PTRHASH_TOMB;
+        s->value = NULL;
+        h->old.count--;
+    } else {
+        return NULL;
+    }
+    ptrhash_migrate(h, PTRHASH_MIGRATE_STEP);
+    return value;
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright 2022 wtcat
+ */
+#ifndef BASE_PTRHASH_H_
+#define BASE_PTRHASH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "base/allocator.h"
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+/*
+ * Open addressing hash table keyed by address (linear probing).
+ *
+ * Growing is incremental: the previous table is kept aside and a few
+ * of its slots are moved on every update, so no single insert pays for
+ * rehashing the whole table. Key 0 and 1 are reserved.
+ */
+struct ptrhash_slot {
+    uintptr_t key;
+    void *value;
+};
+
+struct ptrhash_table {
+    struct ptrhash_slot *slots;
+    size_t mask;
+    size_t count;
+    unsigned int shift;
+};
+
+struct ptrhash {
+    struct ptrhash_table cur;
+    struct ptrhash_table old;
+    size_t migrate_pos;
+    struct mem_allocator *allocator;
+};
+
+void ptrhash_init(struct ptrhash *h, struct mem_allocator *alloc);
+void ptrhash_destroy(struct ptrhash *h);
+int ptrhash_insert(struct ptrhash *h, uintptr_t key, void *value);
+void *ptrhash_find(struct ptrhash *h, uintptr_t key);
+void *ptrhash_remove(struct ptrhash *h, uintptr_t key);
+
+static inline size_t ptrhash_count(const struct ptrhash *h) {
+    return h->cur.count + h->old.count;
+}
+
+static inline size_t ptrhash_memory_size(const struct ptrhash *h) {
+    size_t n = h->cur.slots? h->cur.mask + 1: 0;
+    if (h->old.slots)
+        n += h->old.mask + 1;
+    return n * sizeof(struct ptrhash_slot);
+}
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* BASE_PTRHASH_H_ */
@@ -0,0 +1,103 @@
+/*
+ * Copyright 2022 wtcat
+ */
+#include <stdint.h>
+#include <string.h>
+
+#include "base/redzone.h"
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64)
+#include <emmintrin.h>
+#define REDZONE_SSE2
+#if defined(__GNUC__) || defined(__clang__)
+#include <immintrin.h>
+#define REDZONE_AVX2
+#endif
+#endif
+
+void redzone_fill(void *p, size_t len) {
+    memset(p, REDZONE_PATTERN, len);
+}
+
+static size_t redzone_find(const unsigned char *p, size_t i, size_t len, 
+    unsigned char c) {
+    while (i < len && p[i] == c)
+        i++;
+    return i;
+}
+
+static size_t redzone_check_scalar(const unsigned char *p, size_t i, size_t len, 
+    unsigned char c) {
+    const uint64_t word = UINT64_C(0x0101010101010101) * c;
+    for ( ; i + 32 <= len; i += 32) {
+        uint64_t w[4];
+        memcpy(w, p + i, sizeof(w));
+        if (((w[0] ^ word) | (w[1] ^ word) | 
+            (w[2] ^ word) | (w[3] ^ word)) != 0)
+            return redzone_find(p, i, len, c);
+    }
+    return redzone_find(p, i, len, c);
+}
+
+#if defined(REDZONE_SSE2)
+static size_t redzone_check_sse2(const unsigned char *p, size_t len, 
+    unsigned char c) {
+    const __m128i pat = _mm_set1_epi8((char)c);
+    size_t i = 0;
+    for ( ; i + 64 <= len; i += 64) {
+        __m128i v0 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i)), pat);
+        __m128i v1 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i + 16)), pat);
+        __m128i v2 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i + 32)), pat);
+        __m128i v3 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i + 48)), pat);
+        __m128i all = _mm_and_si128(_mm_and_si128(v0, v1), _mm_and_si128(v2, v3));
+        if (_mm_movemask_epi8(all) != 0xFFFF)
+            return redzone_find(p, i, len, c);
+    }
+    return redzone_check_scalar(p, i, len, c);
+}
+#endif
+
+#if defined(REDZONE_AVX2)
+__attribute__((target("avx2")))
+static size_t redzone_check_avx2(const unsigned char *p, size_t len, 
+    unsigned char c) {
+    const __m256i pat = _mm256_set1_epi8((char)c);
+    size_t i = 0;
+    for ( ; i + 128 <= len; i += 128) {
+        __m256i v0 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(p + i)), pat);
+        __m256i v1 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(p + i + 32)), pat);
+        __m256i v2 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(p + i + 64)), pat);
+        __m256i v3 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(p + i + 96)), pat);
+        __m256i any = _mm256_or_si256(_mm256_or_si256(v0, v1), _mm256_or_si256(v2, v3));
+        if (!_mm256_testz_si256(any, any))
+            return redzone_find(p, i, len, c);
+    }
+    return redzone_check_scalar(p, i, len, c);
+}
+
+static int redzone_has_avx2(void) {
+    static int avx2 = -1;
+    if (avx2 < 0) {
+        __builtin_cpu_init();
+        avx2 = __builtin_cpu_supports("avx2")? 1: 0;
+    }
+    return avx2;
+}
+#endif
+
+size_t redzone_check_pattern(const void *p, size_t len, unsigned char c) {
+    const unsigned char *s = (const unsigned char *)p;
+#if defined(REDZONE_AVX2)
+    if (len >= 128 && redzone_has_avx2())
+        return redzone_check_avx2(s, len, c);
+#endif
+#if defined(REDZONE_SSE2)
+    return redzone_check_sse2(s, len, c);
+#else
+    return redzone_check_scalar(s, 0, len, c);
+#endif
+}
+
+size_t redzone_check(const void *p, size_t len) {
+    return redzone_check_pattern(p, len, REDZONE_PATTERN);
+}
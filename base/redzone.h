@@ -0,0 +1,28 @@
+/*
+ * Copyright 2022 wtcat
+ */
+#ifndef BASE_REDZONE_H_
+#define BASE_REDZONE_H_
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+#define REDZONE_PATTERN 0xFD
+
+void redzone_fill(void *p, size_t len);
+/*
+ * Offset of the first byte of [@p, @p + @len) that is not 
+ * REDZONE_PATTERN, or @len if the zone is intact. Compares 128 bytes 
+ * per step with AVX2 when the CPU has it, else SSE2 or 64-bit words.
+ */
+size_t redzone_check(const void *p, size_t len);
+/* Same as redzone_check() for any fill byte @c */
+size_t redzone_check_pattern(const void *p, size_t len, unsigned char c);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* BASE_REDZONE_H_ */
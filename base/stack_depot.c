@@ -0,0 +1,213 @@
+/*
+ * Copyright 2022 wtcat
+ */
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "base/atomic.h"
+#include "base/mutex.h"
+#include "base/stack_depot.h"
+
+#define DEPOT_HASH_BITS   16
+#define DEPOT_HASH_SIZE   (1u << DEPOT_HASH_BITS)
+#define DEPOT_SLAB_SHIFT  12
+#define DEPOT_SLAB_SIZE   (1u << DEPOT_SLAB_SHIFT)
+#define DEPOT_MAX_SLABS   4096
+#define DEPOT_ARENA_SIZE  (64 * 1024)
+
+struct stack_record {
+    struct stack_record *next;
+    uint64_t hash;
+    stack_id_t id;
+    uint32_t n;
+    void *ip[];
+};
+
+struct stack_arena {
+    struct stack_arena *next;
+    size_t offset;
+    size_t size;
+    char buffer[];
+};
+
+static struct stack_depot {
+    struct stack_record *buckets[DEPOT_HASH_SIZE];
+    struct stack_record **slabs[DEPOT_MAX_SLABS];
+    struct stack_arena *arena;
+    stack_id_t next_id;
+    size_t nframes;
+    size_t ndropped;
+    size_t memory_size;
+    MUTEX_LOCK_DECLARE(lock);
+} depot;
+
+#if defined(_MSC_VER)
+static INIT_ONCE depot_once = INIT_ONCE_STATIC_INIT;
+static BOOL CALLBACK depot_init(PINIT_ONCE once, PVOID param, PVOID *ctx) {
+    (void) once;
+    (void) param;
+    (void) ctx;
+    MUTEX_INIT(&depot);
+    return TRUE;
+}
+#define DEPOT_INIT_ONCE() \
+    InitOnceExecuteOnce(&depot_once, depot_init, NULL, NULL)
+#else
+static once_flag depot_once = ONCE_FLAG_INIT;
+static void depot_init(void) {
+    MUTEX_INIT(&depot);
+}
+#define DEPOT_INIT_ONCE() \
+    call_once(&depot_once, depot_init)
+#endif
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t stack_hash(void *const ip[], size_t n) {
+    uint64_t h = 0x9E3779B97F4A7C15ULL ^ (n * 0xC2B2AE3D27D4EB4FULL);
+    for (size_t i = 0; i < n; i++) {
+        uint64_t k = (uint64_t)(uintptr_t)ip[i];
+        k *= 0x87C37B91114253D5ULL;
+        k = rotl64(k, 31);
+        k *= 0x4CF5AD432745937FULL;
+        h ^= k;
+        h = rotl64(h, 27) * 5 + 0x52DCE729;
+    }
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static struct stack_record *stack_lookup(struct stack_record *head, 
+    uint64_t hash, void *const ip[], size_t n) {
+    for (struct stack_record *r = head; r != NULL; r = ATOMIC_LOAD(&r->next)) {
+        if (r->hash == hash && r->n == n && 
+            !memcmp(r->ip, ip, n * sizeof(void *)))
+            return r;
+    }
+    return NULL;
+}
+
+static void *depot_arena_alloc(size_t size) {
+    struct stack_arena *arena = depot.arena;
+    size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    if (arena == NULL || arena->offset + size > arena->size) {
+        size_t asize = DEPOT_ARENA_SIZE;
+        if (size > asize - sizeof(*arena))
+            asize = size + sizeof(*arena);
+        arena = malloc(asize);
+        if (arena == NULL)
+            return NULL;
+        arena->size = asize - sizeof(*arena);
+        arena->offset = 0;
+        arena->next = depot.arena;
+        depot.arena = arena;
+        depot.memory_size += asize;
+    }
+    void *p = arena->buffer + arena->offset;
+    arena->offset += size;
+    return p;
+}
+
+static struct stack_record **depot_slot(stack_id_t id, bool create) {
+    size_t idx = id >> DEPOT_SLAB_SHIFT;
+    struct stack_record **slab;
+    if (idx >= DEPOT_MAX_SLABS)
+        return NULL;
+    slab = ATOMIC_LOAD(&depot.slabs[idx]);
+    if (slab == NULL && create) {
+        size_t size = DEPOT_SLAB_SIZE * sizeof(struct stack_record *);
+        slab = depot_arena_alloc(size);
+        if (slab == NULL)
+            return NULL;
+        memset(slab, 0, size);
+        ATOMIC_STORE(&depot.slabs[idx], slab);
+    }
+    if (slab == NULL)
+        return NULL;
+    return &slab[id & (DEPOT_SLAB_SIZE - 1)];
+}
+
+stack_id_t stack_depot_put(void *const ip[], size_t n) {
+    struct stack_record **bucket, **slot, *head, *r;
+    uint64_t hash;
+    stack_id_t id = 0;
+
+    if (ip == NULL || n == 0 || n > UINT32_MAX)
+        return 0;
+    hash = stack_hash(ip, n);
+    bucket = &depot.buckets[hash & (DEPOT_HASH_SIZE - 1)];
+    head = ATOMIC_LOAD(bucket);
+    r = stack_lookup(head, hash, ip, n);
+    if (r != NULL)
+        return r->id;
+
+    DEPOT_INIT_ONCE();
+    MUTEX_LOCK(&depot);
+    /* Somebody may have inserted the same path meanwhile */
+    r = stack_lookup(ATOMIC_LOAD(bucket), hash, ip, n);
+    if (r != NULL) {
+        id = r->id;
+        goto _unlock;
+    }
+    slot = depot_slot(depot.next_id + 1, true);
+    r = slot? depot_arena_alloc(sizeof(*r) + n * sizeof(void *)): NULL;
+    if (r == NULL) {
+        depot.ndropped++;
+        goto _unlock;
+    }
+    r->hash = hash;
+    r->n = (uint32_t)n;
+    memcpy(r->ip, ip, n * sizeof(void *));
+    r->id = id = ++depot.next_id;
+    r->next = *bucket;
+    depot.nframes += n;
+    ATOMIC_STORE(slot, r);
+    ATOMIC_STORE(bucket, r);
+_unlock:
+    MUTEX_UNLOCK(&depot);
+    return id;
+}
+
+static struct stack_record *stack_depot_get(stack_id_t id) {
+    struct stack_record **slot;
+    if (id == 0)
+        return NULL;
+    slot = depot_slot(id, false);
+    if (slot == NULL)
+        return NULL;
+    return ATOMIC_LOAD(slot);
+}
+
+int stack_depot_fetch(stack_id_t id, struct ip_array *ips) {
+    struct stack_record *r = stack_depot_get(id);
+    if (r == NULL || ips == NULL)
+        return -ENOENT;
+    ips->ip = r->ip;
+    ips->n = r->n;
+    return 0;
+}
+
+uint64_t stack_depot_hash(stack_id_t id) {
+    struct stack_record *r = stack_depot_get(id);
+    return r? r->hash: 0;
+}
+
+void stack_depot_get_stats(struct stack_depot_stats *stats) {
+    if (stats == NULL)
+        return;
+    DEPOT_INIT_ONCE();
+    MUTEX_LOCK(&depot);
+    stats->nstacks = depot.next_id;
+    stats->nframes = depot.nframes;
+    stats->ndropped = depot.ndropped;
+    stats->memory_size = depot.memory_size + sizeof(depot);
+    MUTEX_UNLOCK(&depot);
+}
@@ -0,0 +1,41 @@
+/*
+ * Copyright 2022 wtcat
+ */
+#ifndef BASE_STACK_DEPOT_H_
+#define BASE_STACK_DEPOT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "base/ipnode.h"
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+/*
+ * Global store of call paths. Every distinct frame array is kept once 
+ * and named by a 32-bit id. Records are never removed, so an id can be 
+ * resolved without taking any lock. Id 0 is never stored, it names the 
+ * paths that could not be captured or kept.
+ */
+typedef uint32_t stack_id_t;
+
+#define STACK_DEPOT_UNKNOWN 0
+
+struct stack_depot_stats {
+    size_t nstacks;
+    size_t nframes;
+    size_t memory_size;
+    size_t ndropped;    /* Paths not stored for lack of memory */
+};
+
+stack_id_t stack_depot_put(void *const ip[], size_t n);
+int stack_depot_fetch(stack_id_t id, struct ip_array *ips);
+uint64_t stack_depot_hash(stack_id_t id);
+void stack_depot_get_stats(struct stack_depot_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* BASE_STACK_DEPOT_H_ */
@@ -13,12 +13,14 @@ extern "C"{
 #if defined(__GNUC__) || defined(__clang__)
 #define __unused __attribute__((unsed))
 #define __pure  __attribute__((pure))
+#define __nosanitize __attribute__((no_sanitize_address))
 #define likely(_exp)   __builtin_expect(( _exp ), 1)
 #define unlikely(_exp) __builtin_expect(( _exp ), 0)
 #else
 
 #define __unused
 #define __pure
+#define __nosanitize
 #define likely(_exp)   (_exp)
 #define unlikely(_exp) (_exp)
 #endif //defined(__GNUC__) || defined(__clang__)
@@ -0,0 +1,131 @@
+/*
+ * Copyright 2022 wtcat
+ */
+
+/*
+ * Global operator new/delete for libmtrace_preload.so. Blocks are tagged 
+ * new or new[], releasing them with the other form or with free() (and 
+ * malloc blocks with delete) is reported with both paths. Sized delete 
+ * checks the size the block was traced with. Like the malloc wrappers, 
+ * the operator and traced_new() frames are left out of the paths.
+ */
+#include <cstddef>
+#include <new>
+
+#include "preload/mtrace_preload.h"
+
+namespace {
+
+void *traced_new(std::size_t size, std::size_t align, mem_alloc_family family) {
+    for ( ; ; ) {
+        void *ptr = mtrace_preload_alloc(size? size: 1, align, family);
+        if (ptr != nullptr)
+            return ptr;
+        std::new_handler handler = std::get_new_handler();
+        if (handler == nullptr)
+            throw std::bad_alloc();
+        handler();
+    }
+}
+
+void *traced_new_nothrow(std::size_t size, std::size_t align, 
+    mem_alloc_family family) noexcept {
+    try {
+        return traced_new(size, align, family);
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+inline void traced_delete(void *ptr, mem_alloc_family family, 
+    std::size_t size = 0, std::size_t align = 0) noexcept {
+    mtrace_preload_free(ptr, family, size, align);
+}
+
+} // namespace
+
+void *operator new(std::size_t size) {
+    return traced_new(size, 0, MEM_ALLOC_NEW);
+}
+
+void *operator new[](std::size_t size) {
+    return traced_new(size, 0, MEM_ALLOC_NEW_ARRAY);
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept {
+    return traced_new_nothrow(size, 0, MEM_ALLOC_NEW);
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept {
+    return traced_new_nothrow(size, 0, MEM_ALLOC_NEW_ARRAY);
+}
+
+void *operator new(std::size_t size, std::align_val_t align) {
+    return traced_new(size, static_cast<std::size_t>(align), MEM_ALLOC_NEW);
+}
+
+void *operator new[](std::size_t size, std::align_val_t align) {
+    return traced_new(size, static_cast<std::size_t>(align), MEM_ALLOC_NEW_ARRAY);
+}
+
+void *operator new(std::size_t size, std::align_val_t align, 
+    const std::nothrow_t &) noexcept {
+    return traced_new_nothrow(size, static_cast<std::size_t>(align), MEM_ALLOC_NEW);
+}
+
+void *operator new[](std::size_t size, std::align_val_t align, 
+    const std::nothrow_t &) noexcept {
+    return traced_new_nothrow(size, static_cast<std::size_t>(align), 
+        MEM_ALLOC_NEW_ARRAY);
+}
+
+void operator delete(void *ptr) noexcept {
+    traced_delete(ptr, MEM_ALLOC_NEW);
+}
+
+void operator delete[](void *ptr) noexcept {
+    traced_delete(ptr, MEM_ALLOC_NEW_ARRAY);
+}
+
+void operator delete(void *ptr, const std::nothrow_t &) noexcept {
+    traced_delete(ptr, MEM_ALLOC_NEW);
+}
+
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept {
+    traced_delete(ptr, MEM_ALLOC_NEW_ARRAY);
+}
+
+void operator delete(void *ptr, std::size_t size) noexcept {
+    traced_delete(ptr, MEM_ALLOC_NEW, size? size: 1);
+}
+
+void operator delete[](void *ptr, std::size_t size) noexcept {
+    traced_delete(ptr, MEM_ALLOC_NEW_ARRAY, size? size: 1);
+}
+
+void operator delete(void *ptr, std::align_val_t align) noexcept {
+    traced_delete(ptr, MEM_ALLOC_NEW, 0, static_cast<std::size_t>(align));
+}
+
+void operator delete[](void *ptr, std::align_val_t align) noexcept {
+    traced_delete(ptr, MEM_ALLOC_NEW_ARRAY, 0, static_cast<std::size_t>(align));
+}
+
+void operator delete(void *ptr, std::align_val_t align, 
+    const std::nothrow_t &) noexcept {
+    traced_delete(ptr, MEM_ALLOC_NEW, 0, static_cast<std::size_t>(align));
+}
+
+void operator delete[](void *ptr, std::align_val_t align, 
+    const std::nothrow_t &) noexcept {
+    traced_delete(ptr, MEM_ALLOC_NEW_ARRAY, 0, static_cast<std::size_t>(align));
+}
+
+void operator delete(void *ptr, std::size_t size, std::align_val_t align) noexcept {
+    traced_delete(ptr, MEM_ALLOC_NEW, size? size: 1, static_cast<std::size_t>(align));
+}
+
+void operator delete[](void *ptr, std::size_t size, std::align_val_t align) noexcept {
+    traced_delete(ptr, MEM_ALLOC_NEW_ARRAY, size? size: 1, 
+        static_cast<std::size_t>(align));
+}
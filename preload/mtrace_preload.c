@@ -0,0 +1,423 @@
+/*
+ * Copyright 2022 wtcat
+ */
+
+/*
+ * Heap tracing of unmodified programs:
+ *
+ *   LD_PRELOAD=libmtrace_preload.so program
+ *
+ * Environment:
+ *   MTRACE_OPTIONS  Tracer option bits (tracer/mem_tracer.h), MEM_SHARDED 
+ *                   by default
+ *   MTRACE_SAMPLE   Mean sample interval in bytes, enables MEM_SAMPLE_BYTES
+ *   MTRACE_DUMP     Dumped at exit: sorted, sequence, raw, folded, peak, 
+ *                   lifetime or leaks (sorted by default), none to disable
+ *   MTRACE_OUTPUT   Dump file, stderr by default
+ *
+ * Every traced block carries a header in front of the user pointer, so 
+ * blocks that the libc handed out directly (before the tracer was up or 
+ * from inside the tracer) are told apart and returned to the libc. 
+ * Calls made by the tracer itself go straight to the libc.
+ */
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "base/allocator.h"
+#include "base/printer.h"
+#include "tracer/mem_tracer.h"
+#include "preload/mtrace_preload.h"
+
+#define PRELOAD_EXPORT __attribute__((visibility("default")))
+#define PRELOAD_TLS __thread __attribute__((tls_model("initial-exec")))
+
+#define PRELOAD_MAGIC UINT64_C(0x6D74726163650A5A)
+#define PRELOAD_ALIGN 16
+#define PRELOAD_ARENA_SIZE (64 * 1024)
+
+/*
+ * Right below the user pointer, keeps it 16 byte aligned. The libc free 
+ * lists take up to four words of a freed chunk (fd/bk and, for large 
+ * chunks, the nextsize links), the reserved ones keep them off the check 
+ * so that a second free is still known.
+ */
+struct preload_hdr {
+    void *reserved[4];
+    uint32_t offset;    /* User pointer - traced block */
+    uint32_t check;     /* preload_check() of the user pointer */
+    size_t size;
+};
+
+enum preload_state {
+    PRELOAD_IDLE,
+    PRELOAD_READY,
+};
+
+struct libc_funcs {
+    void *(*malloc)(size_t size);
+    void (*free)(void *ptr);
+    void *(*calloc)(size_t n, size_t size);
+    void *(*realloc)(void *ptr, size_t size);
+    int (*posix_memalign)(void **pptr, size_t align, size_t size);
+    size_t (*malloc_usable_size)(void *ptr);
+};
+
+static MTRACER_DEFINE(preload_context);
+static struct libc_funcs libc;
+static struct printer preload_printer;
+static FILE *preload_output;
+static int preload_dump = MEM_DUMP_SORTED;
+static int preload_state;
+static pthread_once_t preload_once = PTHREAD_ONCE_INIT;
+static PRELOAD_TLS int preload_busy;
+
+/* Serves dlsym() before the libc functions are known, never freed */
+static char preload_arena[PRELOAD_ARENA_SIZE] __attribute__((aligned(PRELOAD_ALIGN)));
+static size_t preload_arena_used;
+
+static void *arena_alloc(size_t size) {
+    size_t *p;
+    size_t need = (sizeof(size_t) * 2 + size + PRELOAD_ALIGN - 1) & 
+        ~(size_t)(PRELOAD_ALIGN - 1);
+    size_t ofs = __atomic_fetch_add(&preload_arena_used, need, __ATOMIC_RELAXED);
+    if (ofs + need > sizeof(preload_arena))
+        return NULL;
+    p = (size_t *)(preload_arena + ofs);
+    p[1] = size;
+    return p + 2;
+}
+
+static inline bool arena_owns(const void *ptr) {
+    return (const char *)ptr >= preload_arena && 
+        (const char *)ptr < preload_arena + sizeof(preload_arena);
+}
+
+static inline size_t arena_size(const void *ptr) {
+    return ((const size_t *)ptr)[-1];
+}
+
+static void *libc_alloc(struct mem_allocator *m, size_t size, void *user) {
+    (void) m;
+    (void) user;
+    return libc.malloc(size);
+}
+
+static void libc_free(struct mem_allocator *m, void *ptr, void *user) {
+    (void) m;
+    (void) user;
+    libc.free(ptr);
+}
+
+static struct mem_allocator libc_allocator = {
+    .allocate = libc_alloc,
+    .free = libc_free
+};
+
+static const char *const dump_names[] = {
+    [MEM_DUMP_SORTED]   = "sorted",
+    [MEM_DUMP_SEQUENCE] = "sequence",
+    [MEM_DUMP_RAW]      = "raw",
+    [MEM_DUMP_FOLDED]   = "folded",
+    [MEM_DUMP_PEAK]     = "peak",
+    [MEM_DUMP_LIFETIME] = "lifetime",
+    [MEM_DUMP_LEAKS]    = "leaks",
+};
+
+static int preload_dump_type(const char *name) {
+    if (name == NULL)
+        return MEM_DUMP_SORTED;
+    for (size_t i = 0; i < sizeof(dump_names) / sizeof(dump_names[0]); i++) {
+        if (dump_names[i] && !strcasecmp(name, dump_names[i]))
+            return (int)i;
+    }
+    return -1;
+}
+
+static void preload_resolve(void) {
+    libc.malloc = dlsym(RTLD_NEXT, "malloc");
+    libc.free = dlsym(RTLD_NEXT, "free");
+    libc.calloc = dlsym(RTLD_NEXT, "calloc");
+    libc.realloc = dlsym(RTLD_NEXT, "realloc");
+    libc.posix_memalign = dlsym(RTLD_NEXT, "posix_memalign");
+    libc.malloc_usable_size = dlsym(RTLD_NEXT, "malloc_usable_size");
+}
+
+/* Runs with preload_busy set, the tracer's own allocations go to the libc */
+static void preload_init(void) {
+    const char *env;
+    unsigned int options = MEM_SHARDED;
+
+    preload_resolve();
+    if (libc.malloc == NULL || libc.free == NULL || libc.posix_memalign == NULL)
+        return;
+    env = getenv("MTRACE_OPTIONS");
+    if (env != NULL)
+        options = (unsigned int)strtoul(env, NULL, 0);
+    env = getenv("MTRACE_SAMPLE");
+    if (env != NULL)
+        options |= MEM_SAMPLE_BYTES;
+    preload_dump = preload_dump_type(getenv("MTRACE_DUMP"));
+    mem_tracer_init(preload_context, &libc_allocator, options);
+    /* The interposers and the tracer itself are not part of the paths */
+    mem_tracer_set_path_skip(preload_context, (const void *)preload_init);
+    if (env != NULL)
+        mem_tracer_set_sample_interval(preload_context, strtoul(env, NULL, 0));
+    env = getenv("MTRACE_OUTPUT");
+    if (env != NULL)
+        preload_output = fopen(env, "w");
+    fprintf_printer_init(&preload_printer, preload_output? preload_output: stderr);
+    mem_tracer_set_printer(preload_context, &preload_printer);
+    if (preload_output != NULL)
+        mem_tracer_set_guard_fd(preload_context, fileno(preload_output));
+    __atomic_store_n(&preload_state, PRELOAD_READY, __ATOMIC_RELEASE);
+}
+
+/* True when the call must be traced, false to go to the libc directly */
+static inline bool preload_enter(void) {
+    if (preload_busy)
+        return false;
+    if (__atomic_load_n(&preload_state, __ATOMIC_ACQUIRE) != PRELOAD_READY) {
+        preload_busy = 1;
+        pthread_once(&preload_once, preload_init);
+        preload_busy = 0;
+        if (__atomic_load_n(&preload_state, __ATOMIC_ACQUIRE) != PRELOAD_READY)
+            return false;
+    }
+    preload_busy = 1;
+    return true;
+}
+
+static inline void preload_leave(void) {
+    preload_busy = 0;
+}
+
+static inline uint32_t preload_check(const void *ptr, uint32_t offset, 
+    size_t size) {
+    uint64_t v = (PRELOAD_MAGIC ^ (uintptr_t)ptr ^ size) + offset;
+    return (uint32_t)((v * UINT64_C(0x9E3779B97F4A7C15)) >> 32);
+}
+
+/* 
+ * The libc chunk header sits below its blocks, so reading in front of 
+ * any heap pointer is safe. A false match needs that header to hash to 
+ * the pointer.
+ */
+static inline struct preload_hdr *preload_header(void *ptr) {
+    struct preload_hdr *hdr = (struct preload_hdr *)ptr - 1;
+    if (hdr->check == preload_check(ptr, hdr->offset, hdr->size))
+        return hdr;
+    return NULL;
+}
+
+/*
+ * Traced block already released: its check was flipped by traced_free(), 
+ * or the tracer poisoned the header (MEM_QUARANTINE). Like preload_header() 
+ * only the words past the reserved ones are read. Blocks big enough to be 
+ * unmapped by the libc or reused since are not recognised.
+ */
+static bool preload_released(void *ptr) {
+    struct preload_hdr *hdr = (struct preload_hdr *)ptr - 1;
+    const unsigned char *p = (const unsigned char *)&hdr->offset;
+    if (hdr->check == ~preload_check(ptr, hdr->offset, hdr->size))
+        return true;
+    for (size_t i = 0; i < (size_t)((const unsigned char *)ptr - p); i++) {
+        if (p[i] != MEM_QUARANTINE_PATTERN)
+            return false;
+    }
+    return true;
+}
+
+/* Called between preload_enter() and preload_leave() */
+static void *traced_alloc(size_t size, size_t align, enum mem_alloc_family family) {
+    size_t pad = align > PRELOAD_ALIGN? align: 0;
+    size_t total = sizeof(struct preload_hdr) + pad + size;
+    struct preload_hdr *hdr;
+    char *base, *user;
+    if (total < size || pad > (1u << 30))
+        return NULL;
+    base = mem_tracer_alloc_as(preload_context, total, family);
+    if (base == NULL)
+        return NULL;
+    user = base + sizeof(struct preload_hdr);
+    if (pad)
+        user = (char *)(((uintptr_t)user + align - 1) & ~(uintptr_t)(align - 1));
+    hdr = (struct preload_hdr *)user - 1;
+    hdr->offset = (uint32_t)(user - base);
+    hdr->size = size;
+    hdr->check = preload_check(user, hdr->offset, size);
+    return user;
+}
+
+/* A non zero @size is checked against the size the block was traced with */
+static void traced_free(void *ptr, struct preload_hdr *hdr, 
+    enum mem_alloc_family family, size_t size) {
+    char *base = (char *)ptr - hdr->offset;
+    hdr->check = ~hdr->check;
+    mem_tracer_free_as(preload_context, base, family, size);
+}
+
+static void *fallback_alloc(size_t size, size_t align) {
+    void *ptr = NULL;
+    if (libc.posix_memalign == NULL)
+        return arena_alloc(size);
+    if (align <= PRELOAD_ALIGN)
+        return libc.malloc(size);
+    return libc.posix_memalign(&ptr, align, size)? NULL: ptr;
+}
+
+void *mtrace_preload_alloc(size_t size, size_t align, 
+    enum mem_alloc_family family) {
+    void *ptr;
+    if (!preload_enter())
+        return fallback_alloc(size, align);
+    ptr = traced_alloc(size, align, family);
+    preload_leave();
+    if (ptr == NULL)
+        errno = ENOMEM;
+    return ptr;
+}
+
+PRELOAD_EXPORT void *malloc(size_t size) {
+    return mtrace_preload_alloc(size, 0, MEM_ALLOC_MALLOC);
+}
+
+void mtrace_preload_free(void *ptr, enum mem_alloc_family family, 
+    size_t size, size_t align) {
+    struct preload_hdr *hdr;
+    int busy;
+    if (ptr == NULL || arena_owns(ptr))
+        return;
+    hdr = preload_header(ptr);
+    if (hdr == NULL) {
+        if (!preload_released(ptr)) {
+            libc.free(ptr);
+        } else if (preload_enter()) {
+            mem_tracer_report_invalid(preload_context, ptr);
+            preload_leave();
+        }
+        return;
+    }
+    if (size != 0)
+        size += sizeof(struct preload_hdr) + (align > PRELOAD_ALIGN? align: 0);
+    /* A traced block goes back through the tracer even from inside it */
+    busy = preload_busy;
+    preload_busy = 1;
+    traced_free(ptr, hdr, family, size);
+    preload_busy = busy;
+}
+
+PRELOAD_EXPORT void free(void *ptr) {
+    mtrace_preload_free(ptr, MEM_ALLOC_MALLOC, 0, 0);
+}
+
+PRELOAD_EXPORT void *calloc(size_t n, size_t size) {
+    size_t total;
+    void *ptr;
+    if (__builtin_mul_overflow(n, size, &total)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (preload_busy && libc.calloc != NULL)
+        return libc.calloc(n, size);
+    ptr = mtrace_preload_alloc(total, 0, MEM_ALLOC_MALLOC);
+    /* Arena memory is zero and never reused */
+    if (ptr != NULL && !arena_owns(ptr))
+        memset(ptr, 0, total);
+    return ptr;
+}
+
+static size_t preload_usable_size(void *ptr) {
+    struct preload_hdr *hdr;
+    if (ptr == NULL)
+        return 0;
+    if (arena_owns(ptr))
+        return arena_size(ptr);
+    hdr = preload_header(ptr);
+    if (hdr != NULL)
+        return hdr->size;
+    if (preload_released(ptr))
+        return 0;
+    return libc.malloc_usable_size? libc.malloc_usable_size(ptr): 0;
+}
+
+PRELOAD_EXPORT void *realloc(void *ptr, size_t size) {
+    void *nptr;
+    size_t old;
+    if (ptr == NULL)
+        return malloc(size);
+    if (size == 0) {
+        free(ptr);
+        return NULL;
+    }
+    if (!arena_owns(ptr) && preload_header(ptr) == NULL) {
+        if (preload_released(ptr)) {
+            free(ptr);
+            errno = ENOMEM;
+            return NULL;
+        }
+        if (preload_busy)
+            return libc.realloc(ptr, size);
+    }
+    old = preload_usable_size(ptr);
+    nptr = malloc(size);
+    if (nptr == NULL)
+        return NULL;
+    memcpy(nptr, ptr, old < size? old: size);
+    free(ptr);
+    return nptr;
+}
+
+static inline bool preload_valid_align(size_t align) {
+    return align != 0 && (align & (align - 1)) == 0;
+}
+
+PRELOAD_EXPORT int posix_memalign(void **pptr, size_t align, size_t size) {
+    void *ptr;
+    if (!preload_valid_align(align) || align % sizeof(void *) != 0)
+        return EINVAL;
+    ptr = mtrace_preload_alloc(size, align, MEM_ALLOC_MALLOC);
+    if (ptr == NULL)
+        return ENOMEM;
+    *pptr = ptr;
+    return 0;
+}
+
+PRELOAD_EXPORT void *aligned_alloc(size_t align, size_t size) {
+    if (!preload_valid_align(align)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return mtrace_preload_alloc(size, align, MEM_ALLOC_MALLOC);
+}
+
+PRELOAD_EXPORT void *memalign(size_t align, size_t size) {
+    if (!preload_valid_align(align)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return mtrace_preload_alloc(size, align, MEM_ALLOC_MALLOC);
+}
+
+PRELOAD_EXPORT size_t malloc_usable_size(void *ptr) {
+    return preload_usable_size(ptr);
+}
+
+__attribute__((destructor))
+static void preload_exit(void) {
+    if (__atomic_load_n(&preload_state, __ATOMIC_ACQUIRE) != PRELOAD_READY)
+        return;
+    preload_busy = 1;
+    if (preload_dump >= 0)
+        mem_tracer_dump(preload_context, (enum mem_dumper)preload_dump);
+    if (preload_output != NULL)
+        fflush(preload_output);
+    preload_busy = 0;
+}
@@ -0,0 +1,24 @@
+/*
+ * Copyright 2022 wtcat
+ */
+#ifndef PRELOAD_MTRACE_PRELOAD_H_
+#define PRELOAD_MTRACE_PRELOAD_H_
+
+#include <stddef.h>
+#include "tracer/mem_tracer.h"
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+/* Shared by malloc() and the operator new/delete hooks (mtrace_new.cpp) */
+void *mtrace_preload_alloc(size_t size, size_t align, 
+    enum mem_alloc_family family);
+/* @size is the sized delete size, zero when unknown */
+void mtrace_preload_free(void *ptr, enum mem_alloc_family family, 
+    size_t size, size_t align);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* PRELOAD_MTRACE_PRELOAD_H_ */
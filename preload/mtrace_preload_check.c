@@ -0,0 +1,88 @@
+/*
+ * Copyright 2022 wtcat
+ */
+
+/*
+ * Released traced blocks under libmtrace_preload.so: a double free, a
+ * free of a quarantined block and a realloc of a freed pointer must be
+ * reported as invalid frees and never reach the libc.
+ *
+ *   MTRACE_OPTIONS=0x806 MTRACE_OUTPUT=report LD_PRELOAD=... mtrace_preload_check
+ *
+ * MEM_CHECK_INVALID is required, the reports are counted in MTRACE_OUTPUT.
+ */
+#define _GNU_SOURCE
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CHECK_REPORT "Free invalid pointer"
+
+static int check_failed;
+
+#define CHECK(_cond) do { \
+    if (!(_cond)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #_cond); \
+        check_failed = 1; \
+    } \
+} while (0)
+
+/* Not inlined, the compiler must not see the second free */
+static __attribute__((noinline)) void check_release(void *ptr) {
+    free(ptr);
+}
+
+static int check_count_reports(const char *file) {
+    char line[1024];
+    int n = 0;
+    FILE *fp;
+
+    /* The tracer writes MTRACE_OUTPUT through this process' stdio */
+    fflush(NULL);
+    fp = fopen(file, "r");
+    if (fp == NULL)
+        return -1;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (strstr(line, CHECK_REPORT) != NULL)
+            n++;
+    }
+    fclose(fp);
+    return n;
+}
+
+int main(void) {
+    /* Small blocks go to the tcache, large ones to the unsorted bin */
+    static const size_t sizes[] = {64, 2000};
+    const char *output = getenv("MTRACE_OUTPUT");
+    int expected = 0;
+    char *ptr;
+
+    if (getenv("LD_PRELOAD") == NULL || output == NULL) {
+        fprintf(stderr, "run with LD_PRELOAD=libmtrace_preload.so and MTRACE_OUTPUT\n");
+        return 2;
+    }
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        ptr = malloc(sizes[i]);
+        CHECK(ptr != NULL);
+        memset(ptr, 0x5A, sizes[i]);
+        check_release(ptr);
+        check_release(ptr);
+        expected++;
+    }
+    ptr = malloc(64);
+    CHECK(ptr != NULL);
+    check_release(ptr);
+    CHECK(malloc_usable_size(ptr) == 0);
+    ptr = realloc(ptr, 128);
+    CHECK(ptr == NULL);
+    expected++;
+    /* The heap is still usable */
+    ptr = malloc(32);
+    CHECK(ptr != NULL);
+    free(ptr);
+    CHECK(check_count_reports(output) == expected);
+    if (!check_failed)
+        printf("%d released blocks reported\n", expected);
+    return check_failed;
+}
@@ -0,0 +1,139 @@
+/*
+ * Copyright 2022 wtcat
+ */
+
+/*
+ * Address index cost: rbtree against the ptrhash (MEM_INDEX_HASH).
+ *
+ * usage: mtrace_bench_index [live-blocks] [cycles]
+ *
+ * The index is filled with shuffled heap-like addresses, then each
+ * cycle does what a free followed by an allocation at the same address
+ * does to the index: find, remove and add back.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "base/utils.h"
+#include "tracer/tracer_core.h"
+
+struct bench_node {
+    struct record_node base;
+    void *ptr;
+};
+
+static rbtree_compare_result bench_compare(const rbtree_node *a,
+    const rbtree_node *b) {
+    const struct bench_node *l = CONTAINER_OF(a, struct bench_node, base.node);
+    const struct bench_node *r = CONTAINER_OF(b, struct bench_node, base.node);
+    return (l->ptr > r->ptr) - (l->ptr < r->ptr);
+}
+
+static uintptr_t bench_key(const struct record_node *node) {
+    return (uintptr_t)CONTAINER_OF(node, struct bench_node, base)->ptr;
+}
+
+static void *bench_alloc(struct mem_allocator *m, size_t size, void *user) {
+    (void) m;
+    (void) user;
+    return malloc(size);
+}
+
+static void bench_free(struct mem_allocator *m, void *ptr, void *user) {
+    (void) m;
+    (void) user;
+    free(ptr);
+}
+
+static struct mem_allocator bench_allocator = {
+    .allocate = bench_alloc,
+    .free = bench_free
+};
+
+static double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static unsigned long bench_rand(unsigned long long *seed) {
+    *seed = *seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (unsigned long)(*seed >> 33);
+}
+
+static int bench_run(struct bench_node *nodes, size_t n, size_t cycles,
+    bool hashed) {
+    struct record_class rc;
+    unsigned long long seed = 1;
+    size_t missed = 0;
+    double t0, t1, t2;
+
+    memset(&rc, 0, sizeof(rc));
+    INIT_LIST_HEAD(&rc.head);
+    rc.tree.compare = bench_compare;
+    rc.allocator = &bench_allocator;
+    ptrhash_init(&rc.hash.map, &bench_allocator);
+    if (hashed)
+        rc.hash.key = bench_key;
+
+    t0 = bench_now();
+    for (size_t i = 0; i < n; i++) {
+        if (core_record_add(&rc, &nodes[i].base))
+            return -1;
+    }
+    t1 = bench_now();
+    for (size_t i = 0; i < cycles; i++) {
+        struct bench_node *node = &nodes[bench_rand(&seed) % n];
+        struct bench_node key = { .ptr = node->ptr };
+        struct record_node *found = core_record_find(&rc, &key.base);
+        if (found != &node->base) {
+            missed++;
+            continue;
+        }
+        core_record_remove(&rc, found);
+        core_record_add(&rc, found);
+    }
+    t2 = bench_now();
+    printf("%-6s %9zu blocks: add %6.0f ns, find+remove+add %6.0f ns\n",
+        hashed? "hash": "rbtree", n, (t1 - t0) / n, (t2 - t1) / cycles);
+    ptrhash_destroy(&rc.hash.map);
+    return missed? -1: 0;
+}
+
+int main(int argc, char *argv[]) {
+    size_t n = argc > 1? strtoul(argv[1], NULL, 0): 1000000;
+    size_t cycles = argc > 2? strtoul(argv[2], NULL, 0): 2000000;
+    unsigned long long seed = 1;
+    struct bench_node *nodes;
+    int err = 0;
+
+    if (n == 0 || cycles == 0) {
+        fprintf(stderr, "usage: %s [live-blocks] [cycles]\n", argv[0]);
+        return 1;
+    }
+    nodes = calloc(n, sizeof(*nodes));
+    if (nodes == NULL)
+        return 1;
+    /* 48 byte spaced blocks with some jitter, in random order */
+    for (size_t i = 0; i < n; i++)
+        nodes[i].ptr = (void *)(0x10000000000ul + i * 48 + (bench_rand(&seed) % 3) * 16);
+    for (size_t i = n; i > 1; i--) {
+        size_t j = bench_rand(&seed) % i;
+        void *p = nodes[i - 1].ptr;
+        nodes[i - 1].ptr = nodes[j].ptr;
+        nodes[j].ptr = p;
+    }
+    for (int hashed = 0; hashed < 2 && !err; hashed++) {
+        for (size_t i = 0; i < n; i++) {
+            memset(&nodes[i].base, 0, sizeof(nodes[i].base));
+            rbtree_set_off_tree(&nodes[i].base.node);
+        }
+        err = bench_run(nodes, n, cycles, hashed);
+    }
+    free(nodes);
+    if (err)
+        fprintf(stderr, "index lost a block\n");
+    return err? 1: 0;
+}
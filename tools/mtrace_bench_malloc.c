@@ -0,0 +1,76 @@
+/*
+ * Copyright 2022 wtcat
+ */
+
+/*
+ * malloc/free pair cost, run once as is and once under the interposer
+ * to get its overhead:
+ *
+ *   mtrace_bench_malloc [threads] [pairs]
+ *   MTRACE_DUMP=none LD_PRELOAD=libmtrace_preload.so mtrace_bench_malloc
+ *
+ * Each thread keeps 64 live blocks of 16..527 bytes and replaces a
+ * random one per pair.
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_SLOTS 64
+#define BENCH_MAX_THREADS 64
+
+struct bench_thread {
+    pthread_t thread;
+    size_t pairs;
+    unsigned int seed;
+};
+
+static double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void *bench_worker(void *arg) {
+    struct bench_thread *bt = (struct bench_thread *)arg;
+    void *slots[BENCH_SLOTS] = {NULL};
+    for (size_t i = 0; i < bt->pairs; i++) {
+        int k = rand_r(&bt->seed) % BENCH_SLOTS;
+        free(slots[k]);
+        slots[k] = malloc(16 + rand_r(&bt->seed) % 512);
+        if (slots[k] != NULL)
+            memset(slots[k], 0, 16);
+    }
+    for (int k = 0; k < BENCH_SLOTS; k++)
+        free(slots[k]);
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    int nthreads = argc > 1? atoi(argv[1]): 1;
+    size_t pairs = argc > 2? strtoul(argv[2], NULL, 0): 500000;
+    struct bench_thread threads[BENCH_MAX_THREADS];
+    double t0, t1;
+
+    if (nthreads <= 0 || nthreads > BENCH_MAX_THREADS || pairs == 0) {
+        fprintf(stderr, "usage: %s [threads(1-%d)] [pairs]\n", argv[0],
+            BENCH_MAX_THREADS);
+        return 1;
+    }
+    t0 = bench_now();
+    for (int i = 0; i < nthreads; i++) {
+        threads[i].pairs = pairs;
+        threads[i].seed = (unsigned int)i + 1;
+        if (pthread_create(&threads[i].thread, NULL, bench_worker, &threads[i])) {
+            nthreads = i;
+            break;
+        }
+    }
+    for (int i = 0; i < nthreads; i++)
+        pthread_join(threads[i].thread, NULL);
+    t1 = bench_now();
+    printf("%d thread(s): %.0f ns per malloc+free pair\n", nthreads, (t1 - t0) / pairs);
+    return 0;
+}
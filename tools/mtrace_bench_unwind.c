@@ -0,0 +1,78 @@
+/*
+ * Copyright 2022 wtcat
+ */
+
+/*
+ * Capture cost of the backtrace implementations.
+ *
+ * usage: mtrace_bench_unwind [captures]
+ *
+ * Each backtrace_class captures the same call chains of about 8, 32 and
+ * 64 frames, the frames it actually kept are printed next to the cost.
+ * Only the capture is timed, no symbol is resolved.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "base/backtrace.h"
+
+static const char *const bench_names[] = {
+    [FAST_BACKTRACE]         = "FAST",
+    [UNWIND_BACKTRACE]       = "UNWIND",
+    [FRAMEPOINTER_BACKTRACE] = "FRAMEPOINTER",
+};
+
+static size_t bench_frames;
+
+static void bench_callback(const struct backtrace_entry *entry, void *user) {
+    (void) user;
+    bench_frames = entry->n;
+}
+
+static struct backtrace_callbacks bench_callbacks = {
+    .callback = bench_callback
+};
+
+static double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Recurses @depth times, then returns ns per capture */
+static __attribute__((noinline)) double bench_capture(struct backtrace_class *cls,
+    int depth, size_t captures) {
+    double t0, ns;
+    if (depth > 0) {
+        ns = bench_capture(cls, depth - 1, captures);
+        __asm__ volatile("" ::: "memory");
+        return ns;
+    }
+    t0 = bench_now();
+    for (size_t i = 0; i < captures; i++)
+        backtrace_extract_path(cls, &bench_callbacks, NULL);
+    return (bench_now() - t0) / captures;
+}
+
+int main(int argc, char *argv[]) {
+    static const int depths[] = {8, 32, 64};
+    size_t captures = argc > 1? strtoul(argv[1], NULL, 0): 20000;
+    struct backtrace_class cls;
+
+    if (captures == 0) {
+        fprintf(stderr, "usage: %s [captures]\n", argv[0]);
+        return 1;
+    }
+    for (int type = FAST_BACKTRACE; type <= FRAMEPOINTER_BACKTRACE; type++) {
+        backtrace_init(type, &cls);
+        for (size_t i = 0; i < sizeof(depths) / sizeof(depths[0]); i++) {
+            /* main() and the libc start code make up the rest */
+            double ns = bench_capture(&cls, depths[i] - 4, captures);
+            printf("%-12s depth %2d: %8.0f ns (%zu frames)\n",
+                bench_names[type], depths[i], ns, bench_frames);
+        }
+        backtrace_deinit(&cls);
+    }
+    return 0;
+}
@@ -0,0 +1,204 @@
+/*
+ * Copyright 2022 wtcat
+ */
+
+/*
+ * Rebuild the heap from an event stream (mem_tracer_event_open).
+ *
+ * usage: mtrace_events [-t nanoseconds] event-file
+ *
+ * Events are replayed in timestamp order up to the given time (the end
+ * of the stream by default), the live blocks are then summed per stack
+ * id. Stack ids can be resolved with a MEM_DUMP_RAW dump of the same run.
+ * Blocks the tracer did not sample have no stack id and are only counted.
+ */
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "base/ptrhash.h"
+#include "tracer/mem_event.h"
+
+struct stack_sum {
+    uint32_t stack_id;
+    uint64_t bytes;
+    uint64_t count;
+};
+
+static void *heap_alloc(struct mem_allocator *m, size_t size, void *user) {
+    (void) m;
+    (void) user;
+    return malloc(size);
+}
+
+static void heap_free(struct mem_allocator *m, void *ptr, void *user) {
+    (void) m;
+    (void) user;
+    free(ptr);
+}
+
+static struct mem_allocator heap_allocator = {
+    .allocate = heap_alloc,
+    .free = heap_free
+};
+
+static int event_compare(const void *a, const void *b) {
+    const struct mem_event *e1 = (const struct mem_event *)a;
+    const struct mem_event *e2 = (const struct mem_event *)b;
+    if (e1->timestamp != e2->timestamp)
+        return e1->timestamp < e2->timestamp? -1: 1;
+    /* A free and an allocation with the same stamp: free first */
+    return (int)mem_event_op(e2) - (int)mem_event_op(e1);
+}
+
+static int sum_compare(const void *a, const void *b) {
+    const struct stack_sum *s1 = (const struct stack_sum *)a;
+    const struct stack_sum *s2 = (const struct stack_sum *)b;
+    if (s1->bytes != s2->bytes)
+        return s1->bytes < s2->bytes? 1: -1;
+    return 0;
+}
+
+static int sum_id_compare(const void *a, const void *b) {
+    const struct stack_sum *s1 = (const struct stack_sum *)a;
+    const struct stack_sum *s2 = (const struct stack_sum *)b;
+    return s1->stack_id < s2->stack_id? -1: s1->stack_id > s2->stack_id;
+}
+
+static struct mem_event *events_load(FILE *fp, size_t *count) {
+    struct mem_event_header hdr;
+    struct mem_event *events = NULL;
+    size_t n = 0, cap = 0;
+
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 || hdr.magic != MEM_EVENT_MAGIC ||
+        hdr.version == 0 || hdr.version > MEM_EVENT_VERSION || hdr.event_size != sizeof(struct mem_event)) {
+        fprintf(stderr, "mtrace_events: not an event stream\n");
+        return NULL;
+    }
+    for ( ; ; ) {
+        if (n == cap) {
+            size_t ncap = cap? cap * 2: 65536;
+            struct mem_event *p = realloc(events, ncap * sizeof(*events));
+            if (p == NULL) {
+                free(events);
+                return NULL;
+            }
+            events = p;
+            cap = ncap;
+        }
+        size_t got = fread(events + n, sizeof(*events), cap - n, fp);
+        n += got;
+        if (got == 0)
+            break;
+    }
+    *count = n;
+    return events;
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t until = UINT64_MAX, live_bytes = 0, peak_bytes = 0, unsampled_bytes = 0;
+    size_t nevents = 0, nsums = 0, bad_free = 0, nalloc = 0, nfree = 0;
+    size_t unsampled = 0;
+    struct mem_event *events;
+    struct stack_sum *sums;
+    struct ptrhash live;
+    FILE *fp;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:")) != -1) {
+        switch (opt) {
+        case 't':
+            until = strtoull(optarg, NULL, 0);
+            break;
+        default:
+            goto _usage;
+        }
+    }
+    if (optind >= argc)
+        goto _usage;
+    fp = fopen(argv[optind], "rb");
+    if (fp == NULL) {
+        perror(argv[optind]);
+        return 1;
+    }
+    events = events_load(fp, &nevents);
+    fclose(fp);
+    if (events == NULL)
+        return 1;
+    qsort(events, nevents, sizeof(*events), event_compare);
+
+    ptrhash_init(&live, &heap_allocator);
+    for (size_t i = 0; i < nevents && events[i].timestamp <= until; i++) {
+        struct mem_event *e = &events[i];
+        if (mem_event_op(e) == MEM_EVENT_ALLOC) {
+            if (ptrhash_insert(&live, e->ptr, e))
+                break;
+            live_bytes += mem_event_size(e);
+            if (live_bytes > peak_bytes)
+                peak_bytes = live_bytes;
+            nalloc++;
+        } else if (mem_event_op(e) == MEM_EVENT_FREE) {
+            struct mem_event *a = ptrhash_remove(&live, e->ptr);
+            if (a == NULL) {
+                /* Untraced blocks allocated before the stream was opened */
+                if (!mem_event_unsampled(e))
+                    bad_free++;
+                continue;
+            }
+            live_bytes -= mem_event_size(a);
+            nfree++;
+        }
+    }
+
+    /* Sum the live blocks per stack id */
+    sums = malloc((ptrhash_count(&live) + 1) * sizeof(*sums));
+    if (sums == NULL)
+        return 1;
+    for (size_t i = 0; i < nevents && events[i].timestamp <= until; i++) {
+        struct mem_event *e = &events[i];
+        if (mem_event_op(e) != MEM_EVENT_ALLOC || ptrhash_find(&live, e->ptr) != e)
+            continue;
+        if (mem_event_unsampled(e)) {
+            unsampled++;
+            unsampled_bytes += mem_event_size(e);
+        } else {
+            sums[nsums].stack_id = e->stack_id;
+            sums[nsums].bytes = mem_event_size(e);
+            sums[nsums].count = 1;
+            nsums++;
+        }
+    }
+    qsort(sums, nsums, sizeof(*sums), sum_id_compare);
+    size_t n = 0;
+    for (size_t i = 0; i < nsums; i++) {
+        if (n > 0 && sums[n - 1].stack_id == sums[i].stack_id) {
+            sums[n - 1].bytes += sums[i].bytes;
+            sums[n - 1].count++;
+        } else {
+            sums[n++] = sums[i];
+        }
+    }
+    qsort(sums, n, sizeof(*sums), sum_compare);
+
+    printf("Events: %zu (alloc %zu free %zu unmatched free %zu)\n",
+        nevents, nalloc, nfree, bad_free);
+    printf("Live: %zu blocks %" PRIu64 " B, peak %" PRIu64 " B\n",
+        ptrhash_count(&live), live_bytes, peak_bytes);
+    printf("Unsampled: %zu blocks %" PRIu64 " B\n\n", unsampled, unsampled_bytes);
+    printf("%-10s %-10s %s\n", "Stack", "Count", "Bytes");
+    for (size_t i = 0; i < n; i++) {
+        printf("%-10u %-10" PRIu64 " %" PRIu64 "\n", sums[i].stack_id,
+            sums[i].count, sums[i].bytes);
+    }
+    ptrhash_destroy(&live);
+    free(sums);
+    free(events);
+    return 0;
+
+_usage:
+    fprintf(stderr, "usage: %s [-t nanoseconds] event-file\n", argv[0]);
+    return 1;
+}
@@ -0,0 +1,223 @@
+/*
+ * Copyright 2022 wtcat
+ */
+
+/*
+ * Symbolize the output of mem_tracer_dump(MEM_DUMP_RAW) offline.
+ *
+ * usage: mtrace_symbolize [-r sysroot] [-s separator] [dump-file]
+ *
+ * The modules are looked up under @sysroot (if any) and rejected when
+ * their build-id differs from the one recorded in the dump.
+ */
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "tracer/elf_symtab.h"
+
+struct module {
+    uintptr_t start;
+    uintptr_t end;
+    uintptr_t bias;
+    char *path;
+    uint8_t build_id[ELF_BUILD_ID_MAX];
+    size_t build_id_size;
+    struct elf_symtab *tab;
+    bool failed;
+};
+
+static struct module *modules;
+static size_t nmodules, modules_cap;
+static const char *sysroot = "";
+static const char *separator = "\n\t->";
+
+static size_t parse_build_id(const char *s, uint8_t *id, size_t maxlen) {
+    size_t n = 0;
+    unsigned int v;
+    while (n < maxlen && sscanf(s, "%2x", &v) == 1) {
+        id[n++] = (uint8_t)v;
+        s += 2;
+    }
+    return n;
+}
+
+static int module_add(char *line) {
+    struct module *m;
+    unsigned long start, end, bias;
+    char build_id[2 * ELF_BUILD_ID_MAX + 1];
+    int pos = 0;
+
+    if (sscanf(line, "M %lx %lx %lx %40s %n", &start, &end, &bias,
+        build_id, &pos) < 4 || pos == 0)
+        return -EINVAL;
+    line[strcspn(line, "\n")] = '\0';
+    if (nmodules == modules_cap) {
+        size_t ncap = modules_cap? modules_cap * 2: 32;
+        struct module *p = realloc(modules, ncap * sizeof(*modules));
+        if (p == NULL)
+            return -ENOMEM;
+        modules = p;
+        modules_cap = ncap;
+    }
+    m = &modules[nmodules];
+    memset(m, 0, sizeof(*m));
+    m->start = start;
+    m->end = end;
+    m->bias = bias;
+    m->path = strdup(line + pos);
+    if (m->path == NULL)
+        return -ENOMEM;
+    if (strcmp(build_id, "-"))
+        m->build_id_size = parse_build_id(build_id, m->build_id, ELF_BUILD_ID_MAX);
+    nmodules++;
+    return 0;
+}
+
+static struct module *module_find(uintptr_t addr) {
+    for (size_t i = 0; i < nmodules; i++) {
+        if (addr >= modules[i].start && addr < modules[i].end)
+            return &modules[i];
+    }
+    return NULL;
+}
+
+static const struct elf_symtab *module_symtab(struct module *m) {
+    char file[PATH_MAX];
+    if (m->tab || m->failed)
+        return m->tab;
+    m->failed = true;
+    snprintf(file, sizeof(file), "%s%s", sysroot, m->path);
+    m->tab = malloc(sizeof(*m->tab));
+    if (m->tab == NULL)
+        return NULL;
+    if (elf_symtab_open(m->tab, file)) {
+        fprintf(stderr, "mtrace_symbolize: cannot load %s\n", file);
+        goto _failed;
+    }
+    if (m->build_id_size && (m->tab->build_id_size != m->build_id_size ||
+        memcmp(m->tab->build_id, m->build_id, m->build_id_size))) {
+        fprintf(stderr, "mtrace_symbolize: build-id mismatch for %s\n", file);
+        elf_symtab_close(m->tab);
+        goto _failed;
+    }
+    m->failed = false;
+    return m->tab;
+_failed:
+    free(m->tab);
+    m->tab = NULL;
+    return NULL;
+}
+
+static void frame_print(uintptr_t ip) {
+    const struct elf_symbol *sym = NULL;
+    const struct elf_symtab *tab;
+    struct module *m = module_find(ip);
+
+    if (m == NULL) {
+        printf("[%#" PRIxPTR "]", ip);
+        return;
+    }
+    tab = module_symtab(m);
+    if (tab)
+        sym = elf_symtab_lookup(tab, ip - m->bias);
+    if (sym) {
+        printf("%s(%s+0x%" PRIxPTR ") [%#" PRIxPTR "]", m->path, sym->name,
+            ip - m->bias - sym->addr, ip);
+    } else {
+        printf("%s(+0x%" PRIxPTR ") [%#" PRIxPTR "]", m->path, ip - m->bias, ip);
+    }
+}
+
+static void stack_print(char *line) {
+    unsigned long cnt, sum;
+    unsigned int id;
+    char *p, *end;
+    int pos = 0;
+
+    if (sscanf(line, "S %u %lu %lu%n", &id, &cnt, &sum, &pos) < 3 || pos == 0)
+        return;
+    printf("\n<Path>@ {Count: %-8lu Used: %luB (%.2fKB)}:\n",
+        cnt, sum, (float)sum / 1024);
+    for (p = line + pos; ; p = end) {
+        uintptr_t ip = (uintptr_t)strtoull(p, &end, 16);
+        if (end == p)
+            break;
+        printf("%s", separator);
+        frame_print(ip);
+    }
+    printf("\n");
+}
+
+int main(int argc, char *argv[]) {
+    char *line = NULL;
+    size_t len = 0;
+    FILE *fp = stdin;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:s:")) != -1) {
+        switch (opt) {
+        case 'r':
+            sysroot = optarg;
+            break;
+        case 's':
+            separator = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-r sysroot] [-s separator] [dump-file]\n",
+                argv[0]);
+            return 1;
+        }
+    }
+    if (optind < argc) {
+        fp = fopen(argv[optind], "r");
+        if (fp == NULL) {
+            perror(argv[optind]);
+            return 1;
+        }
+    }
+    while (getline(&line, &len, fp) > 0) {
+        switch (line[0]) {
+        case 'M':
+            module_add(line);
+            break;
+        case 'S':
+            stack_print(line);
+            break;
+        case 'B': {
+            unsigned long long ptr;
+            unsigned long size;
+            if (sscanf(line, "B %llx %lu", &ptr, &size) == 2)
+                printf("\tMemory: 0x%llx Size: %lu\n", ptr, size);
+            break;
+        }
+        case 'T': {
+            unsigned long sum, cnt;
+            if (sscanf(line, "T %lu %lu", &sum, &cnt) == 2)
+                printf("\nTotal Used: %lu B (%.2f KB) Blocks: %lu\n",
+                    sum, (float)sum / 1024, cnt);
+            break;
+        }
+        default:
+            break;
+        }
+    }
+    free(line);
+    if (fp != stdin)
+        fclose(fp);
+    for (size_t i = 0; i < nmodules; i++) {
+        if (modules[i].tab) {
+            elf_symtab_close(modules[i].tab);
+            free(modules[i].tab);
+        }
+        free(modules[i].path);
+    }
+    free(modules);
+    return 0;
+}
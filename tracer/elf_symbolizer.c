@@ -0,0 +1,217 @@
+/*
+ * Copyright 2022 wtcat
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <link.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "base/mutex.h"
+#include "base/utils.h"
+#include "tracer/elf_symtab.h"
+#include "tracer/elf_symbolizer.h"
+
+/*
+ * Executable mappings of the process as listed in /proc/self/maps, the 
+ * symbol table of a module is loaded the first time one of its 
+ * addresses is resolved. The list is read again for an unknown address 
+ * only when the loader has added or removed objects since the last read, 
+ * addresses outside of any file mapping (JIT code, vdso) would otherwise 
+ * rescan the maps each time.
+ */
+struct elf_module {
+    uintptr_t start;
+    uintptr_t end;
+    uint64_t offset;
+    char *path;
+    struct elf_symtab *tab;
+    bool failed;
+};
+
+static struct elf_module_list {
+    struct elf_module *mods;
+    size_t n;
+    unsigned long long generation;
+    bool loaded;
+    MUTEX_LOCK_DECLARE(lock);
+} modules;
+
+static once_flag modules_once = ONCE_FLAG_INIT;
+
+static void elf_modules_init(void) {
+    MUTEX_INIT(&modules);
+}
+
+static struct elf_module *elf_module_find(struct elf_module *mods, size_t n, 
+    uintptr_t addr) {
+    size_t lo = 0, hi = n;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (addr < mods[mid].start)
+            hi = mid;
+        else if (addr >= mods[mid].end)
+            lo = mid + 1;
+        else
+            return &mods[mid];
+    }
+    return NULL;
+}
+
+static int elf_generation_callback(struct dl_phdr_info *info, size_t size, 
+    void *arg) {
+    unsigned long long *gen = (unsigned long long *)arg;
+    if (size < offsetof(struct dl_phdr_info, dlpi_subs) + sizeof(info->dlpi_subs))
+        return -1;
+    *gen = info->dlpi_adds + info->dlpi_subs;
+    return 1;
+}
+
+/* Counts dlopen() and dlclose() of the process, 0 if not known */
+static unsigned long long elf_modules_generation(void) {
+    unsigned long long gen = 0;
+    dl_iterate_phdr(elf_generation_callback, &gen);
+    return gen;
+}
+
+static void elf_module_release(struct elf_module *m) {
+    if (m->tab) {
+        elf_symtab_close(m->tab);
+        free(m->tab);
+    }
+    free(m->path);
+}
+
+/*
+ * Modules that are still mapped at the same place keep their 
+ * symbol tables, everything else is dropped.
+ */
+static int elf_modules_reload(void) {
+    struct elf_module *mods = NULL;
+    size_t n = 0, cap = 0;
+    char *line = NULL;
+    size_t len = 0;
+    FILE *fp;
+
+    fp = fopen("/proc/self/maps", "r");
+    if (fp == NULL)
+        return -errno;
+    while (getline(&line, &len, fp) > 0) {
+        unsigned long start, end;
+        unsigned long long offset;
+        char perms[8];
+        int pos = 0;
+        if (sscanf(line, "%lx-%lx %7s %llx %*s %*s %n", 
+            &start, &end, perms, &offset, &pos) < 4 || pos == 0)
+            continue;
+        if (perms[2] != 'x' || line[pos] != '/')
+            continue;
+        line[strcspn(line, "\n")] = '\0';
+        if (n == cap) {
+            size_t ncap = cap? cap * 2: 32;
+            struct elf_module *p = realloc(mods, ncap * sizeof(*mods));
+            if (p == NULL)
+                break;
+            mods = p;
+            cap = ncap;
+        }
+        struct elf_module *m = &mods[n];
+        memset(m, 0, sizeof(*m));
+        m->start = start;
+        m->end = end;
+        m->offset = offset;
+        struct elf_module *old = elf_module_find(modules.mods, modules.n, start);
+        if (old && old->path && old->start == start && old->offset == offset && 
+            !strcmp(old->path, line + pos)) {
+            *m = *old;
+            old->path = NULL;
+            old->tab = NULL;
+        } else {
+            m->path = strdup(line + pos);
+            if (m->path == NULL)
+                continue;
+        }
+        n++;
+    }
+    free(line);
+    fclose(fp);
+    for (size_t i = 0; i < modules.n; i++)
+        elf_module_release(&modules.mods[i]);
+    free(modules.mods);
+    modules.mods = mods;
+    modules.n = n;
+    return 0;
+}
+
+static const struct elf_symtab *elf_module_symtab(struct elf_module *m) {
+    if (m->tab == NULL && !m->failed) {
+        m->tab = malloc(sizeof(*m->tab));
+        if (m->tab == NULL || elf_symtab_open(m->tab, m->path)) {
+            free(m->tab);
+            m->tab = NULL;
+            m->failed = true;
+        }
+    }
+    return m->tab;
+}
+
+static ssize_t elf_symbol_transform(struct backtrace_class *cls, void *ip, 
+    char *buf, size_t maxlen) {
+    const struct elf_symbol *sym = NULL;
+    const struct elf_symtab *tab;
+    struct elf_module *m;
+    uintptr_t addr = (uintptr_t)ip;
+    uint64_t vaddr;
+    ssize_t ret = -ENOENT;
+    (void) cls;
+
+    if (ip == NULL || maxlen == 0)
+        return -EINVAL;
+    call_once(&modules_once, elf_modules_init);
+    MUTEX_LOCK(&modules);
+    m = elf_module_find(modules.mods, modules.n, addr);
+    if (m == NULL) {
+        /* Probably loaded after the last scan */
+        unsigned long long gen = elf_modules_generation();
+        if (!modules.loaded || gen == 0 || gen != modules.generation) {
+            if (!elf_modules_reload()) {
+                modules.loaded = true;
+                modules.generation = gen;
+            }
+            m = elf_module_find(modules.mods, modules.n, addr);
+        }
+    }
+    if (m == NULL)
+        goto _unlock;
+    tab = elf_module_symtab(m);
+    if (tab == NULL || elf_symtab_offset_to_vaddr(tab, m->offset, &vaddr))
+        goto _unlock;
+    /* Map the run-time address back to the link-time address */
+    vaddr += addr - m->start;
+    sym = elf_symtab_lookup(tab, (uintptr_t)vaddr);
+    if (sym != NULL) {
+        ret = snprintf(buf, maxlen, "%s(%s+0x%lx) [%p]", m->path, sym->name, 
+            (unsigned long)(vaddr - sym->addr), ip);
+    } else {
+        ret = snprintf(buf, maxlen, "%s(+0x%lx) [%p]", m->path, 
+            (unsigned long)(addr - m->start + m->offset), ip);
+    }
+    if (ret >= (ssize_t)maxlen)
+        ret = maxlen - 1;
+_unlock:
+    MUTEX_UNLOCK(&modules);
+    return ret;
+}
+
+int elf_symbolizer_attach(struct backtrace_class *cls) {
+    if (cls == NULL)
+        return -EINVAL;
+    cls->transform = elf_symbol_transform;
+    cls->transform_prepare = NULL;
+    cls->transform_post = NULL;
+    return 0;
+}
@@ -0,0 +1,18 @@
+/*
+ * Copyright 2022 wtcat
+ */
+#ifndef TRACER_ELF_SYMBOLIZER_H_
+#define TRACER_ELF_SYMBOLIZER_H_
+
+#include "base/backtrace.h"
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+int elf_symbolizer_attach(struct backtrace_class *cls);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* TRACER_ELF_SYMBOLIZER_H_ */
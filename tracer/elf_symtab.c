@@ -0,0 +1,193 @@
+/*
+ * Copyright 2022 wtcat
+ */
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <link.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "tracer/elf_symtab.h"
+
+static int elf_symbol_compare(const void *a, const void *b) {
+    const struct elf_symbol *s1 = (const struct elf_symbol *)a;
+    const struct elf_symbol *s2 = (const struct elf_symbol *)b;
+    if (s1->addr != s2->addr)
+        return s1->addr < s2->addr? -1: 1;
+    /* Sized symbols win over aliases without size */
+    return s1->size < s2->size? 1: (s1->size > s2->size? -1: 0);
+}
+
+static const ElfW(Shdr) *elf_find_section(const ElfW(Ehdr) *eh, 
+    size_t size, ElfW(Word) type) {
+    const ElfW(Shdr) *sh = (const ElfW(Shdr) *)((const char *)eh + eh->e_shoff);
+    for (size_t i = 0; i < eh->e_shnum; i++) {
+        if (sh[i].sh_type == type && sh[i].sh_offset + sh[i].sh_size <= size)
+            return &sh[i];
+    }
+    return NULL;
+}
+
+size_t elf_note_build_id(const void *notes, size_t size, uint8_t *id, 
+    size_t maxlen) {
+    const char *p = (const char *)notes;
+    const char *end = p + size;
+    while (p + sizeof(ElfW(Nhdr)) <= end) {
+        const ElfW(Nhdr) *nh = (const ElfW(Nhdr) *)p;
+        size_t namesz = (nh->n_namesz + 3) & ~3u;
+        size_t descsz = (nh->n_descsz + 3) & ~3u;
+        const char *name = p + sizeof(ElfW(Nhdr));
+        const char *desc = name + namesz;
+        if (desc + descsz > end)
+            break;
+        if (nh->n_type == NT_GNU_BUILD_ID && nh->n_namesz == 4 && 
+            !memcmp(name, "GNU", 4)) {
+            size_t n = nh->n_descsz < maxlen? nh->n_descsz: maxlen;
+            memcpy(id, desc, n);
+            return n;
+        }
+        p = desc + descsz;
+    }
+    return 0;
+}
+
+static int elf_load_symbols(struct elf_symtab *tab, const ElfW(Ehdr) *eh, 
+    const ElfW(Shdr) *symsh) {
+    const ElfW(Shdr) *sh = (const ElfW(Shdr) *)((const char *)eh + eh->e_shoff);
+    const ElfW(Sym) *sym;
+    const char *strtab;
+    size_t n, count = 0;
+
+    if (symsh->sh_link >= eh->e_shnum || 
+        sh[symsh->sh_link].sh_offset + sh[symsh->sh_link].sh_size > tab->map_size)
+        return -EINVAL;
+    strtab = (const char *)eh + sh[symsh->sh_link].sh_offset;
+    sym = (const ElfW(Sym) *)((const char *)eh + symsh->sh_offset);
+    n = symsh->sh_size / sizeof(ElfW(Sym));
+    tab->syms = malloc(n * sizeof(struct elf_symbol));
+    if (tab->syms == NULL)
+        return -ENOMEM;
+    for (size_t i = 0; i < n; i++) {
+        unsigned char type = ELF64_ST_TYPE(sym[i].st_info);
+        if ((type != STT_FUNC && type != STT_GNU_IFUNC) || 
+            sym[i].st_shndx == SHN_UNDEF || sym[i].st_value == 0 ||
+            sym[i].st_name >= sh[symsh->sh_link].sh_size)
+            continue;
+        tab->syms[count].addr = sym[i].st_value;
+        tab->syms[count].size = sym[i].st_size;
+        tab->syms[count].name = strtab + sym[i].st_name;
+        count++;
+    }
+    qsort(tab->syms, count, sizeof(struct elf_symbol), elf_symbol_compare);
+    tab->nsyms = count;
+    return 0;
+}
+
+int elf_symtab_open(struct elf_symtab *tab, const char *path) {
+    const ElfW(Ehdr) *eh;
+    const ElfW(Phdr) *ph;
+    const ElfW(Shdr) *symsh;
+    struct stat st;
+    int fd, err;
+
+    memset(tab, 0, sizeof(*tab));
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -errno;
+    if (fstat(fd, &st) || (size_t)st.st_size < sizeof(ElfW(Ehdr))) {
+        close(fd);
+        return -EINVAL;
+    }
+    tab->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (tab->map == MAP_FAILED) {
+        tab->map = NULL;
+        return -ENOMEM;
+    }
+    tab->map_size = st.st_size;
+    eh = (const ElfW(Ehdr) *)tab->map;
+    if (memcmp(eh->e_ident, ELFMAG, SELFMAG) || 
+        eh->e_shoff + (size_t)eh->e_shnum * sizeof(ElfW(Shdr)) > tab->map_size ||
+        eh->e_phoff + (size_t)eh->e_phnum * sizeof(ElfW(Phdr)) > tab->map_size) {
+        err = -EINVAL;
+        goto _failed;
+    }
+    ph = (const ElfW(Phdr) *)((const char *)eh + eh->e_phoff);
+    for (size_t i = 0; i < eh->e_phnum && 
+        tab->nsegments < ELF_SYMTAB_MAX_SEGMENTS; i++) {
+        if (ph[i].p_type != PT_LOAD)
+            continue;
+        tab->segments[tab->nsegments].vaddr = ph[i].p_vaddr;
+        tab->segments[tab->nsegments].offset = ph[i].p_offset;
+        tab->segments[tab->nsegments].filesz = ph[i].p_filesz;
+        tab->nsegments++;
+    }
+    const ElfW(Shdr) *sh = (const ElfW(Shdr) *)((const char *)eh + eh->e_shoff);
+    for (size_t i = 0; i < eh->e_shnum && tab->build_id_size == 0; i++) {
+        if (sh[i].sh_type == SHT_NOTE && 
+            sh[i].sh_offset + sh[i].sh_size <= tab->map_size)
+            tab->build_id_size = elf_note_build_id((const char *)eh + sh[i].sh_offset, 
+                sh[i].sh_size, tab->build_id, ELF_BUILD_ID_MAX);
+    }
+    /* .symtab also has the static functions, .dynsym is the fallback */
+    symsh = elf_find_section(eh, tab->map_size, SHT_SYMTAB);
+    if (symsh == NULL)
+        symsh = elf_find_section(eh, tab->map_size, SHT_DYNSYM);
+    if (symsh == NULL) {
+        err = -ENOENT;
+        goto _failed;
+    }
+    err = elf_load_symbols(tab, eh, symsh);
+    if (err)
+        goto _failed;
+    return 0;
+_failed:
+    elf_symtab_close(tab);
+    return err;
+}
+
+void elf_symtab_close(struct elf_symtab *tab) {
+    free(tab->syms);
+    if (tab->map)
+        munmap(tab->map, tab->map_size);
+    memset(tab, 0, sizeof(*tab));
+}
+
+const struct elf_symbol *elf_symtab_lookup(const struct elf_symtab *tab, 
+    uintptr_t vaddr) {
+    size_t lo = 0, hi = tab->nsyms;
+    const struct elf_symbol *s;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (tab->syms[mid].addr <= vaddr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == 0)
+        return NULL;
+    s = &tab->syms[lo - 1];
+    /* Step back to the sized entry of a group of aliases */
+    while (s > tab->syms && s[-1].addr == s->addr)
+        s--;
+    if (s->size && vaddr >= s->addr + s->size)
+        return NULL;
+    return s;
+}
+
+int elf_symtab_offset_to_vaddr(const struct elf_symtab *tab, uint64_t offset, 
+    uint64_t *vaddr) {
+    for (size_t i = 0; i < tab->nsegments; i++) {
+        const struct elf_segment *seg = &tab->segments[i];
+        uint64_t start = seg->offset & ~(uint64_t)(getpagesize() - 1);
+        if (offset >= start && offset < seg->offset + seg->filesz) {
+            *vaddr = seg->vaddr - (seg->offset - offset);
+            return 0;
+        }
+    }
+    return -ENOENT;
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright 2022 wtcat
+ */
+#ifndef TRACER_ELF_SYMTAB_H_
+#define TRACER_ELF_SYMTAB_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+struct elf_symbol {
+    uintptr_t addr;
+    uintptr_t size;
+    const char *name;
+};
+
+struct elf_segment {
+    uint64_t vaddr;
+    uint64_t offset;
+    uint64_t filesz;
+};
+
+/*
+ * Function symbols of one ELF file sorted by address. The file stays 
+ * mapped, names point into its string table.
+ */
+struct elf_symtab {
+#define ELF_SYMTAB_MAX_SEGMENTS 8
+#define ELF_BUILD_ID_MAX 20
+    void *map;
+    size_t map_size;
+    struct elf_symbol *syms;
+    size_t nsyms;
+    struct elf_segment segments[ELF_SYMTAB_MAX_SEGMENTS];
+    size_t nsegments;
+    uint8_t build_id[ELF_BUILD_ID_MAX];
+    size_t build_id_size;
+};
+
+int elf_symtab_open(struct elf_symtab *tab, const char *path);
+void elf_symtab_close(struct elf_symtab *tab);
+const struct elf_symbol *elf_symtab_lookup(const struct elf_symtab *tab, 
+    uintptr_t vaddr);
+int elf_symtab_offset_to_vaddr(const struct elf_symtab *tab, uint64_t offset, 
+    uint64_t *vaddr);
+/*
+ * Copy the NT_GNU_BUILD_ID descriptor found in a block of ELF notes, 
+ * returns its size or zero.
+ */
+size_t elf_note_build_id(const void *notes, size_t size, uint8_t *id, 
+    size_t maxlen);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* TRACER_ELF_SYMTAB_H_ */
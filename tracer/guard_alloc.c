@@ -0,0 +1,335 @@
+/*
+ * Copyright 2022 wtcat
+ */
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "base/atomic.h"
+#include "base/mutex.h"
+#include "base/utils.h"
+#include "tracer/guard_alloc.h"
+
+#if !defined(_WIN32)
+#include <unistd.h>
+#include <sys/mman.h>
+
+/* Written right below the user pointer */
+struct guard_header {
+#define GUARD_MAGIC 0x47554152444D454DULL
+#define GUARD_FALLBACK_MAGIC 0x4641494C4241434BULL
+    uint64_t magic;
+    void *base;
+    size_t pages;
+    size_t size;
+    uint32_t tag;
+};
+
+/* A cached mapping, the link lives in its first page */
+struct guard_free {
+    struct guard_free *next;
+};
+
+/*
+ * Live blocks by guard page, for the fault handler. A slot is claimed 
+ * with GUARD_SLOT_BUSY, the block is stored, then the guard address is 
+ * published. Lookups probe a fixed window and never lock, a block that 
+ * finds no free slot in its window is simply not reported.
+ */
+struct guard_slot {
+#define GUARD_SLOT_BUSY 1
+    uintptr_t guard;
+    void *ptr;
+};
+
+struct guard_pool {
+#define GUARD_POOL_CLASSES 16
+#define GUARD_SLOT_BITS 16
+#define GUARD_SLOTS (1 << GUARD_SLOT_BITS)
+#define GUARD_PROBES 16
+    struct mem_allocator base;
+    struct mem_allocator *meta;
+    size_t page_size;
+    size_t max_cached;          /* Pages */
+    size_t cached;
+    struct guard_free *classes[GUARD_POOL_CLASSES + 1];
+    struct guard_slot *slots;
+    MUTEX_LOCK_DECLARE(lock);
+};
+
+static inline size_t guard_slot_index(uintptr_t guard) {
+    return (size_t)(((uint64_t)guard * 0x9E3779B97F4A7C15ULL) >> (64 - GUARD_SLOT_BITS));
+}
+
+static void guard_slot_insert(struct guard_pool *gp, uintptr_t guard, void *ptr) {
+    size_t idx = guard_slot_index(guard);
+    for (size_t i = 0; i < GUARD_PROBES; i++) {
+        struct guard_slot *gs = &gp->slots[(idx + i) & (GUARD_SLOTS - 1)];
+        uintptr_t expected = 0;
+        if (ATOMIC_CAS(&gs->guard, &expected, GUARD_SLOT_BUSY)) {
+            ATOMIC_STORE(&gs->ptr, ptr);
+            ATOMIC_STORE(&gs->guard, guard);
+            return;
+        }
+    }
+}
+
+static void guard_slot_remove(struct guard_pool *gp, uintptr_t guard) {
+    size_t idx = guard_slot_index(guard);
+    for (size_t i = 0; i < GUARD_PROBES; i++) {
+        struct guard_slot *gs = &gp->slots[(idx + i) & (GUARD_SLOTS - 1)];
+        if (ATOMIC_LOAD(&gs->guard) == guard) {
+            ATOMIC_STORE(&gs->guard, 0);
+            return;
+        }
+    }
+}
+
+static inline size_t guard_align(size_t size) {
+    size_t align = 1;
+    while (align < size && align < 16)
+        align <<= 1;
+    return align;
+}
+
+static inline size_t guard_round(size_t size) {
+    size_t align = guard_align(size);
+    return (size + align - 1) & ~(align - 1);
+}
+
+static void *guard_map(struct guard_pool *gp, size_t pages) {
+    size_t len = pages * gp->page_size;
+    char *base;
+    if (pages <= GUARD_POOL_CLASSES) {
+        struct guard_free *gf;
+        MUTEX_LOCK(gp);
+        gf = gp->classes[pages];
+        if (gf != NULL) {
+            gp->classes[pages] = gf->next;
+            gp->cached -= pages;
+        }
+        MUTEX_UNLOCK(gp);
+        if (gf != NULL)
+            return gf;
+    }
+    base = mmap(NULL, len + gp->page_size, PROT_READ | PROT_WRITE, 
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+        return NULL;
+    /* Splits the mapping, fails too once vm.max_map_count is reached */
+    if (mprotect(base + len, gp->page_size, PROT_NONE)) {
+        munmap(base, len + gp->page_size);
+        return NULL;
+    }
+    return base;
+}
+
+static void guard_unmap(struct guard_pool *gp, void *base, size_t pages) {
+    if (pages <= GUARD_POOL_CLASSES) {
+        struct guard_free *gf = (struct guard_free *)base;
+        bool cached = false;
+        MUTEX_LOCK(gp);
+        if (gp->cached + pages <= gp->max_cached) {
+            gf->next = gp->classes[pages];
+            gp->classes[pages] = gf;
+            gp->cached += pages;
+            cached = true;
+        }
+        MUTEX_UNLOCK(gp);
+        if (cached)
+            return;
+    }
+    munmap(base, (pages + 1) * gp->page_size);
+}
+
+/* Out of mappings: an unguarded block of the meta allocator */
+static void *guard_fallback_alloc(struct guard_pool *gp, size_t size) {
+    struct guard_header hdr;
+    char *base, *ptr;
+    if (size > SIZE_MAX - sizeof(hdr) - 16)
+        return NULL;
+    base = memory_allocate(gp->meta, size + sizeof(hdr) + 16, NULL);
+    if (base == NULL)
+        return NULL;
+    ptr = (char *)(((uintptr_t)base + sizeof(hdr) + 15) & ~(uintptr_t)15);
+    hdr.magic = GUARD_FALLBACK_MAGIC;
+    hdr.base = base;
+    hdr.pages = 0;
+    hdr.size = size;
+    hdr.tag = 0;
+    memcpy(ptr - sizeof(hdr), &hdr, sizeof(hdr));
+    return ptr;
+}
+
+static void *guard_alloc(struct mem_allocator *m, size_t size, void *user) {
+    struct guard_pool *gp = CONTAINER_OF(m, struct guard_pool, base);
+    struct guard_header hdr;
+    size_t rsize = guard_round(size);
+    char *base, *ptr;
+    (void) user;
+    if (rsize < size || rsize > SIZE_MAX / 2)
+        return NULL;
+    hdr.pages = (rsize + sizeof(hdr) + gp->page_size - 1) / gp->page_size;
+    base = guard_map(gp, hdr.pages);
+    if (base == NULL)
+        return guard_fallback_alloc(gp, size);
+    ptr = base + hdr.pages * gp->page_size - rsize;
+    hdr.magic = GUARD_MAGIC;
+    hdr.base = base;
+    hdr.size = size;
+    hdr.tag = 0;
+    /* The user pointer may be less aligned than the header */
+    memcpy(ptr - sizeof(hdr), &hdr, sizeof(hdr));
+    guard_slot_insert(gp, (uintptr_t)ptr + rsize, ptr);
+    return ptr;
+}
+
+static void guard_free(struct mem_allocator *m, void *ptr, void *user) {
+    struct guard_pool *gp = CONTAINER_OF(m, struct guard_pool, base);
+    struct guard_header hdr;
+    (void) user;
+    if (ptr == NULL)
+        return;
+    memcpy(&hdr, (char *)ptr - sizeof(hdr), sizeof(hdr));
+    if (hdr.magic == GUARD_FALLBACK_MAGIC && hdr.pages == 0 && 
+        (char *)ptr - (char *)hdr.base >= (ptrdiff_t)sizeof(hdr) && 
+        (char *)ptr - (char *)hdr.base < (ptrdiff_t)(sizeof(hdr) + 16)) {
+        memory_free(gp->meta, hdr.base, NULL);
+        return;
+    }
+    /* A clobbered header leaks the mapping rather than unmapping garbage */
+    if (hdr.magic != GUARD_MAGIC || 
+        (char *)hdr.base + hdr.pages * gp->page_size != 
+        (char *)ptr + guard_round(hdr.size))
+        return;
+    guard_slot_remove(gp, (uintptr_t)ptr + guard_round(hdr.size));
+    guard_unmap(gp, hdr.base, hdr.pages);
+}
+
+int guard_pool_create(struct guard_pool **pgp, struct mem_allocator *meta, 
+    size_t max_cached) {
+    struct guard_pool *gp;
+    long page_size = sysconf(_SC_PAGESIZE);
+    if (pgp == NULL || meta == NULL || page_size <= 0)
+        return -EINVAL;
+    gp = memory_allocate(meta, sizeof(*gp), NULL);
+    if (gp == NULL)
+        return -ENOMEM;
+    memset(gp, 0, sizeof(*gp));
+    gp->slots = memory_allocate(meta, GUARD_SLOTS * sizeof(*gp->slots), NULL);
+    if (gp->slots == NULL) {
+        memory_free(meta, gp, NULL);
+        return -ENOMEM;
+    }
+    memset(gp->slots, 0, GUARD_SLOTS * sizeof(*gp->slots));
+    MUTEX_INIT(gp);
+    gp->base.allocate = guard_alloc;
+    gp->base.free = guard_free;
+    gp->meta = meta;
+    gp->page_size = (size_t)page_size;
+    gp->max_cached = max_cached / gp->page_size;
+    *pgp = gp;
+    return 0;
+}
+
+void guard_pool_destroy(struct guard_pool *gp) {
+    if (gp == NULL)
+        return;
+    for (size_t pages = 1; pages <= GUARD_POOL_CLASSES; pages++) {
+        struct guard_free *gf;
+        while ((gf = gp->classes[pages]) != NULL) {
+            gp->classes[pages] = gf->next;
+            munmap(gf, (pages + 1) * gp->page_size);
+        }
+    }
+    MUTEX_DEINIT(gp);
+    memory_free(gp->meta, gp->slots, NULL);
+    memory_free(gp->meta, gp, NULL);
+}
+
+struct mem_allocator *guard_pool_allocator(struct guard_pool *gp) {
+    return &gp->base;
+}
+
+void guard_pool_set_cache(struct guard_pool *gp, size_t max_cached) {
+    MUTEX_LOCK(gp);
+    gp->max_cached = max_cached / gp->page_size;
+    for (size_t pages = GUARD_POOL_CLASSES; pages > 0; pages--) {
+        struct guard_free *gf;
+        while (gp->cached > gp->max_cached && 
+            (gf = gp->classes[pages]) != NULL) {
+            gp->classes[pages] = gf->next;
+            gp->cached -= pages;
+            munmap(gf, (pages + 1) * gp->page_size);
+        }
+    }
+    MUTEX_UNLOCK(gp);
+}
+
+void guard_pool_set_tag(struct guard_pool *gp, void *ptr, uint32_t tag) {
+    (void) gp;
+    memcpy((char *)ptr - sizeof(struct guard_header) + 
+        offsetof(struct guard_header, tag), &tag, sizeof(tag));
+}
+
+bool guard_pool_lookup(struct guard_pool *gp, const void *addr, 
+    struct guard_block *blk) {
+    uintptr_t guard = (uintptr_t)addr & ~(uintptr_t)(gp->page_size - 1);
+    size_t idx = guard_slot_index(guard);
+    for (size_t i = 0; i < GUARD_PROBES; i++) {
+        struct guard_slot *gs = &gp->slots[(idx + i) & (GUARD_SLOTS - 1)];
+        struct guard_header hdr;
+        void *ptr;
+        if (ATOMIC_LOAD(&gs->guard) != guard)
+            continue;
+        ptr = ATOMIC_LOAD(&gs->ptr);
+        memcpy(&hdr, (char *)ptr - sizeof(hdr), sizeof(hdr));
+        if (hdr.magic != GUARD_MAGIC)
+            return false;
+        blk->ptr = ptr;
+        blk->size = hdr.size;
+        blk->tag = hdr.tag;
+        return true;
+    }
+    return false;
+}
+
+#else /* _WIN32 */
+
+int guard_pool_create(struct guard_pool **pgp, struct mem_allocator *meta, 
+    size_t max_cached) {
+    (void) pgp;
+    (void) meta;
+    (void) max_cached;
+    return -ENOTSUP;
+}
+
+void guard_pool_destroy(struct guard_pool *gp) {
+    (void) gp;
+}
+
+struct mem_allocator *guard_pool_allocator(struct guard_pool *gp) {
+    (void) gp;
+    return NULL;
+}
+
+void guard_pool_set_cache(struct guard_pool *gp, size_t max_cached) {
+    (void) gp;
+    (void) max_cached;
+}
+
+void guard_pool_set_tag(struct guard_pool *gp, void *ptr, uint32_t tag) {
+    (void) gp;
+    (void) ptr;
+    (void) tag;
+}
+
+bool guard_pool_lookup(struct guard_pool *gp, const void *addr, 
+    struct guard_block *blk) {
+    (void) gp;
+    (void) addr;
+    (void) blk;
+    return false;
+}
+#endif /* _WIN32 */
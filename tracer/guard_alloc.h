@@ -0,0 +1,54 @@
+/*
+ * Copyright 2022 wtcat
+ */
+#ifndef TRACER_GUARD_ALLOC_H_
+#define TRACER_GUARD_ALLOC_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "base/allocator.h"
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+/*
+ * Every block gets its own mapping and ends flush against a PROT_NONE 
+ * page, so the first access past its end faults. Blocks are aligned to 
+ * 16 bytes, or to the next power of two of smaller sizes, overflows 
+ * into the rounding slack are not caught. Freed mappings are kept per 
+ * page count and handed out again without a system call.
+ *
+ * Each block costs at least two pages and two kernel mappings, once 
+ * vm.max_map_count is reached blocks come from the meta allocator 
+ * without a guard page until mappings are released again.
+ */
+struct guard_pool;
+
+struct guard_block {
+    void *ptr;
+    size_t size;
+    uint32_t tag;
+};
+
+int guard_pool_create(struct guard_pool **pgp, struct mem_allocator *meta, 
+    size_t max_cached);
+void guard_pool_destroy(struct guard_pool *gp);
+struct mem_allocator *guard_pool_allocator(struct guard_pool *gp);
+/* Bytes of freed mappings kept for reuse, the excess is unmapped */
+void guard_pool_set_cache(struct guard_pool *gp, size_t max_cached);
+/* A caller value kept with the block, reported back by the lookup */
+void guard_pool_set_tag(struct guard_pool *gp, void *ptr, uint32_t tag);
+/*
+ * The live block whose guard page holds @addr. Takes no lock and makes 
+ * no call, so it can be used from a signal handler.
+ */
+bool guard_pool_lookup(struct guard_pool *gp, const void *addr, 
+    struct guard_block *blk);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* TRACER_GUARD_ALLOC_H_ */
@@ -0,0 +1,306 @@
+/*
+ * Copyright 2022 wtcat
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "base/atomic.h"
+#include "base/utils.h"
+#include "tracer/mem_event.h"
+
+#if !defined(_WIN32)
+#include <threads.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "base/mutex.h"
+
+#define MEM_EVENT_RING_DEFAULT (1024 * 1024)
+#define MEM_EVENT_SLEEP_SLICE  10
+
+/*
+ * Single producer ring: only the owner thread moves @head, @tail is
+ * moved under the stream lock by whoever writes the events out.
+ */
+struct mem_event_ring {
+    struct mem_event_ring *next;
+    struct mem_event *events;
+    size_t mask;
+    size_t map_size;
+    size_t tail;
+    size_t head;
+    size_t tail_cache;
+    uint32_t tid;
+    bool orphan;
+};
+
+struct mem_event_stream {
+    struct mem_event_ring *rings;
+    size_t ring_events;
+    size_t lost;
+    int fd;
+    int err;
+    tss_t key;
+    thrd_t drainer;
+    unsigned int drain_ms;
+    bool running;
+    MUTEX_LOCK_DECLARE(lock);
+};
+
+static int mem_event_write(int fd, const void *buf, size_t len) {
+    const char *p = (const char *)buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Called with the stream lock held */
+static void mem_event_ring_flush(struct mem_event_stream *stream,
+    struct mem_event_ring *ring) {
+    size_t head = ATOMIC_LOAD(&ring->head);
+    size_t tail = ring->tail;
+    while (tail != head) {
+        size_t ofs = tail & ring->mask;
+        size_t n = MIN(head - tail, ring->mask + 1 - ofs);
+        int err = mem_event_write(stream->fd, &ring->events[ofs],
+            n * sizeof(struct mem_event));
+        if (err) {
+            stream->err = err;
+            ATOMIC_ADD(&stream->lost, head - tail);
+            tail = head;
+            break;
+        }
+        tail += n;
+    }
+    ATOMIC_STORE(&ring->tail, tail);
+}
+
+static void mem_event_ring_destroy(struct mem_event_ring *ring) {
+    munmap(ring->events, ring->map_size);
+    free(ring);
+}
+
+/* The ring of an exited thread is released once it has been drained */
+static void mem_event_ring_orphan(void *arg) {
+    struct mem_event_ring *ring = (struct mem_event_ring *)arg;
+    ATOMIC_STORE(&ring->orphan, true);
+}
+
+static struct mem_event_ring *mem_event_ring_create(struct mem_event_stream *stream) {
+    struct mem_event_ring *ring = calloc(1, sizeof(*ring));
+    if (ring == NULL)
+        return NULL;
+    ring->map_size = stream->ring_events * sizeof(struct mem_event);
+    ring->events = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->events == MAP_FAILED) {
+        free(ring);
+        return NULL;
+    }
+    ring->mask = stream->ring_events - 1;
+    ring->tid = (uint32_t)syscall(SYS_gettid);
+    MUTEX_LOCK(stream);
+    ring->next = stream->rings;
+    stream->rings = ring;
+    MUTEX_UNLOCK(stream);
+    tss_set(stream->key, ring);
+    return ring;
+}
+
+uint64_t mem_event_timestamp(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void mem_event_record(struct mem_event_stream *stream, uint64_t timestamp,
+    unsigned int op, const void *ptr, size_t size, uint32_t stack_id) {
+    struct mem_event_ring *ring = tss_get(stream->key);
+    struct mem_event *e;
+    size_t head;
+
+    if (ring == NULL) {
+        ring = mem_event_ring_create(stream);
+        if (ring == NULL) {
+            ATOMIC_ADD(&stream->lost, 1);
+            return;
+        }
+    }
+    head = ring->head;
+    if (head - ring->tail_cache > ring->mask) {
+        ring->tail_cache = ATOMIC_LOAD(&ring->tail);
+        if (head - ring->tail_cache > ring->mask) {
+            /* Full, write it out from this thread rather than drop events */
+            MUTEX_LOCK(stream);
+            mem_event_ring_flush(stream, ring);
+            MUTEX_UNLOCK(stream);
+            ring->tail_cache = ATOMIC_LOAD(&ring->tail);
+        }
+    }
+    e = &ring->events[head & ring->mask];
+    e->timestamp = timestamp;
+    e->ptr = (uintptr_t)ptr;
+    e->size_op = ((uint64_t)op << MEM_EVENT_OP_SHIFT) |
+        ((uint64_t)size & MEM_EVENT_SIZE_MASK);
+    e->stack_id = stack_id;
+    e->tid = ring->tid;
+    ATOMIC_STORE(&ring->head, head + 1);
+}
+
+int mem_event_stream_drain(struct mem_event_stream *stream) {
+    struct mem_event_ring **pr;
+    int err;
+    if (stream == NULL)
+        return -EINVAL;
+    MUTEX_LOCK(stream);
+    pr = &stream->rings;
+    while (*pr) {
+        struct mem_event_ring *ring = *pr;
+        bool orphan = ATOMIC_LOAD(&ring->orphan);
+        mem_event_ring_flush(stream, ring);
+        if (orphan) {
+            *pr = ring->next;
+            mem_event_ring_destroy(ring);
+            continue;
+        }
+        pr = &ring->next;
+    }
+    err = stream->err;
+    MUTEX_UNLOCK(stream);
+    return err;
+}
+
+static int mem_event_drainer(void *arg) {
+    struct mem_event_stream *stream = (struct mem_event_stream *)arg;
+    struct timespec slice = {0, MEM_EVENT_SLEEP_SLICE * 1000000};
+    unsigned int elapsed = 0;
+    while (ATOMIC_LOAD(&stream->running)) {
+        thrd_sleep(&slice, NULL);
+        elapsed += MEM_EVENT_SLEEP_SLICE;
+        if (elapsed >= stream->drain_ms) {
+            mem_event_stream_drain(stream);
+            elapsed = 0;
+        }
+    }
+    return 0;
+}
+
+int mem_event_stream_open(struct mem_event_stream **pstream, int fd,
+    size_t ring_size, unsigned int drain_ms, unsigned int options) {
+    struct mem_event_stream *stream;
+    struct mem_event_header hdr;
+    size_t nevents = 1;
+    int err;
+
+    if (pstream == NULL || fd < 0)
+        return -EINVAL;
+    if (ring_size == 0)
+        ring_size = MEM_EVENT_RING_DEFAULT;
+    while (nevents * sizeof(struct mem_event) < ring_size)
+        nevents <<= 1;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = MEM_EVENT_MAGIC;
+    hdr.version = MEM_EVENT_VERSION;
+    hdr.event_size = sizeof(struct mem_event);
+    hdr.options = options;
+    err = mem_event_write(fd, &hdr, sizeof(hdr));
+    if (err)
+        return err;
+    stream = calloc(1, sizeof(*stream));
+    if (stream == NULL)
+        return -ENOMEM;
+    if (tss_create(&stream->key, mem_event_ring_orphan) != thrd_success) {
+        free(stream);
+        return -ENOMEM;
+    }
+    MUTEX_INIT(stream);
+    stream->fd = fd;
+    stream->ring_events = nevents;
+    stream->drain_ms = drain_ms;
+    if (drain_ms > 0) {
+        stream->running = true;
+        if (thrd_create(&stream->drainer, mem_event_drainer, stream) != thrd_success) {
+            tss_delete(stream->key);
+            free(stream);
+            return -ENOMEM;
+        }
+    }
+    *pstream = stream;
+    return 0;
+}
+
+void mem_event_stream_close(struct mem_event_stream *stream) {
+    struct mem_event_ring *ring, *next;
+    if (stream == NULL)
+        return;
+    if (stream->drain_ms > 0) {
+        ATOMIC_STORE(&stream->running, false);
+        thrd_join(stream->drainer, NULL);
+    }
+    mem_event_stream_drain(stream);
+    for (ring = stream->rings; ring != NULL; ring = next) {
+        next = ring->next;
+        mem_event_ring_destroy(ring);
+    }
+    tss_delete(stream->key);
+    MUTEX_DEINIT(stream);
+    free(stream);
+}
+
+#else /* _WIN32 */
+#include <windows.h>
+
+/* Also used for block lifetimes, which do not need the event stream */
+uint64_t mem_event_timestamp(void) {
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+    if (freq.QuadPart == 0)
+        QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (uint64_t)(now.QuadPart / freq.QuadPart) * 1000000000 + 
+        (uint64_t)(now.QuadPart % freq.QuadPart) * 1000000000 / freq.QuadPart;
+}
+
+void mem_event_record(struct mem_event_stream *stream, uint64_t timestamp,
+    unsigned int op, const void *ptr, size_t size, uint32_t stack_id) {
+    (void) stream;
+    (void) timestamp;
+    (void) op;
+    (void) ptr;
+    (void) size;
+    (void) stack_id;
+}
+
+int mem_event_stream_drain(struct mem_event_stream *stream) {
+    (void) stream;
+    return -ENOTSUP;
+}
+
+int mem_event_stream_open(struct mem_event_stream **pstream, int fd,
+    size_t ring_size, unsigned int drain_ms, unsigned int options) {
+    (void) pstream;
+    (void) fd;
+    (void) ring_size;
+    (void) drain_ms;
+    (void) options;
+    return -ENOTSUP;
+}
+
+void mem_event_stream_close(struct mem_event_stream *stream) {
+    (void) stream;
+}
+#endif /* _WIN32 */
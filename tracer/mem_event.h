@@ -0,0 +1,78 @@
+/*
+ * Copyright 2022 wtcat
+ */
+#ifndef TRACER_MEM_EVENT_H_
+#define TRACER_MEM_EVENT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+/*
+ * Event stream file: one struct mem_event_header followed by fixed-size
+ * struct mem_event records. Records of different threads are interleaved
+ * in chunks, sorting them by timestamp gives the order of the heap
+ * operations: the timestamp of a free is taken before the block is
+ * released and the one of an allocation after it is obtained.
+ */
+#define MEM_EVENT_MAGIC   0x5645544D /* "MTEV" */
+#define MEM_EVENT_VERSION 2
+
+enum mem_event_op {
+    MEM_EVENT_ALLOC = 1,
+    MEM_EVENT_FREE  = 2
+};
+
+/*
+ * Or'ed into the operation of blocks that are not traced (unsampled, or
+ * unknown to the tracer on free): no stack id, and no size on free.
+ */
+#define MEM_EVENT_UNSAMPLED 0x80
+
+struct mem_event_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t event_size;
+    uint32_t options;
+    uint32_t reserved;
+};
+
+struct mem_event {
+#define MEM_EVENT_OP_SHIFT 56
+#define MEM_EVENT_SIZE_MASK ((UINT64_C(1) << MEM_EVENT_OP_SHIFT) - 1)
+    uint64_t timestamp; /* CLOCK_MONOTONIC nanoseconds */
+    uint64_t ptr;
+    uint64_t size_op;   /* operation in the top byte */
+    uint32_t stack_id;
+    uint32_t tid;
+};
+
+static inline unsigned int mem_event_op(const struct mem_event *e) {
+    return (unsigned int)(e->size_op >> MEM_EVENT_OP_SHIFT) & ~MEM_EVENT_UNSAMPLED;
+}
+
+static inline int mem_event_unsampled(const struct mem_event *e) {
+    return (e->size_op >> MEM_EVENT_OP_SHIFT) & MEM_EVENT_UNSAMPLED? 1: 0;
+}
+
+static inline uint64_t mem_event_size(const struct mem_event *e) {
+    return e->size_op & MEM_EVENT_SIZE_MASK;
+}
+
+struct mem_event_stream;
+
+int mem_event_stream_open(struct mem_event_stream **pstream, int fd,
+    size_t ring_size, unsigned int drain_ms, unsigned int options);
+int mem_event_stream_drain(struct mem_event_stream *stream);
+void mem_event_stream_close(struct mem_event_stream *stream);
+uint64_t mem_event_timestamp(void);
+void mem_event_record(struct mem_event_stream *stream, uint64_t timestamp,
+    unsigned int op, const void *ptr, size_t size, uint32_t stack_id);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* TRACER_MEM_EVENT_H_ */
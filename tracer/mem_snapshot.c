@@ -0,0 +1,155 @@
+/*
+ * Copyright 2022 wtcat
+ */
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_MSC_VER)
+#include <io.h>
+#define read _read
+#define write _write
+#else
+#include <unistd.h>
+#endif
+
+#include "tracer/mem_snapshot.h"
+
+struct mem_snapshot *mem_snapshot_allocate(size_t capacity) {
+    struct mem_snapshot *snap;
+    snap = malloc(sizeof(*snap) + capacity * sizeof(struct mem_snapshot_entry));
+    if (snap != NULL) {
+        memset(&snap->hdr, 0, sizeof(snap->hdr));
+        snap->hdr.magic = MEM_SNAPSHOT_MAGIC;
+        snap->hdr.version = MEM_SNAPSHOT_VERSION;
+        snap->hdr.entry_size = sizeof(struct mem_snapshot_entry);
+    }
+    return snap;
+}
+
+void mem_snapshot_free(struct mem_snapshot *snap) {
+    free(snap);
+}
+
+static int snapshot_write(int fd, const void *buf, size_t len) {
+    const char *p = (const char *)buf;
+    while (len > 0) {
+        long n = (long)write(fd, p, (unsigned int)len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int snapshot_read(int fd, void *buf, size_t len) {
+    char *p = (char *)buf;
+    while (len > 0) {
+        long n = (long)read(fd, p, (unsigned int)len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        if (n == 0)
+            return -EIO;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int mem_snapshot_save(const struct mem_snapshot *snap, int fd) {
+    int err;
+    if (snap == NULL || fd < 0)
+        return -EINVAL;
+    err = snapshot_write(fd, &snap->hdr, sizeof(snap->hdr));
+    if (!err) {
+        err = snapshot_write(fd, snap->entries,
+            snap->hdr.count * sizeof(struct mem_snapshot_entry));
+    }
+    return err;
+}
+
+int mem_snapshot_load(struct mem_snapshot **psnap, int fd) {
+    struct mem_snapshot_header hdr;
+    struct mem_snapshot *snap;
+    int err;
+    if (psnap == NULL || fd < 0)
+        return -EINVAL;
+    err = snapshot_read(fd, &hdr, sizeof(hdr));
+    if (err)
+        return err;
+    if (hdr.magic != MEM_SNAPSHOT_MAGIC || hdr.version != MEM_SNAPSHOT_VERSION ||
+        hdr.entry_size != sizeof(struct mem_snapshot_entry) ||
+        hdr.count > SIZE_MAX / sizeof(struct mem_snapshot_entry))
+        return -EINVAL;
+    snap = mem_snapshot_allocate((size_t)hdr.count);
+    if (snap == NULL)
+        return -ENOMEM;
+    snap->hdr = hdr;
+    err = snapshot_read(fd, snap->entries,
+        (size_t)hdr.count * sizeof(struct mem_snapshot_entry));
+    if (err) {
+        mem_snapshot_free(snap);
+        return err;
+    }
+    *psnap = snap;
+    return 0;
+}
+
+static int delta_compare(const void *a, const void *b) {
+    const struct mem_snapshot_delta *d1 = (const struct mem_snapshot_delta *)a;
+    const struct mem_snapshot_delta *d2 = (const struct mem_snapshot_delta *)b;
+    if (d1->live_bytes != d2->live_bytes)
+        return d1->live_bytes < d2->live_bytes? 1: -1;
+    if (d1->alloc_bytes != d2->alloc_bytes)
+        return d1->alloc_bytes < d2->alloc_bytes? 1: -1;
+    return d1->stack_id < d2->stack_id? -1: d1->stack_id > d2->stack_id;
+}
+
+/* Both entry arrays are ordered by stack id, a single merge pairs them */
+int mem_snapshot_diff(const struct mem_snapshot *a, const struct mem_snapshot *b,
+    struct mem_snapshot_delta **pdelta, size_t *count) {
+    static const struct mem_snapshot_entry empty;
+    struct mem_snapshot_delta *delta;
+    size_t i = 0, j = 0, n = 0;
+
+    if (a == NULL || b == NULL || pdelta == NULL || count == NULL)
+        return -EINVAL;
+    delta = malloc((a->hdr.count + b->hdr.count + 1) * sizeof(*delta));
+    if (delta == NULL)
+        return -ENOMEM;
+    while (i < a->hdr.count || j < b->hdr.count) {
+        const struct mem_snapshot_entry *ea = &empty, *eb = &empty;
+        struct mem_snapshot_delta *d = &delta[n];
+        if (j == b->hdr.count ||
+            (i < a->hdr.count && a->entries[i].stack_id < b->entries[j].stack_id)) {
+            ea = &a->entries[i++];
+        } else if (i == a->hdr.count ||
+            b->entries[j].stack_id < a->entries[i].stack_id) {
+            eb = &b->entries[j++];
+        } else {
+            ea = &a->entries[i++];
+            eb = &b->entries[j++];
+        }
+        d->stack_id = (ea != &empty)? ea->stack_id: eb->stack_id;
+        d->live_bytes = (int64_t)(eb->live_bytes - ea->live_bytes);
+        d->live_count = (int64_t)(eb->live_count - ea->live_count);
+        /* Cumulative totals never decrease within one run */
+        d->alloc_bytes = (eb->alloc_bytes > ea->alloc_bytes)?
+            eb->alloc_bytes - ea->alloc_bytes: 0;
+        d->alloc_count = (eb->alloc_count > ea->alloc_count)?
+            eb->alloc_count - ea->alloc_count: 0;
+        if (d->live_bytes || d->live_count || d->alloc_count)
+            n++;
+    }
+    qsort(delta, n, sizeof(*delta), delta_compare);
+    *pdelta = delta;
+    *count = n;
+    return 0;
+}
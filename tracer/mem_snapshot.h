@@ -0,0 +1,71 @@
+/*
+ * Copyright 2022 wtcat
+ */
+#ifndef TRACER_MEM_SNAPSHOT_H_
+#define TRACER_MEM_SNAPSHOT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+/*
+ * Per-callsite totals at one point in time (mem_tracer_snapshot), one
+ * entry per stack id in ascending order. The file format is the header
+ * followed by the entries. Stack ids are those of the process that took
+ * the snapshot, the "S" lines of a MEM_DUMP_RAW dump of the same run
+ * map them to instruction pointers.
+ */
+#define MEM_SNAPSHOT_MAGIC   0x50534D4D /* "MMSP" */
+#define MEM_SNAPSHOT_VERSION 1
+
+struct mem_snapshot_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t entry_size;
+    uint64_t timestamp; /* UTC nanoseconds */
+    uint64_t count;
+    uint64_t live_bytes;
+    uint64_t live_count;
+};
+
+struct mem_snapshot_entry {
+    uint32_t stack_id;
+    uint32_t reserved;
+    uint64_t live_bytes;
+    uint64_t live_count;
+    uint64_t alloc_bytes;
+    uint64_t alloc_count;
+};
+
+struct mem_snapshot {
+    struct mem_snapshot_header hdr;
+    struct mem_snapshot_entry entries[];
+};
+
+/* Change of one callsite from snapshot a to snapshot b */
+struct mem_snapshot_delta {
+    uint32_t stack_id;
+    int64_t live_bytes;
+    int64_t live_count;
+    uint64_t alloc_bytes;
+    uint64_t alloc_count;
+};
+
+struct mem_snapshot *mem_snapshot_allocate(size_t capacity);
+void mem_snapshot_free(struct mem_snapshot *snap);
+int mem_snapshot_save(const struct mem_snapshot *snap, int fd);
+int mem_snapshot_load(struct mem_snapshot **psnap, int fd);
+/*
+ * Callsites whose live bytes or allocations changed, by live byte growth
+ * (largest first). The array is released with free().
+ */
+int mem_snapshot_diff(const struct mem_snapshot *a, const struct mem_snapshot *b,
+    struct mem_snapshot_delta **pdelta, size_t *count);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* TRACER_MEM_SNAPSHOT_H_ */
@@ -2,63 +2,84 @@
  * Copyright 2022 wtcat
  */
 #include <errno.h>
+#include <inttypes.h>
+#include <math.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
-#if !defined(_MSC_VER)
+#if !defined(_WIN32)
+#include <signal.h>
 #include <threads.h>
+#include <unistd.h>
 #endif
 #include "base/list.h"
+#include "base/atomic.h"
+#include "base/mutex.h"
 #include "base/utils.h"
 #include "base/printer.h"
 #include "base/allocator.h"
 #include "base/assert.h"
 #include "base/backtrace.h"
+#include "base/redzone.h"
 #include "tracer/tracer_core.h"
+#include "tracer/guard_alloc.h"
+#include "tracer/mem_event.h"
+#include "tracer/mem_snapshot.h"
+#include "tracer/pprof_writer.h"
 #include "tracer/mem_tracer.h"
 
 
-/* For thread safe */
-#if !defined(_MSC_VER)
-#define MUTEX_LOCK_DECLARE(name) mtx_t name
-#define MUTEX_INIT(_path) \
-    mtx_init(&(_path)->lock, mtx_plain)
-#define MUTEX_LOCK(_path) \
-    mtx_lock(&(_path)->lock)
-#define MUTEX_UNLOCK(_path) \
-    mtx_unlock(&(_path)->lock)
-#define MUTEX_DEINIT(_path) \
-    (void) (_path)
-#else
-#include <windows.h>
-#define MUTEX_LOCK_DECLARE(name) HANDLE name
-#define MUTEX_INIT(_path) \
-    (_path)->lock = CreateMutex(NULL, FALSE, NULL)
-#define MUTEX_LOCK(_path) \
-    WaitForSingleObject((_path)->lock, INFINITE)
-#define MUTEX_UNLOCK(_path) \
-    ReleaseMutex((_path)->lock)
-#define MUTEX_DEINIT(_path) \
-    CloseHandle((_path)->lock)
-#endif
-
-/* For memory overflow check */
-typedef size_t _mem_fill_t; 
+/*
+ * For memory overflow check. A block is laid out as 
+ * [prot_mem][head zone][buffer][tail zone], the tail zone starts right 
+ * after the requested size and both zones are filled with 
+ * REDZONE_PATTERN. The buffer keeps the 16 byte alignment of malloc.
+ */
 struct prot_mem {
-    _mem_fill_t magic;
-    _mem_fill_t size;
+    size_t magic;
+    size_t size;
     char buffer[];
 #define PROTMEM_MAGIC 0xDEADBEEF
+#define PROTMEM_ALIGN 16
 #define PROTMEM_ALIGN_SIZE(_size) \
-    (((_size) + (sizeof(_mem_fill_t) - 1)) & ~(sizeof(_mem_fill_t) - 1))
-#define PROTMEM_GET_SIZE(_size) \
-    (PROTMEM_ALIGN_SIZE(_size) + sizeof(struct prot_mem) + sizeof(_mem_fill_t))
-#define PROTMEM_WRITE(_ptr, _ofs, _v) \
-    *(_mem_fill_t *)((char *)(_ptr) + (_ofs)) = (_v)
-#define PROTMEM_READ(_ptr, _ofs) \
-    *(_mem_fill_t *)((char *)(_ptr) + (_ofs))
+    (((_size) + (PROTMEM_ALIGN - 1)) & ~(size_t)(PROTMEM_ALIGN - 1))
+#define PROTMEM_DEFAULT_REDZONE 16
+};
+
+struct protmem_allocator {
+    struct mem_allocator base;
+    size_t head;
+    size_t tail;
+    bool used;  /* Zone widths are fixed once a block is out */
+};
+
+/*
+ * Background redzone verification. Each tick checks a bounded number 
+ * of blocks under one shard lock and leaves the callsite lists in 
+ * order. The cursor (shard, chunk, site) belongs to the scanner thread 
+ * alone, callsites are only freed by mem_tracer_destory(), which joins 
+ * the thread before rewinding the cursor and starts it again afterwards. 
+ * The position in the callsite list is kept in the shard, under its 
+ * lock, and moved on by the free path when that block goes away.
+ */
+struct mem_scanner {
+#define MEM_SCAN_DEFAULT_INTERVAL 10
+#define MEM_SCAN_DEFAULT_BATCH 4096
+#define MEM_SCAN_REPORTS 16
+#if !defined(_WIN32)
+    thrd_t thread;
+#endif
+    bool running;
+    unsigned int interval_ms;
+    size_t batch;
+    size_t shard;
+    struct mem_site_chunk *chunk;
+    size_t site;
+    size_t passes;
+    size_t corrupted;
 };
 
 struct mem_argument {
@@ -68,30 +89,142 @@ struct mem_argument {
         size_t msize;
     };
     size_t mcount;
-    bool dis_print;
+};
+
+/*
+ * Records are spread over address-hashed shards, each one with its 
+ * own lock, so that threads working on unrelated blocks do not 
+ * serialize on a single mutex.
+ */
+struct mem_shard {
+    struct record_class base;
+    struct record_tree tree;    /* Callsites by stack id */
+    struct mem_site_chunk *chunks;
+    size_t nsites;
+    size_t nblocks;
+    size_t live_bytes;
+    size_t live_count;
+    struct list_head quarantine;    /* Freed blocks, oldest first */
+    size_t quarantine_bytes;
+    struct list_head *scan_pos;     /* Next block for the scanner, or NULL */
+    MUTEX_LOCK_DECLARE(lock);
+};
+
+/*
+ * High watermark of the recorded live bytes. The callsite breakdown is 
+ * captured again only once the live total has grown by a step above 
+ * the last capture, so alloc/free pay one atomic add and a compare, 
+ * and the kept breakdown is within one step of the true peak.
+ */
+struct mem_peak {
+#define MEM_PEAK_DEFAULT_GRANULARITY (64 * 1024)
+#define MEM_PEAK_STEP_SHIFT 4
+    size_t live_bytes;
+    size_t peak_bytes;
+    size_t next_capture;
+    size_t granularity;
+    size_t busy;
+    struct mem_snapshot *snap;  /* Protected by lock */
+    MUTEX_LOCK_DECLARE(lock);
 };
 
 struct path_class {
 #define PATH_SEPARATOR_SIZE 16
-    struct record_class base;
-    struct record_tree tree;
+#define MEM_SHARD_COUNT 16
+#define MEM_SHARD_SHIFT 12
+#define MEM_SAMPLE_FILTER_SIZE 16384
+#define MEM_SAMPLE_DEFAULT_INTERVAL (512 * 1024)
+#define MEM_SYMBOL_CACHE_SIZE (4 * 1024 * 1024)
+#define MEM_GUARD_CACHE_SIZE (64 * 1024 * 1024)
+#define MEM_QUARANTINE_SIZE (16 * 1024 * 1024)
+    struct backtrace_class tracer;
+    struct mem_shard *shards;
+    size_t nshards;
+    uint32_t *sample_filter;
+    size_t sample_interval;
     struct mem_allocator *allocator;
+    struct mem_allocator *meta_allocator;
     const struct printer *vio;
-    MUTEX_LOCK_DECLARE(lock);
+    struct mem_event_stream *events;
+    struct mem_peak *peak;
+    struct guard_pool *guard;
+    int guard_fd;               /* Guard page fault reports */
+    struct protmem_allocator *protmem;
+    size_t quarantine_limit;    /* Per shard */
+    struct mem_scanner *scanner;
     size_t path_size;
     char separator[PATH_SEPARATOR_SIZE];
     unsigned int options;
+    bool symbol_persist;
+};
+
+/*
+ * Blocks of one shard allocated from the same call path, with running 
+ * totals so that summaries do not walk the blocks. The totals are 
+ * estimates in MEM_SAMPLE_BYTES mode. A callsite stays in the tree 
+ * after its last block is freed to keep the allocation history.
+ */
+struct mem_callsite {
+    rbtree_node rbnode;
+    struct list_head blocks;
+    stack_id_t stack_id;
+    size_t alloc_bytes;
+    size_t alloc_count;
+    size_t free_bytes;
+    size_t free_count;
+    size_t *lifetime;   /* MEM_LIFETIME_BUCKETS, NULL without MEM_LIFETIME */
+    size_t *sizes;      /* MEM_SIZE_BUCKETS, NULL without MEM_SIZE_HIST */
+};
+
+/*
+ * Callsites are never freed alone, they are carved out of chunks. The 
+ * histograms enabled by the options follow the chunk in the same 
+ * allocation.
+ */
+struct mem_site_chunk {
+#define MEM_SITE_CHUNK_SIZE 64
+    struct mem_site_chunk *next;
+    size_t count;
+    struct mem_callsite sites[MEM_SITE_CHUNK_SIZE];
+    size_t hist[];
 };
 
 struct mem_record_node {
     struct record_node base;
-    rbtree_node rbnode;
-    union {
-        struct list_head head;
-        struct list_head node;
-    };
+    struct mem_callsite *site;
+    struct list_head node;
     void  *ptr;
     size_t size;
+    size_t sample_period;
+    uint64_t timestamp;     /* MEM_LIFETIME */
+    stack_id_t free_stack_id;   /* MEM_QUARANTINE */
+    uint32_t scan_bad: 1;       /* Already reported by the scanner */
+    uint32_t family: 2;         /* enum mem_alloc_family */
+};
+
+/* Block copied out of a shard for MEM_DUMP_RAW */
+struct mem_raw_block {
+    void *ptr;
+    size_t size;
+    size_t sample_period;
+    stack_id_t stack_id;
+};
+
+/* One run per shard, each one in stack id order */
+struct mem_raw_snapshot {
+    struct mem_raw_block *blocks;
+    size_t count;
+    size_t capacity;
+    size_t runs[MEM_SHARD_COUNT + 1];
+};
+
+/*
+ * Per-thread Poisson sampler: the distance between samples is drawn 
+ * from an exponential distribution whose mean is the sample interval.
+ */
+struct mem_sampler {
+    intptr_t bytes_until_sample;
+    uint64_t rng;
 };
 
 _Static_assert(sizeof(struct path_class) <= MTRACER_INST_SIZE, "Over size");
@@ -102,13 +235,13 @@ static const char mdump_info[] = {
     "******************************************************\n"
 };
 
-static rbtree_compare_result sum_compare(const rbtree_node *a,
+static rbtree_compare_result site_compare(const rbtree_node *a,
     const rbtree_node *b) {
     ASSERT_TRUE(a != NULL);
     ASSERT_TRUE(b != NULL);
-    struct mem_record_node *p1 = CONTAINER_OF(a, struct mem_record_node, rbnode);
-    struct mem_record_node *p2 = CONTAINER_OF(b, struct mem_record_node, rbnode);
-    return core_record_ip_compare(&p1->base, &p2->base);
+    struct mem_callsite *p1 = CONTAINER_OF(a, struct mem_callsite, rbnode);
+    struct mem_callsite *p2 = CONTAINER_OF(b, struct mem_callsite, rbnode);
+    return (long)p1->stack_id - (long)p2->stack_id;
 }
 
 static rbtree_compare_result ptr_compare(const rbtree_node *a,
@@ -118,37 +251,120 @@ static rbtree_compare_result ptr_compare(const rbtree_node *a,
     return (long)p1->ptr - (long)p2->ptr;
 }
 
+static inline struct mem_shard *mem_shard_of(struct path_class *path, 
+    const void *ptr) {
+    uint32_t key = (uint32_t)((uintptr_t)ptr >> MEM_SHARD_SHIFT);
+    key *= 0x9E3779B1U;
+    return &path->shards[(key >> 16) & (path->nshards - 1)];
+}
+
+static void mem_lock_all(struct path_class *path) {
+    for (size_t i = 0; i < path->nshards; i++)
+        MUTEX_LOCK(&path->shards[i]);
+}
+
+static void mem_unlock_all(struct path_class *path) {
+    for (size_t i = path->nshards; i > 0; i--)
+        MUTEX_UNLOCK(&path->shards[i - 1]);
+}
+
+static uintptr_t ptr_key(const struct record_node *n) {
+    const struct mem_record_node *mrn = CONTAINER_OF(n, struct mem_record_node, base);
+    return (uintptr_t)mrn->ptr;
+}
+
 static struct mem_record_node *mem_find(struct record_class *rc, void *ptr) {
-    rbtree_node *found;
+    struct record_node *found;
     if (rc == NULL || ptr == NULL)
         return NULL;
     struct mem_record_node mrn;
     mrn.ptr = ptr;
-    found = rbtree_find(&rc->tree.root, &mrn.base.node, rc->tree.compare, true);
+    found = core_record_find(rc, &mrn.base);
     if (found)
-        return CONTAINER_OF(found, struct mem_record_node, base.node);
+        return CONTAINER_OF(found, struct mem_record_node, base);
     return NULL;
 }
 
-static int mem_instert(struct path_class *path, struct mem_record_node *node, bool reset) {
+static struct mem_record_node *mem_find_lower(struct path_class *path, void *ptr) {
+    struct mem_record_node mrn, *lower = NULL;
+    mrn.ptr = ptr;
+    for (size_t i = 0; i < path->nshards; i++) {
+        struct record_node *rn = core_record_lower(&path->shards[i].base, &mrn.base);
+        if (rn != NULL) {
+            struct mem_record_node *p = CONTAINER_OF(rn, struct mem_record_node, base);
+            if (lower == NULL || (uintptr_t)p->ptr > (uintptr_t)lower->ptr)
+                lower = p;
+        }
+    }
+    return lower;
+}
+
+static struct mem_callsite *mem_callsite_get(struct path_class *path, 
+    struct mem_shard *shard, stack_id_t id) {
+    struct mem_callsite key, *site;
+    size_t nbuckets = 0;
     rbtree_node *found;
-    if (path == NULL || node == NULL)
-        return -EINVAL;
-    found = rbtree_insert(&path->tree.root, &node->rbnode, path->tree.compare, true);
-    if (found) {
-        struct mem_record_node *hnode = CONTAINER_OF(found, struct mem_record_node, rbnode);
-        list_add_tail(&node->node, &hnode->head);
-    } else if (reset) {
-        INIT_LIST_HEAD(&node->head);
+    key.stack_id = id;
+    found = rbtree_find(&shard->tree.root, &key.rbnode, shard->tree.compare, true);
+    if (found)
+        return CONTAINER_OF(found, struct mem_callsite, rbnode);
+    if (path->options & MEM_LIFETIME)
+        nbuckets += MEM_LIFETIME_BUCKETS;
+    if (path->options & MEM_SIZE_HIST)
+        nbuckets += MEM_SIZE_BUCKETS;
+    if (shard->chunks == NULL || shard->chunks->count == MEM_SITE_CHUNK_SIZE) {
+        struct mem_site_chunk *chunk;
+        chunk = memory_allocate(path->meta_allocator, sizeof(*chunk) + 
+            MEM_SITE_CHUNK_SIZE * nbuckets * sizeof(size_t), NULL);
+        if (chunk == NULL)
+            return NULL;
+        chunk->count = 0;
+        chunk->next = shard->chunks;
+        shard->chunks = chunk;
+    }
+    site = &shard->chunks->sites[shard->chunks->count];
+    memset(site, 0, sizeof(*site));
+    if (nbuckets) {
+        size_t *hist = &shard->chunks->hist[shard->chunks->count * nbuckets];
+        memset(hist, 0, nbuckets * sizeof(size_t));
+        if (path->options & MEM_LIFETIME) {
+            site->lifetime = hist;
+            hist += MEM_LIFETIME_BUCKETS;
+        }
+        if (path->options & MEM_SIZE_HIST)
+            site->sizes = hist;
+    }
+    shard->chunks->count++;
+    site->stack_id = id;
+    INIT_LIST_HEAD(&site->blocks);
+    rbtree_insert(&shard->tree.root, &site->rbnode, shard->tree.compare, true);
+    shard->nsites++;
+    return site;
+}
+
+static inline struct mem_record_node *mem_callsite_first(struct mem_callsite *site) {
+    return CONTAINER_OF(site->blocks.next, struct mem_record_node, node);
+}
+
+/* Shard totals are read without the lock by mem_tracer_get_used() */
+static inline void mem_shard_account(struct mem_shard *shard, size_t bytes, 
+    size_t count, bool add) {
+    if (add) {
+        ATOMIC_STORE_RELAXED(&shard->live_bytes, shard->live_bytes + bytes);
+        ATOMIC_STORE_RELAXED(&shard->live_count, shard->live_count + count);
+        shard->nblocks++;
+    } else {
+        ATOMIC_STORE_RELAXED(&shard->live_bytes, shard->live_bytes - bytes);
+        ATOMIC_STORE_RELAXED(&shard->live_count, shard->live_count - count);
+        shard->nblocks--;
     }
-    return 0;
 }
 
 static void mem_path_print(struct path_class *path, struct mem_record_node *node, 
     const char *separator) {
     const struct printer *vio = path->vio;
     virt_print(vio, "%s", "<Path>: ");
-    core_record_print_path(&path->base, &node->base, vio, path->separator);
+    core_record_print_path(&path->shards[0].base, &node->base, vio, path->separator);
     virt_print(vio, "\n");
 }
 
@@ -157,97 +373,814 @@ static bool free_iterator(struct record_node *n, void *u) {
     struct mem_record_node *mrn = CONTAINER_OF(n, 
         struct mem_record_node, base);
     if (mrn->ptr) {
-        memory_free(path->allocator, mrn->ptr, mrn);
+        memory_free(path->allocator, mrn->ptr, NULL);
         mrn->ptr = NULL;
     }
     return true;
 }
 
+/*
+ * A block of @size bytes is sampled with probability 1 - exp(-size/period),
+ * dividing by it gives an unbiased estimate of the bytes and blocks that 
+ * the sample stands for.
+ */
+static size_t mem_node_estimate(const struct mem_record_node *mrn, size_t *count) {
+    double scale;
+    if (mrn->sample_period == 0) {
+        *count = 1;
+        return mrn->size;
+    }
+    scale = 1.0 / (1.0 - exp(-(double)mrn->size / (double)mrn->sample_period));
+    *count = (size_t)(scale + 0.5);
+    return (size_t)(mrn->size * scale + 0.5);
+}
+
 static bool iterator(struct record_node *n, void *u) {
     struct mem_argument *ia = (struct mem_argument *)u;
     struct mem_record_node *mrn = CONTAINER_OF(n, struct mem_record_node, base);
-    ia->msize += mrn->size;
-    ia->mcount++;
-    if (!ia->dis_print) {
-        const struct printer *vio = ia->path->vio;
-        mem_path_print(ia->path, mrn, ia->path->separator);
-        virt_print(vio, "\tMemory: %p Size: %ld\n",
-            mrn->ptr, mrn->size);
-    }
+    size_t count;
+    ia->msize += mem_node_estimate(mrn, &count);
+    ia->mcount += count;
+    mem_path_print(ia->path, mrn, ia->path->separator);
+    virt_print(ia->path->vio, "\tMemory: %p Size: %ld\n",
+        mrn->ptr, mrn->size);
     return true;
 }
 
-static bool sorted_iterator(const rbtree_node *node, void *arg) {
+static void mem_visitor(struct path_class *path, 
+    bool (*iterator)(struct record_node *n, void *u), void *user) {
+    for (size_t i = 0; i < path->nshards; i++)
+        core_record_visitor(&path->shards[i].base, iterator, user);
+}
+
+/*
+ * Blocks with the same path may live in different shards, the 
+ * iterator receives the callsite of every shard that has live blocks 
+ * on the path.
+ */
+static size_t mem_sites_estimate(struct mem_callsite *sites[], size_t n, 
+    size_t *cnt) {
+    size_t sum = 0;
+    *cnt = 0;
+    for (size_t i = 0; i < n; i++) {
+        sum += sites[i]->alloc_bytes - sites[i]->free_bytes;
+        *cnt += sites[i]->alloc_count - sites[i]->free_count;
+    }
+    return sum;
+}
+
+/* Returns the total count of the merged histogram */
+static size_t mem_hist_merge(size_t *hist, struct mem_callsite *sites[], 
+    size_t n, bool sizes) {
+    size_t nbuckets = sizes? MEM_SIZE_BUCKETS: MEM_LIFETIME_BUCKETS;
+    size_t total = 0;
+    memset(hist, 0, nbuckets * sizeof(size_t));
+    for (size_t i = 0; i < n; i++) {
+        const size_t *src = sizes? sites[i]->sizes: sites[i]->lifetime;
+        if (src == NULL)
+            continue;
+        for (size_t k = 0; k < nbuckets; k++) {
+            hist[k] += src[k];
+            total += src[k];
+        }
+    }
+    return total;
+}
+
+/* Non empty buckets as "<upper bound>:count" */
+static void mem_lifetime_print(const struct printer *vio, const size_t *hist) {
+    virt_print(vio, "\tLifetime:");
+    for (size_t k = 0; k < MEM_LIFETIME_BUCKETS; k++) {
+        double ns = ldexp(1.0, (int)k + 10);
+        const char *op = "<";
+        if (hist[k] == 0)
+            continue;
+        if (k == MEM_LIFETIME_BUCKETS - 1) {
+            ns /= 2;
+            op = ">=";
+        }
+        if (ns < 1e6)
+            virt_print(vio, " %s%.0fus:%zu", op, ns / 1e3, hist[k]);
+        else if (ns < 1e9)
+            virt_print(vio, " %s%.0fms:%zu", op, ns / 1e6, hist[k]);
+        else
+            virt_print(vio, " %s%.0fs:%zu", op, ns / 1e9, hist[k]);
+    }
+    virt_print(vio, "\n");
+}
+
+/* Non empty buckets as "<=upper bound:count" */
+static void mem_sizes_print(const struct printer *vio, const size_t *hist) {
+    virt_print(vio, "\tSizes:");
+    for (size_t k = 0; k < MEM_SIZE_BUCKETS; k++) {
+        size_t bound = (size_t)8 << k;
+        const char *op = "<=";
+        if (hist[k] == 0)
+            continue;
+        if (k == MEM_SIZE_BUCKETS - 1) {
+            bound /= 2;
+            op = ">";
+        }
+        if (bound < 1024)
+            virt_print(vio, " %s%zu:%zu", op, bound, hist[k]);
+        else if (bound < 1024 * 1024)
+            virt_print(vio, " %s%zuK:%zu", op, bound >> 10, hist[k]);
+        else
+            virt_print(vio, " %s%zuM:%zu", op, bound >> 20, hist[k]);
+    }
+    virt_print(vio, "\n");
+}
+
+static bool sorted_iterator(struct mem_callsite *sites[], size_t n, void *arg) {
     struct mem_argument *ia = (struct mem_argument *)arg;
     struct path_class *path = ia->path;
     const struct printer *vio = path->vio;
-    size_t sum = 0, cnt = 1;
-
     struct list_head *pos;
-    struct mem_record_node *hnode = CONTAINER_OF(node, struct mem_record_node, rbnode);
-    sum += hnode->size;
+    size_t sum, cnt;
     
-    /* Calculate size and count */
-    list_for_each(pos, &hnode->head) {
-        struct mem_record_node *p = CONTAINER_OF(pos, struct mem_record_node, node);
-        sum += p->size;
-        cnt++;
-    }
+    sum = mem_sites_estimate(sites, n, &cnt);
     virt_print(vio, "\n<Path>@ {Count: %-8d Used: %uB (%.2fKB)}:\n",
         cnt, sum, (float)sum / 1024);
-    core_record_print_path(&path->base, &hnode->base, vio, path->separator);
-    virt_print(vio, "\n\tMemory: 0x%p Size: %ld\n", 
-        hnode->ptr, hnode->size);
-    list_for_each(pos, &hnode->head) {
-        struct mem_record_node *p = CONTAINER_OF(pos, struct mem_record_node, node);
-        virt_print(vio, "\tMemory: 0x%p Size: %ld\n", p->ptr, p->size);
+    core_record_print_path(&path->shards[0].base, 
+        &mem_callsite_first(sites[0])->base, vio, path->separator);
+    virt_print(vio, "\n");
+    if (path->options & MEM_SIZE_HIST) {
+        size_t hist[MEM_SIZE_BUCKETS];
+        if (mem_hist_merge(hist, sites, n, true))
+            mem_sizes_print(vio, hist);
+    }
+    if (path->options & MEM_LIFETIME) {
+        size_t hist[MEM_LIFETIME_BUCKETS];
+        if (mem_hist_merge(hist, sites, n, false))
+            mem_lifetime_print(vio, hist);
+    }
+    for (size_t i = 0; i < n; i++) {
+        list_for_each(pos, &sites[i]->blocks) {
+            struct mem_record_node *p = CONTAINER_OF(pos, struct mem_record_node, node);
+            virt_print(vio, "\tMemory: 0x%p Size: %ld\n", p->ptr, p->size);
+        }
     }
     ia->msize += sum;
     ia->mcount += cnt;
     return false;
 }
 
+static rbtree_node *mem_next_site(rbtree_node *rb, bool live_only) {
+    while (live_only && rb != NULL && 
+        list_empty(&CONTAINER_OF(rb, struct mem_callsite, rbnode)->blocks))
+        rb = rbtree_successor(rb);
+    return rb;
+}
+
+/*
+ * Merge the callsite trees of all shards in stack id order. With 
+ * @live_only, callsites whose blocks have all been freed are skipped.
+ */
+static void mem_sorted_visitor(struct path_class *path, bool live_only, 
+    bool (*iterator)(struct mem_callsite *sites[], size_t n, void *arg), 
+    void *arg) {
+    rbtree_node *cursor[MEM_SHARD_COUNT];
+    struct mem_callsite *sites[MEM_SHARD_COUNT];
+    size_t i;
+
+    for (i = 0; i < path->nshards; i++)
+        cursor[i] = mem_next_site(rbtree_min(&path->shards[i].tree.root), live_only);
+    for ( ; ; ) {
+        struct mem_callsite *min = NULL;
+        size_t n = 0;
+        for (i = 0; i < path->nshards; i++) {
+            struct mem_callsite *p;
+            if (cursor[i] == NULL)
+                continue;
+            p = CONTAINER_OF(cursor[i], struct mem_callsite, rbnode);
+            if (min == NULL || p->stack_id < min->stack_id)
+                min = p;
+        }
+        if (min == NULL)
+            break;
+        for (i = 0; i < path->nshards; i++) {
+            if (cursor[i] == NULL || site_compare(cursor[i], &min->rbnode))
+                continue;
+            sites[n++] = CONTAINER_OF(cursor[i], struct mem_callsite, rbnode);
+            cursor[i] = mem_next_site(rbtree_successor(cursor[i]), live_only);
+        }
+        if (iterator(sites, n, arg))
+            break;
+    }
+}
+
+static void raw_copy(struct mem_raw_snapshot *snap, const struct mem_record_node *mrn) {
+    struct mem_raw_block *blk = &snap->blocks[snap->count++];
+    blk->ptr = mrn->ptr;
+    blk->size = mrn->size;
+    blk->sample_period = mrn->sample_period;
+    blk->stack_id = mrn->base.stack_id;
+}
+
+/*
+ * Walk the callsite tree of @shard so that the copied blocks come out 
+ * grouped and ordered by stack id.
+ */
+static void raw_copy_shard(struct mem_raw_snapshot *snap, struct mem_shard *shard) {
+    rbtree_node *rb;
+    for (rb = rbtree_min(&shard->tree.root); rb; rb = rbtree_successor(rb)) {
+        struct mem_callsite *site = CONTAINER_OF(rb, struct mem_callsite, rbnode);
+        struct list_head *pos;
+        list_for_each(pos, &site->blocks)
+            raw_copy(snap, CONTAINER_OF(pos, struct mem_record_node, node));
+    }
+}
+
+/*
+ * Copy the blocks of every shard, holding one shard lock at a time. 
+ * The buffer is sized ahead and the copy restarts if it turns out 
+ * to be too small.
+ */
+static int mem_raw_snapshot(struct path_class *path, struct mem_raw_snapshot *snap) {
+    for ( ; ; ) {
+        size_t total = 0, i;
+        for (i = 0; i < path->nshards; i++) {
+            MUTEX_LOCK(&path->shards[i]);
+            total += path->shards[i].nblocks;
+            MUTEX_UNLOCK(&path->shards[i]);
+        }
+        snap->capacity = total + total / 4 + 64;
+        snap->count = 0;
+        snap->blocks = memory_allocate(path->meta_allocator, 
+            snap->capacity * sizeof(struct mem_raw_block), NULL);
+        if (snap->blocks == NULL)
+            return -ENOMEM;
+        for (i = 0; i < path->nshards; i++) {
+            struct mem_shard *shard = &path->shards[i];
+            bool overflow;
+            MUTEX_LOCK(shard);
+            overflow = snap->count + shard->nblocks > snap->capacity;
+            snap->runs[i] = snap->count;
+            if (!overflow)
+                raw_copy_shard(snap, shard);
+            MUTEX_UNLOCK(shard);
+            if (overflow)
+                break;
+        }
+        if (i == path->nshards) {
+            snap->runs[i] = snap->count;
+            return 0;
+        }
+        memory_free(path->meta_allocator, snap->blocks, NULL);
+    }
+}
+
+static int raw_module_print(const struct backtrace_module *m, void *arg) {
+    const struct printer *vio = (const struct printer *)arg;
+    virt_print(vio, "M %" PRIxPTR " %" PRIxPTR " %" PRIxPTR " ", 
+        m->start, m->end, m->bias);
+    if (m->build_id_size == 0)
+        virt_print(vio, "-");
+    for (size_t i = 0; i < m->build_id_size; i++)
+        virt_print(vio, "%02x", m->build_id[i]);
+    virt_print(vio, " %s\n", m->path);
+    return 0;
+}
+
+/*
+ * Lines are formatted by hand into a buffer that is handed to the 
+ * printer in large pieces, this keeps the cost close to a memcpy.
+ */
+struct raw_writer {
+#define RAW_WRITER_SIZE 4096
+    const struct printer *vio;
+    size_t len;
+    char buf[RAW_WRITER_SIZE + 1];
+};
+
+static void raw_flush(struct raw_writer *w) {
+    if (w->len) {
+        w->buf[w->len] = '\0';
+        virt_print(w->vio, "%s", w->buf);
+        w->len = 0;
+    }
+}
+
+static void raw_put_char(struct raw_writer *w, char c) {
+    if (w->len == RAW_WRITER_SIZE)
+        raw_flush(w);
+    w->buf[w->len++] = c;
+}
+
+static void raw_put_hex(struct raw_writer *w, uint64_t v) {
+    static const char digits[] = "0123456789abcdef";
+    int shift = 60;
+    if (w->len + 20 > RAW_WRITER_SIZE)
+        raw_flush(w);
+    w->buf[w->len++] = ' ';
+    while (shift > 0 && !(v >> shift))
+        shift -= 4;
+    for ( ; shift >= 0; shift -= 4)
+        w->buf[w->len++] = digits[(v >> shift) & 0xF];
+}
+
+static void raw_put_dec(struct raw_writer *w, uint64_t v) {
+    char tmp[20];
+    size_t n = 0;
+    if (w->len + 24 > RAW_WRITER_SIZE)
+        raw_flush(w);
+    w->buf[w->len++] = ' ';
+    do {
+        tmp[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v);
+    while (n)
+        w->buf[w->len++] = tmp[--n];
+}
+
+static void raw_put_str(struct raw_writer *w, const char *s, size_t len) {
+    while (len > 0) {
+        size_t n;
+        if (w->len == RAW_WRITER_SIZE)
+            raw_flush(w);
+        n = MIN(len, RAW_WRITER_SIZE - w->len);
+        memcpy(w->buf + w->len, s, n);
+        w->len += n;
+        s += n;
+        len -= n;
+    }
+}
+
+/*
+ * Output lines:
+ *  M <start> <end> <bias> <build-id|-> <path>
+ *  S <stack-id> <count> <bytes> <ip>...
+ *  B <ptr> <size> <sample-period>
+ *  T <bytes> <count>
+ */
+static int mem_raw_dump(struct path_class *path) {
+    size_t cursor[MEM_SHARD_COUNT], end[MEM_SHARD_COUNT];
+    struct mem_raw_snapshot snap;
+    struct raw_writer *w;
+    size_t msize = 0, mcount = 0, i;
+    int err;
+
+    err = mem_raw_snapshot(path, &snap);
+    if (err)
+        return err;
+    w = memory_allocate(path->meta_allocator, sizeof(*w), NULL);
+    if (w == NULL) {
+        memory_free(path->meta_allocator, snap.blocks, NULL);
+        return -ENOMEM;
+    }
+    w->vio = path->vio;
+    w->len = 0;
+    virt_print(w->vio, "# mtrace raw 1\n");
+    backtrace_module_iterate(raw_module_print, (void *)w->vio);
+    for (i = 0; i < path->nshards; i++)
+        cursor[i] = snap.runs[i];
+    for ( ; ; ) {
+        stack_id_t id = 0;
+        size_t sum = 0, cnt = 0;
+        struct ip_array ips;
+        bool found = false;
+        /* Merge the shard runs by stack id */
+        for (i = 0; i < path->nshards; i++) {
+            if (cursor[i] < snap.runs[i + 1] && 
+                (!found || snap.blocks[cursor[i]].stack_id < id)) {
+                id = snap.blocks[cursor[i]].stack_id;
+                found = true;
+            }
+        }
+        if (!found)
+            break;
+        for (i = 0; i < path->nshards; i++) {
+            for (end[i] = cursor[i]; end[i] < snap.runs[i + 1] && 
+                snap.blocks[end[i]].stack_id == id; end[i]++) {
+                struct mem_record_node tmp;
+                size_t count;
+                tmp.size = snap.blocks[end[i]].size;
+                tmp.sample_period = snap.blocks[end[i]].sample_period;
+                sum += mem_node_estimate(&tmp, &count);
+                cnt += count;
+            }
+        }
+        raw_put_char(w, 'S');
+        raw_put_dec(w, id);
+        raw_put_dec(w, cnt);
+        raw_put_dec(w, sum);
+        if (!stack_depot_fetch(id, &ips)) {
+            for (size_t k = 0; k < ips.n; k++)
+                raw_put_hex(w, (uintptr_t)ips.ip[k]);
+        }
+        raw_put_char(w, '\n');
+        for (i = 0; i < path->nshards; i++) {
+            for ( ; cursor[i] < end[i]; cursor[i]++) {
+                const struct mem_raw_block *blk = &snap.blocks[cursor[i]];
+                raw_put_char(w, 'B');
+                raw_put_hex(w, (uintptr_t)blk->ptr);
+                raw_put_dec(w, blk->size);
+                raw_put_dec(w, blk->sample_period);
+                raw_put_char(w, '\n');
+            }
+        }
+        msize += sum;
+        mcount += cnt;
+    }
+    raw_flush(w);
+    virt_print(w->vio, "T %zu %zu\n", msize, mcount);
+    memory_free(path->meta_allocator, w, NULL);
+    memory_free(path->meta_allocator, snap.blocks, NULL);
+    return 0;
+}
+
+/* Frame names of a folded dump, every instruction pointer is resolved once */
+struct folded_name {
+    struct folded_name *next;
+    char name[];
+};
+
+struct folded_argument {
+    struct path_class *path;
+    struct raw_writer *w;
+    struct ptrhash names;
+    struct folded_name *list;
+    int err;
+};
+
+static const char *folded_frame_name(struct folded_argument *fa, void *ip) {
+    char symbol[256], addr[32];
+    struct folded_name *fn;
+    const char *name = NULL;
+    size_t len = 0;
+    ssize_t ret;
+
+    fn = ptrhash_find(&fa->names, (uintptr_t)ip);
+    if (fn != NULL)
+        return fn->name;
+    ret = backtrace_transform_symbol(&fa->path->tracer, ip, symbol, sizeof(symbol));
+    if (ret > 0)
+        len = backtrace_symbol_name(symbol, &name);
+    if (len == 0) {
+        len = snprintf(addr, sizeof(addr), "%p", ip);
+        name = addr;
+    }
+    fn = memory_allocate(fa->path->meta_allocator, sizeof(*fn) + len + 1, NULL);
+    if (fn == NULL)
+        return NULL;
+    /* ';' separates the frames */
+    for (size_t i = 0; i < len; i++)
+        fn->name[i] = (name[i] == ';')? ':': name[i];
+    fn->name[len] = '\0';
+    if (ptrhash_insert(&fa->names, (uintptr_t)ip, fn)) {
+        memory_free(fa->path->meta_allocator, fn, NULL);
+        return NULL;
+    }
+    fn->next = fa->list;
+    fa->list = fn;
+    return fn->name;
+}
+
+static bool folded_iterator(struct mem_callsite *sites[], size_t n, void *arg) {
+    struct folded_argument *fa = (struct folded_argument *)arg;
+    struct ip_array ips;
+    size_t sum, cnt, k;
+    bool first = true;
+
+    sum = mem_sites_estimate(sites, n, &cnt);
+    if (stack_depot_fetch(sites[0]->stack_id, &ips))
+        return false;
+    for (k = 0; k < ips.n; k++) {
+        const char *name;
+        if ((uintptr_t)ips.ip[k] < 2)
+            continue;
+        name = folded_frame_name(fa, ips.ip[k]);
+        if (name == NULL) {
+            fa->err = -ENOMEM;
+            return true;
+        }
+        if (!first)
+            raw_put_char(fa->w, ';');
+        raw_put_str(fa->w, name, strlen(name));
+        first = false;
+    }
+    raw_put_dec(fa->w, sum);
+    raw_put_char(fa->w, '\n');
+    return false;
+}
+
+/*
+ * One "frame;frame;... bytes" line per call path, outermost frame 
+ * first, as consumed by flamegraph.pl.
+ */
+static int mem_folded_dump(struct path_class *path) {
+    struct folded_argument fa = {0};
+    struct folded_name *fn;
+
+    fa.path = path;
+    fa.w = memory_allocate(path->meta_allocator, sizeof(*fa.w), NULL);
+    if (fa.w == NULL)
+        return -ENOMEM;
+    fa.w->vio = path->vio;
+    fa.w->len = 0;
+    ptrhash_init(&fa.names, path->meta_allocator);
+    mem_lock_all(path);
+    mem_sorted_visitor(path, true, folded_iterator, &fa);
+    if (!path->symbol_persist)
+        backtrace_symbol_cache_flush(&path->tracer);
+    mem_unlock_all(path);
+    raw_flush(fa.w);
+    ptrhash_destroy(&fa.names);
+    while ((fn = fa.list) != NULL) {
+        fa.list = fn->next;
+        memory_free(path->meta_allocator, fn, NULL);
+    }
+    memory_free(path->meta_allocator, fa.w, NULL);
+    return fa.err;
+}
+
+/*
+ * Symbolized call path of @id, released with the meta allocator. 
+ * Called with the tracer locks held.
+ */
+static char *mem_stack_path(struct path_class *path, stack_id_t id) {
+    char buffer[1024];
+    struct ip_array ips;
+    ssize_t len = -ENOENT;
+    char *str;
+    if (!stack_depot_fetch(id, &ips))
+        len = backtrace_transform_path(&path->tracer, &ips, buffer, sizeof(buffer));
+    if (len < 0)
+        len = 0;
+    str = memory_allocate(path->meta_allocator, len + 1, NULL);
+    if (str != NULL) {
+        memcpy(str, buffer, len);
+        str[len] = '\0';
+    }
+    return str;
+}
+
+static int peak_entry_compare(const void *a, const void *b) {
+    const struct mem_snapshot_entry *e1 = (const struct mem_snapshot_entry *)a;
+    const struct mem_snapshot_entry *e2 = (const struct mem_snapshot_entry *)b;
+    if (e1->live_bytes != e2->live_bytes)
+        return e1->live_bytes < e2->live_bytes? 1: -1;
+    return e1->stack_id < e2->stack_id? -1: e1->stack_id > e2->stack_id;
+}
+
+/* Callsites that were live at the peak, largest first */
+static int mem_peak_dump(struct path_class *path) {
+    const struct printer *vio = path->vio;
+    struct mem_snapshot *snap;
+    int err;
+
+    err = mem_tracer_peak_snapshot(path, &snap);
+    if (err)
+        return err;
+    qsort(snap->entries, (size_t)snap->hdr.count, sizeof(snap->entries[0]), 
+        peak_entry_compare);
+    mem_lock_all(path);
+    virt_print(vio, mdump_info);
+    for (size_t i = 0; i < snap->hdr.count; i++) {
+        const struct mem_snapshot_entry *e = &snap->entries[i];
+        char *str;
+        if (e->live_count == 0)
+            break;
+        str = mem_stack_path(path, e->stack_id);
+        virt_print(vio, "\n<Path>@ {Count: %-8zu Used: %zuB (%.2fKB)}:\n%s\n", 
+            (size_t)e->live_count, (size_t)e->live_bytes, 
+            (float)e->live_bytes / 1024, str? str: "");
+        if (str != NULL)
+            memory_free(path->meta_allocator, str, NULL);
+    }
+    virt_print(vio, "\nPeak Used: %zu B (%.2f KB) Breakdown At: %zu B Blocks: %zu\n\n", 
+        ATOMIC_LOAD_RELAXED(&path->peak->peak_bytes), 
+        (float)ATOMIC_LOAD_RELAXED(&path->peak->peak_bytes) / 1024, 
+        (size_t)snap->hdr.live_bytes, (size_t)snap->hdr.live_count);
+    if (!path->symbol_persist)
+        backtrace_symbol_cache_flush(&path->tracer);
+    mem_unlock_all(path);
+    mem_snapshot_free(snap);
+    return 0;
+}
+
+static void lifetime_callback(const struct mem_callsite_stats *stats, void *arg) {
+    const struct printer *vio = (const struct printer *)arg;
+    virt_print(vio, "\n<Path>@ {Freed: %-8zu Live: %-8zu Allocated: %zuB}:\n%s\n", 
+        stats->free_count, stats->live_count, stats->alloc_bytes, stats->path);
+    mem_lifetime_print(vio, stats->lifetime);
+}
+
+/* The callsites that freed the most blocks, with their lifetimes */
+static int mem_lifetime_dump(struct path_class *path) {
+#define MEM_LIFETIME_DUMP_TOP 64
+    const struct printer *vio = path->vio;
+    int ret;
+    if (!(path->options & MEM_LIFETIME))
+        return -EINVAL;
+    virt_print(vio, mdump_info);
+    ret = mem_tracer_top(path, MEM_TOP_FREE_COUNT, MEM_LIFETIME_DUMP_TOP, 
+        lifetime_callback, (void *)vio);
+    virt_print(vio, "\n");
+    return ret < 0? ret: 0;
+}
+
+static void leak_callback(const struct mem_leak_stats *stats, void *arg) {
+    const struct printer *vio = (const struct printer *)arg;
+    virt_print(vio, "\n<Path>@ {Lost: %zuB in %zu Indirect: %zuB in %zu}:\n%s\n", 
+        stats->definite_bytes, stats->definite_count, stats->indirect_bytes, 
+        stats->indirect_count, stats->path? stats->path: "");
+}
+
+static int mem_leak_dump(struct path_class *path) {
+    const struct printer *vio = path->vio;
+    struct mem_leak_stats total;
+    int ret;
+    virt_print(vio, mdump_info);
+    ret = mem_tracer_leak_check(path, false, &total, leak_callback, (void *)vio);
+    if (ret < 0) {
+        virt_print(vio, "\nLeak check failed (%d)\n\n", ret);
+        return ret;
+    }
+    virt_print(vio, "\nDefinitely Lost: %zu B in %zu blocks\n", 
+        total.definite_bytes, total.definite_count);
+    virt_print(vio, "Indirectly Lost: %zu B in %zu blocks\n", 
+        total.indirect_bytes, total.indirect_count);
+    virt_print(vio, "Still Reachable: %zu B in %zu blocks\n\n", 
+        total.reachable_bytes, total.reachable_count);
+    return 0;
+}
+
 static void mem_overflow_dump(struct mem_argument *ia) {
     struct mem_record_node *killer, *victim;
     const struct printer *vio = ia->path->vio;
     victim = ia->mnode;
-    killer = (struct mem_record_node *)core_record_lessthen_node(&ia->mnode->base);
+    mem_lock_all(ia->path);
+    killer = mem_find_lower(ia->path, victim->ptr);
     virt_print(vio, "\n\n@Victime vs @Killer {\n");
     mem_path_print(ia->path, victim, ia->path->separator);
-    mem_path_print(ia->path, killer, ia->path->separator);
+    if (killer != NULL)
+        mem_path_print(ia->path, killer, ia->path->separator);
     virt_print(vio, "\n}\n");
+    mem_unlock_all(ia->path);
+}
+
+#if !defined(_WIN32)
+/* Only one tracer at a time reports guard page faults */
+static struct path_class *guard_owner;
+static struct sigaction guard_prev;
+
+struct mem_fault_buf {
+    char data[2048];
+    size_t len;
+};
+
+static void mem_fault_puts(struct mem_fault_buf *fb, const char *s) {
+    while (*s != '\0' && fb->len < sizeof(fb->data))
+        fb->data[fb->len++] = *s++;
+}
+
+static void mem_fault_putu(struct mem_fault_buf *fb, uintptr_t v, 
+    unsigned int base) {
+    char tmp[24];
+    size_t n = sizeof(tmp);
+    tmp[--n] = '\0';
+    do {
+        tmp[--n] = "0123456789abcdef"[v % base];
+        v /= base;
+    } while (v != 0);
+    if (base == 16)
+        mem_fault_puts(fb, "0x");
+    mem_fault_puts(fb, tmp + n);
+}
+
+/*
+ * Runs on the faulting instruction, so only async-signal-safe calls: 
+ * the block comes from the lock-free guard page table, the path from 
+ * the stack depot as raw addresses, and the report is written to the 
+ * descriptor directly. The stack id matches the MEM_DUMP_RAW dumps. 
+ * The previous action is restored so that the access faults again 
+ * into it once the handler returns.
+ */
+static void mem_guard_fault(int sig, siginfo_t *si, void *uc) {
+    struct path_class *path = ATOMIC_LOAD(&guard_owner);
+    struct guard_block blk;
+    (void) sig;
+    (void) uc;
+    if (path != NULL && guard_pool_lookup(path->guard, si->si_addr, &blk)) {
+        struct mem_fault_buf fb;
+        struct ip_array ips;
+        ssize_t n;
+        fb.len = 0;
+        mem_fault_puts(&fb, "\nError***: Access ");
+        mem_fault_putu(&fb, (uintptr_t)si->si_addr, 16);
+        mem_fault_puts(&fb, " is ");
+        mem_fault_putu(&fb, (uintptr_t)si->si_addr - (uintptr_t)blk.ptr - blk.size, 10);
+        mem_fault_puts(&fb, " bytes past the block ");
+        mem_fault_putu(&fb, (uintptr_t)blk.ptr, 16);
+        mem_fault_puts(&fb, " (");
+        mem_fault_putu(&fb, blk.size, 10);
+        mem_fault_puts(&fb, " bytes), stack id ");
+        mem_fault_putu(&fb, blk.tag, 10);
+        mem_fault_puts(&fb, ":\n<Path>: ");
+        if (!stack_depot_fetch(blk.tag, &ips)) {
+            for (size_t i = 0; i < ips.n; i++) {
+                mem_fault_putu(&fb, (uintptr_t)ips.ip[i], 16);
+                mem_fault_puts(&fb, path->separator);
+            }
+        }
+        mem_fault_puts(&fb, "\n");
+        n = write(path->guard_fd, fb.data, fb.len);
+        (void) n;
+    }
+    sigaction(SIGSEGV, &guard_prev, NULL);
+}
+
+static void mem_guard_install(struct path_class *path) {
+    struct path_class *expected = NULL;
+    struct sigaction sa;
+    if (!ATOMIC_CAS(&guard_owner, &expected, path))
+        return;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = mem_guard_fault;
+    sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGSEGV, &sa, &guard_prev);
 }
 
+static void mem_guard_uninstall(struct path_class *path) {
+    struct path_class *expected = path;
+    if (ATOMIC_CAS(&guard_owner, &expected, NULL))
+        sigaction(SIGSEGV, &guard_prev, NULL);
+}
+#else /* _WIN32 */
+static void mem_guard_install(struct path_class *path) {
+    (void) path;
+}
+
+static void mem_guard_uninstall(struct path_class *path) {
+    (void) path;
+}
+#endif /* _WIN32 */
+
 static void *protmem_alloc(struct mem_allocator *m, size_t size, void *user) {
-    struct prot_mem *ptr;
-    size_t rsize = PROTMEM_GET_SIZE(size);
-    ptr = (struct prot_mem *)memory_allocate(m->context, rsize, user);
-    if (ptr) {
-        size_t aligned_size = PROTMEM_ALIGN_SIZE(size);
+    struct protmem_allocator *pa = CONTAINER_OF(m, struct protmem_allocator, base);
+    size_t tail = PROTMEM_ALIGN_SIZE(size) - size + pa->tail;
+    char *p;
+    if (!ATOMIC_LOAD_RELAXED(&pa->used))
+        ATOMIC_STORE_RELAXED(&pa->used, true);
+    p = (char *)memory_allocate(m->context, sizeof(struct prot_mem) + 
+        pa->head + size + tail, user);
+    if (p) {
+        struct prot_mem *ptr = (struct prot_mem *)p;
         ptr->magic = PROTMEM_MAGIC;
-        ptr->size = aligned_size;
-        PROTMEM_WRITE(ptr->buffer, aligned_size, PROTMEM_MAGIC);
-        return ptr->buffer;
+        ptr->size = size;
+        redzone_fill(ptr->buffer, pa->head);
+        redzone_fill(ptr->buffer + pa->head + size, tail);
+        return ptr->buffer + pa->head;
     }
     return NULL;
 }
 
+static inline struct prot_mem *protmem_header(struct protmem_allocator *pa, 
+    void *p) {
+    return (struct prot_mem *)((char *)p - pa->head - sizeof(struct prot_mem));
+}
+
+/*
+ * Returns the offset of the first corrupted byte relative to @p, 
+ * negative in the head zone, or 0 if the block is intact.
+ */
+static ptrdiff_t protmem_verify(struct protmem_allocator *pa, void *p) {
+    struct prot_mem *ptr = protmem_header(pa, p);
+    size_t tail, ofs;
+    if (ptr->magic != PROTMEM_MAGIC)
+        return -(ptrdiff_t)(pa->head + sizeof(struct prot_mem));
+    ofs = redzone_check(ptr->buffer, pa->head);
+    if (ofs < pa->head)
+        return -(ptrdiff_t)(pa->head - ofs);
+    tail = PROTMEM_ALIGN_SIZE(ptr->size) - ptr->size + pa->tail;
+    ofs = redzone_check((char *)p + ptr->size, tail);
+    if (ofs < tail)
+        return (ptrdiff_t)(ptr->size + ofs);
+    return 0;
+}
+
+static void protmem_report(const struct printer *vio, void *p, size_t size, 
+    ptrdiff_t ofs) {
+    virt_print(vio, "Error***: Block %p (%zu bytes) %s redzone corrupted at offset %td\n", 
+        p, size, ofs < 0? "head": "tail", ofs);
+}
+
 static void protmem_free(struct mem_allocator *m, void *p, void *user) {
+    struct protmem_allocator *pa = CONTAINER_OF(m, struct protmem_allocator, base);
+    struct mem_argument *ia = (struct mem_argument *)user;
     struct prot_mem *ptr;
+    ptrdiff_t ofs;
     if (p == NULL)
         return;
-    ptr = CONTAINER_OF(p, struct prot_mem, buffer);
-    if (ptr->magic == PROTMEM_MAGIC) {
-        size_t aligned_size = PROTMEM_ALIGN_SIZE(ptr->size);
-        _mem_fill_t magic = PROTMEM_READ(ptr->buffer, aligned_size);
-        if (magic == PROTMEM_MAGIC) {
-            memory_free(m->context, ptr, NULL);
-            return;
-        }
+    ptr = protmem_header(pa, p);
+    ofs = protmem_verify(pa, p);
+    if (ofs != 0 && ia != NULL) {
+        protmem_report(ia->path->vio, p, ia->mnode->size, ofs);
+        mem_overflow_dump(ia);
     }
-    memory_free(m->context, ptr, user);
-    if (user != NULL)
-        mem_overflow_dump((struct mem_argument *)user);
+    memory_free(m->context, ptr, NULL);
 }
 
 static void *mem_alloc(struct mem_allocator *m, size_t size, void *user) {
@@ -267,118 +1200,1316 @@ static struct mem_allocator allocator = {
     .free = mem_free
 };
 
-static struct mem_allocator protmem_allocator = {
-    .allocate = protmem_alloc,
-    .free = protmem_free,
-    .context = NULL
-};
-
-static inline struct mem_record_node *mem_node_alloc(struct path_class *path, 
-    size_t path_size) {
-    return (struct mem_record_node *)core_record_node_allocate(&path->base, 
-        path_size);
+static inline struct mem_record_node *mem_node_alloc(struct mem_shard *shard) {
+    return (struct mem_record_node *)core_record_node_allocate(&shard->base);
 }
 
-static struct mem_record_node *mem_node_create(struct path_class *path, void *ptr, 
+static struct mem_record_node *mem_node_create(struct mem_shard *shard, void *ptr, 
     size_t size) {
-    struct mem_record_node *mnode = mem_node_alloc(path, path->path_size);
+    struct mem_record_node *mnode = mem_node_alloc(shard);
     if (mnode) {
-        rbtree_set_off_tree(&mnode->rbnode);
         mnode->ptr = ptr;
         mnode->size = size;
+        mnode->scan_bad = 0;
+        mnode->family = MEM_ALLOC_MALLOC;
         return mnode;
     }
     return NULL;
 }
 
-static int mem_node_delete(struct path_class *path, struct mem_record_node *rn) {
-    if (!rbtree_is_node_off_tree(&rn->rbnode)) {
-        rbtree_extract(&path->tree.root, &rn->rbnode);
-        if (!list_empty(&rn->head)) {
-            struct mem_record_node *new_node;
-            new_node = CONTAINER_OF(rn->head.next, 
-                struct mem_record_node, node);
-            list_del(&rn->head);
-            mem_instert(path, new_node, false);
-        }
-    } else {
-        list_del(&rn->node);
-    }
-    core_record_del(&path->base, &rn->base);
-    return 0;
-}
+/* Bit length of @v >> @shift, the last bucket takes everything larger */
+static inline unsigned int mem_log2_bucket(uint64_t v, unsigned int shift, 
+    unsigned int nbuckets) {
+    unsigned int b = 0;
+    v >>= shift;
+#if defined(__GNUC__) || defined(__clang__)
+    if (v)
+        b = 64 - __builtin_clzll(v);
+#else
+    for ( ; v; v >>= 1)
+        b++;
+#endif
+    return b < nbuckets? b: nbuckets - 1;
+}
+
+/* @now is the time of the free, only used with MEM_LIFETIME */
+static int mem_node_remove(struct path_class *path, struct mem_shard *shard, 
+    struct mem_record_node *rn, uint64_t now) {
+    struct mem_callsite *site = rn->site;
+    size_t count, bytes = mem_node_estimate(rn, &count);
+    if (shard->scan_pos == &rn->node)
+        shard->scan_pos = rn->node.next;
+    list_del(&rn->node);
+    site->free_bytes += bytes;
+    site->free_count += count;
+    if (site->lifetime) {
+        uint64_t age = (now > rn->timestamp)? now - rn->timestamp: 0;
+        site->lifetime[mem_log2_bucket(age, 10, MEM_LIFETIME_BUCKETS)] += count;
+    }
+    mem_shard_account(shard, bytes, count, false);
+    ATOMIC_SUB(&path->peak->live_bytes, bytes);
+    return core_record_remove(&shard->base, &rn->base);
+}
+
+static inline uint64_t mem_sample_random(struct mem_sampler *ms) {
+    uint64_t x = ms->rng;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    ms->rng = x;
+    return x;
+}
+
+static intptr_t mem_sample_next(struct mem_sampler *ms, size_t mean) {
+    /* Uniform in (0, 1] */
+    double u = (double)((mem_sample_random(ms) >> 11) + 1) * (1.0 / 9007199254740992.0);
+    double next = -log(u) * (double)mean;
+    if (next > (double)(INTPTR_MAX / 2))
+        next = (double)(INTPTR_MAX / 2);
+    return (intptr_t)next + 1;
+}
+
+/*
+ * Returns the sampling period if the allocation must be recorded, 
+ * otherwise only the thread local byte counter is touched.
+ */
+static size_t mem_sample(struct path_class *path, size_t size) {
+    static _Thread_local struct mem_sampler sampler;
+    struct mem_sampler *ms = &sampler;
+    size_t mean = ATOMIC_LOAD_RELAXED(&path->sample_interval);
+    if (unlikely(ms->rng == 0)) {
+        ms->rng = ((uint64_t)(uintptr_t)ms * 0x9E3779B97F4A7C15ULL) ^ 
+            (uint64_t)time(NULL) ^ 0x2545F4914F6CDD1DULL;
+        if (ms->rng == 0)
+            ms->rng = 1;
+        ms->bytes_until_sample = mem_sample_next(ms, mean);
+    }
+    ms->bytes_until_sample -= (intptr_t)size;
+    if (likely(ms->bytes_until_sample > 0))
+        return 0;
+    ms->bytes_until_sample = mem_sample_next(ms, mean);
+    return mean;
+}
+
+static inline uint32_t *mem_sample_slot(struct path_class *path, const void *ptr) {
+    uint32_t key = (uint32_t)((uintptr_t)ptr >> 4) * 0x9E3779B1U;
+    return &path->sample_filter[key >> 18];
+}
+
+void mem_tracer_set_sample_interval(void *context, size_t bytes) {
+    ASSERT_TRUE(context != NULL);
+    struct path_class *path = (struct path_class *)context;
+    if (!bytes)
+        bytes = 1;
+    ATOMIC_STORE_RELAXED(&path->sample_interval, bytes);
+}
 
 void mem_tracer_set_path_length(void *context, size_t maxlen) {
     ASSERT_TRUE(context != NULL);
     struct path_class *path = (struct path_class *)context;
     if (!maxlen)
         maxlen = 1;
-    MUTEX_LOCK(path);
-    path->path_size = maxlen;
-    MUTEX_UNLOCK(path);
+    ATOMIC_STORE_RELAXED(&path->path_size, maxlen);
 }
 
+/*
+ * Stack ids are handed out densely by the depot, the callsites of all 
+ * shards are summed into a table indexed by stack id. Only one shard 
+ * lock is held at a time, and the walk goes over the callsite chunks 
+ * rather than the tree.
+ */
+static int mem_snapshot_take(struct path_class *path, struct mem_snapshot **psnap) {
+    struct mem_snapshot_entry *table;
+    struct stack_depot_stats depot;
+    struct mem_snapshot *snap;
+    struct timespec ts;
+    size_t nids, count, i;
+
+    for ( ; ; ) {
+        bool overflow = false;
+        stack_depot_get_stats(&depot);
+        nids = depot.nstacks + 64;
+        table = memory_allocate(path->meta_allocator, nids * sizeof(*table), NULL);
+        if (table == NULL)
+            return -ENOMEM;
+        memset(table, 0, nids * sizeof(*table));
+        for (i = 0; i < path->nshards && !overflow; i++) {
+            struct mem_shard *shard = &path->shards[i];
+            struct mem_site_chunk *chunk;
+            MUTEX_LOCK(shard);
+            for (chunk = shard->chunks; chunk && !overflow; chunk = chunk->next) {
+                for (size_t k = 0; k < chunk->count; k++) {
+                    const struct mem_callsite *site = &chunk->sites[k];
+                    struct mem_snapshot_entry *e;
+                    /* Stack created after the table was sized */
+                    if (site->stack_id >= nids) {
+                        overflow = true;
+                        break;
+                    }
+                    e = &table[site->stack_id];
+                    e->live_bytes += site->alloc_bytes - site->free_bytes;
+                    e->live_count += site->alloc_count - site->free_count;
+                    e->alloc_bytes += site->alloc_bytes;
+                    e->alloc_count += site->alloc_count;
+                }
+            }
+            MUTEX_UNLOCK(shard);
+        }
+        if (!overflow)
+            break;
+        memory_free(path->meta_allocator, table, NULL);
+    }
+    for (i = 0, count = 0; i < nids; i++)
+        count += table[i].alloc_count != 0;
+    snap = mem_snapshot_allocate(count);
+    if (snap == NULL) {
+        memory_free(path->meta_allocator, table, NULL);
+        return -ENOMEM;
+    }
+    for (i = 0; i < nids; i++) {
+        struct mem_snapshot_entry *e;
+        if (table[i].alloc_count == 0)
+            continue;
+        e = &snap->entries[snap->hdr.count++];
+        *e = table[i];
+        e->stack_id = (uint32_t)i;
+        snap->hdr.live_bytes += e->live_bytes;
+        snap->hdr.live_count += e->live_count;
+    }
+    memory_free(path->meta_allocator, table, NULL);
+    timespec_get(&ts, TIME_UTC);
+    snap->hdr.timestamp = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    *psnap = snap;
+    return 0;
+}
+
+/*
+ * Called when @live passed the recorded peak. Only one thread captures 
+ * at a time, the others just raise the watermark.
+ */
+static void mem_peak_update(struct path_class *path, size_t live) {
+    struct mem_peak *peak = path->peak;
+    struct mem_snapshot *snap, *old;
+    size_t cur = ATOMIC_LOAD_RELAXED(&peak->peak_bytes);
+    size_t busy = 0, step;
+
+    while (live > cur && !ATOMIC_CAS(&peak->peak_bytes, &cur, live));
+    if (live < ATOMIC_LOAD_RELAXED(&peak->next_capture) || 
+        !ATOMIC_CAS(&peak->busy, &busy, 1))
+        return;
+    if (!mem_snapshot_take(path, &snap)) {
+        live = MAX(live, (size_t)snap->hdr.live_bytes);
+        step = MAX(ATOMIC_LOAD_RELAXED(&peak->granularity), live >> MEM_PEAK_STEP_SHIFT);
+        ATOMIC_STORE_RELAXED(&peak->next_capture, live + step);
+        MUTEX_LOCK(peak);
+        old = peak->snap;
+        peak->snap = snap;
+        MUTEX_UNLOCK(peak);
+        mem_snapshot_free(old);
+    }
+    ATOMIC_STORE(&peak->busy, 0);
+}
+
+/*
+ * The node, the backtrace and its stack id are all prepared on the 
+ * calling thread; the shard lock only covers the index insertion.
+ */
 void *mem_tracer_alloc(void *context, size_t size) {
+    return mem_tracer_alloc_as(context, size, MEM_ALLOC_MALLOC);
+}
+
+void *mem_tracer_alloc_as(void *context, size_t size, enum mem_alloc_family family) {
     ASSERT_TRUE(context != NULL);
     struct path_class *path = (struct path_class *)context;
+    struct mem_event_stream *events = ATOMIC_LOAD(&path->events);
     struct mem_record_node *mnode;
-    MUTEX_LOCK(path);
+    struct mem_callsite *site;
+    struct mem_shard *shard;
+    size_t period = 0, live = 0, bytes, count;
+    uint64_t timestamp = 0;
+    stack_id_t stack_id;
+    int err;
     void *ptr = memory_allocate(path->allocator, size, NULL);
-    if (ptr) {
-        mnode = mem_node_create(path, ptr, size);
-        ASSERT_TRUE(mnode != NULL);
-        if (!core_record_backtrace(&path->base, &mnode->base)) {
-            mem_instert(path, mnode, true);
-        } else {
-            memory_free(path->allocator, ptr, NULL);
-            ptr = NULL;
+    if (ptr == NULL)
+        return NULL;
+    if (events)
+        timestamp = mem_event_timestamp();
+    if (path->options & MEM_SAMPLE_BYTES) {
+        period = mem_sample(path, size);
+        if (period == 0) {
+            if (events)
+                mem_event_record(events, timestamp, 
+                    MEM_EVENT_ALLOC | MEM_EVENT_UNSAMPLED, ptr, size, 0);
+            return ptr;
+        }
+    }
+    shard = mem_shard_of(path, ptr);
+    mnode = mem_node_create(shard, ptr, size);
+    ASSERT_TRUE(mnode != NULL);
+    mnode->sample_period = period;
+    mnode->family = family;
+    if (path->options & MEM_LIFETIME)
+        mnode->timestamp = timestamp? timestamp: mem_event_timestamp();
+    err = core_record_backtrace(&shard->base, &mnode->base, 
+        ATOMIC_LOAD_RELAXED(&path->path_size));
+    stack_id = mnode->base.stack_id;
+    if (!err) {
+        bytes = mem_node_estimate(mnode, &count);
+        MUTEX_LOCK(shard);
+        site = mem_callsite_get(path, shard, stack_id);
+        err = site? core_record_add(&shard->base, &mnode->base): -ENOMEM;
+        if (!err) {
+            list_add_tail(&mnode->node, &site->blocks);
+            mnode->site = site;
+            site->alloc_bytes += bytes;
+            site->alloc_count += count;
+            if (site->sizes) {
+                site->sizes[mem_log2_bucket(size? size - 1: 0, 3, 
+                    MEM_SIZE_BUCKETS)] += count;
+            }
+            mem_shard_account(shard, bytes, count, true);
+            /* Added before the block can be freed, so it never wraps */
+            live = ATOMIC_ADD(&path->peak->live_bytes, bytes);
         }
-            
+        MUTEX_UNLOCK(shard);
+        if (!err && period)
+            ATOMIC_ADD(mem_sample_slot(path, ptr), 1);
+        if (!err && live > ATOMIC_LOAD_RELAXED(&path->peak->peak_bytes))
+            mem_peak_update(path, live);
     }
-    MUTEX_UNLOCK(path);
+    if (err) {
+        core_record_node_free(&shard->base, &mnode->base);
+        memory_free(path->allocator, ptr, NULL);
+        return NULL;
+    }
+    if (path->guard)
+        guard_pool_set_tag(path->guard, ptr, stack_id);
+    if (events)
+        mem_event_record(events, timestamp, MEM_EVENT_ALLOC, ptr, size, stack_id);
     return ptr;
 }
 
+static void mem_quarantine_report(struct path_class *path, 
+    struct mem_record_node *rn, size_t ofs) {
+    const struct printer *vio = path->vio;
+    char *alloc_path, *free_path;
+    mem_lock_all(path);
+    alloc_path = mem_stack_path(path, rn->base.stack_id);
+    free_path = mem_stack_path(path, rn->free_stack_id);
+    virt_print(vio, "Error***: Use after free of block %p (%zu bytes) at offset %zu\n"
+        "<Allocated>: %s\n<Freed>: %s\n", rn->ptr, rn->size, ofs, 
+        alloc_path? alloc_path: "", free_path? free_path: "");
+    if (alloc_path != NULL)
+        memory_free(path->meta_allocator, alloc_path, NULL);
+    if (free_path != NULL)
+        memory_free(path->meta_allocator, free_path, NULL);
+    if (!path->symbol_persist)
+        backtrace_symbol_cache_flush(&path->tracer);
+    mem_unlock_all(path);
+}
+
+/*
+ * Verifies the poison of the evicted blocks and hands them back to 
+ * the allocator. Returns the number of blocks written after free.
+ */
+static int mem_quarantine_release(struct path_class *path, 
+    struct mem_shard *shard, struct list_head *evicted) {
+    struct list_head *pos, *next;
+    int bad = 0;
+    list_for_each_safe(pos, next, evicted) {
+        struct mem_record_node *rn = CONTAINER_OF(pos, struct mem_record_node, node);
+        struct mem_argument ia = {0};
+        size_t ofs = redzone_check_pattern(rn->ptr, rn->size, MEM_QUARANTINE_PATTERN);
+        if (ofs < rn->size) {
+            mem_quarantine_report(path, rn, ofs);
+            bad++;
+        }
+        ia.path = path;
+        ia.mnode = rn;
+        memory_free(path->allocator, rn->ptr, &ia);
+        core_record_node_free(&shard->base, &rn->base);
+    }
+    return bad;
+}
+
+/*
+ * The freed block is poisoned and queued on its own shard, the oldest 
+ * ones beyond the shard budget are evicted. Poisoning and verification 
+ * run outside the shard lock.
+ */
+static void mem_quarantine_put(struct path_class *path, struct mem_shard *shard, 
+    struct mem_record_node *rn) {
+    struct record_node free_rec = {0};
+    struct list_head evicted;
+    size_t limit = ATOMIC_LOAD_RELAXED(&path->quarantine_limit);
+    if (!core_record_backtrace(&shard->base, &free_rec, 
+        ATOMIC_LOAD_RELAXED(&path->path_size)))
+        rn->free_stack_id = free_rec.stack_id;
+    memset(rn->ptr, MEM_QUARANTINE_PATTERN, rn->size);
+    INIT_LIST_HEAD(&evicted);
+    MUTEX_LOCK(shard);
+    list_add_tail(&rn->node, &shard->quarantine);
+    shard->quarantine_bytes += rn->size;
+    while (shard->quarantine_bytes > limit) {
+        struct mem_record_node *old = CONTAINER_OF(shard->quarantine.next, 
+            struct mem_record_node, node);
+        list_del(&old->node);
+        shard->quarantine_bytes -= old->size;
+        list_add_tail(&old->node, &evicted);
+    }
+    MUTEX_UNLOCK(shard);
+    mem_quarantine_release(path, shard, &evicted);
+}
+
+static const char *const mem_family_names[] = {
+    [MEM_ALLOC_MALLOC]    = "malloc",
+    [MEM_ALLOC_NEW]       = "new",
+    [MEM_ALLOC_NEW_ARRAY] = "new[]",
+};
+
+static const char *const mem_release_names[] = {
+    [MEM_ALLOC_MALLOC]    = "free",
+    [MEM_ALLOC_NEW]       = "delete",
+    [MEM_ALLOC_NEW_ARRAY] = "delete[]",
+};
+
+/* Wrong deallocation function or sized delete size, on the freeing thread */
+static void mem_mismatch_report(struct path_class *path, struct mem_shard *shard, 
+    struct mem_record_node *rn, enum mem_alloc_family family, size_t size) {
+    const struct printer *vio = path->vio;
+    struct record_node free_rec = {0};
+    char *alloc_path, *free_path;
+    core_record_backtrace(&shard->base, &free_rec, 
+        ATOMIC_LOAD_RELAXED(&path->path_size));
+    mem_lock_all(path);
+    if (rn->family != family) {
+        virt_print(vio, "Error***: Block %p (%zu bytes) allocated by %s released by %s\n", 
+            rn->ptr, rn->size, mem_family_names[rn->family], mem_release_names[family]);
+    } else {
+        virt_print(vio, "Error***: Block %p (%zu bytes) released by sized %s of %zu bytes\n", 
+            rn->ptr, rn->size, mem_release_names[family], size);
+    }
+    alloc_path = mem_stack_path(path, rn->base.stack_id);
+    free_path = mem_stack_path(path, free_rec.stack_id);
+    virt_print(vio, "<Allocated>: %s\n<Freed>: %s\n", 
+        alloc_path? alloc_path: "", free_path? free_path: "");
+    if (alloc_path != NULL)
+        memory_free(path->meta_allocator, alloc_path, NULL);
+    if (free_path != NULL)
+        memory_free(path->meta_allocator, free_path, NULL);
+    if (!path->symbol_persist)
+        backtrace_symbol_cache_flush(&path->tracer);
+    mem_unlock_all(path);
+}
+
+static void mem_invalid_report(struct path_class *path, void *ptr) {
+    struct record_node free_rec = {0};
+    char *str;
+    core_record_backtrace(&path->shards[0].base, &free_rec, 
+        ATOMIC_LOAD_RELAXED(&path->path_size));
+    mem_lock_all(path);
+    str = mem_stack_path(path, free_rec.stack_id);
+    virt_print(path->vio, "Error***: Free invalid pointer (%p):\n<Path>: %s\n", 
+        ptr, str? str: "");
+    if (str != NULL)
+        memory_free(path->meta_allocator, str, NULL);
+    if (!path->symbol_persist)
+        backtrace_symbol_cache_flush(&path->tracer);
+    mem_unlock_all(path);
+}
+
 void mem_tracer_free(void *context, void *ptr) {
+    mem_tracer_free_as(context, ptr, MEM_ALLOC_MALLOC, 0);
+}
+
+void mem_tracer_free_as(void *context, void *ptr, enum mem_alloc_family family, 
+    size_t size) {
     ASSERT_TRUE(context != NULL);
     struct path_class *path = (struct path_class *)context;
+    struct mem_event_stream *events = ATOMIC_LOAD(&path->events);
     struct mem_record_node *rn;
+    struct mem_shard *shard;
+    uint64_t now = 0;
     ASSERT_TRUE(ptr != NULL);
-    MUTEX_LOCK(path);
-    rn = mem_find(&path->base, ptr);
+    /* Unsampled blocks are never recorded, skip the lookup if possible */
+    if ((path->options & MEM_SAMPLE_BYTES) && 
+        !ATOMIC_LOAD_RELAXED(mem_sample_slot(path, ptr))) {
+        if (events)
+            mem_event_record(events, mem_event_timestamp(), 
+                MEM_EVENT_FREE | MEM_EVENT_UNSAMPLED, ptr, 0, 0);
+        memory_free(path->allocator, ptr, NULL);
+        return;
+    }
+    if (path->options & MEM_LIFETIME)
+        now = mem_event_timestamp();
+    shard = mem_shard_of(path, ptr);
+    MUTEX_LOCK(shard);
+    rn = mem_find(&shard->base, ptr);
+    if (rn)
+        mem_node_remove(path, shard, rn, now);
+    MUTEX_UNLOCK(shard);
     if (rn) {
-        memory_free(path->allocator, ptr, rn);
-        mem_node_delete(path, rn);
+        if (rn->sample_period)
+            ATOMIC_SUB(mem_sample_slot(path, ptr), 1);
+        if (rn->family != family || (size && rn->size != size))
+            mem_mismatch_report(path, shard, rn, family, size);
+        /* Stamped before the block can be handed out again */
+        if (events) {
+            mem_event_record(events, mem_event_timestamp(), MEM_EVENT_FREE, ptr, 
+                rn->size, rn->base.stack_id);
+        }
+        if (path->options & MEM_QUARANTINE) {
+            mem_quarantine_put(path, shard, rn);
+        } else {
+            struct mem_argument ia = {0};
+            ia.path = path;
+            ia.mnode = rn;
+            memory_free(path->allocator, ptr, &ia);
+            core_record_node_free(&shard->base, &rn->base);
+        }
+    } else if (path->options & MEM_SAMPLE_BYTES) {
+        if (events)
+            mem_event_record(events, mem_event_timestamp(), 
+                MEM_EVENT_FREE | MEM_EVENT_UNSAMPLED, ptr, 0, 0);
+        memory_free(path->allocator, ptr, NULL);
     } else if (path->options & MEM_CHECK_INVALID) {
-        virt_print(path->vio, "Error***: Free invalid pointer (%p):\n", ptr);
-        mem_path_print(path, rn, path->separator);
+        mem_invalid_report(path, ptr);
     }
-    MUTEX_UNLOCK(path);
+}
+
+void mem_tracer_report_invalid(void *context, void *ptr) {
+    ASSERT_TRUE(context != NULL);
+    struct path_class *path = (struct path_class *)context;
+    if (path->options & MEM_CHECK_INVALID)
+        mem_invalid_report(path, ptr);
 }
 
 void mem_tracer_dump(void *context, enum mem_dumper type) {
     ASSERT_TRUE(context != NULL);
     struct path_class *path = (struct path_class *)context;
     struct mem_argument ia = {0};
+    struct stack_depot_stats depot;
+    struct symbol_cache_stats symbols;
     time_t now;
-    MUTEX_LOCK(path);
+    if (type == MEM_DUMP_RAW) {
+        mem_raw_dump(path);
+        return;
+    }
+    if (type == MEM_DUMP_FOLDED) {
+        mem_folded_dump(path);
+        return;
+    }
+    if (type == MEM_DUMP_PEAK) {
+        mem_peak_dump(path);
+        return;
+    }
+    if (type == MEM_DUMP_LIFETIME) {
+        mem_lifetime_dump(path);
+        return;
+    }
+    if (type == MEM_DUMP_LEAKS) {
+        mem_leak_dump(path);
+        return;
+    }
+    mem_lock_all(path);
     const struct printer *vio = path->vio;
     virt_print(vio, mdump_info);
     if (type == MEM_DUMP_SORTED) {
         ia.path = path;
-        rbtree_iterate(&path->tree.root, sorted_iterator, &ia);
+        mem_sorted_visitor(path, true, sorted_iterator, &ia);
         goto _print;
     }
     if (type == MEM_DUMP_SEQUENCE) {
         ia.path = path;
-        core_record_visitor(&path->base, iterator, &ia);
+        mem_visitor(path, iterator, &ia);
     }
 _print:
     time(&now);
     virt_print(vio, "\nTotal Used: %u B (%.2f KB) Blocks: %u\n", 
         ia.msize, (float)ia.msize/1024, ia.mcount);
+    stack_depot_get_stats(&depot);
+    virt_print(vio, "Stack Depot: %u paths %u frames (%.2f KB) %u dropped\n", 
+        depot.nstacks, depot.nframes, (float)depot.memory_size/1024, depot.ndropped);
+    backtrace_symbol_cache_stats(&path->tracer, &symbols);
+    if (symbols.hits + symbols.misses > 0) {
+        virt_print(vio, "Symbol Cache: %u hits %u misses %u entries (%.2f KB)\n", 
+            symbols.hits, symbols.misses, symbols.entries, 
+            (float)symbols.memory_size/1024);
+    }
+    if (!path->symbol_persist)
+        backtrace_symbol_cache_flush(&path->tracer);
     virt_print(vio, "Time: %s\n\n", asctime(localtime(&now)));
-    MUTEX_UNLOCK(path);
+    mem_unlock_all(path);
+}
+
+static bool pprof_iterator(struct mem_callsite *sites[], size_t n, void *arg) {
+    struct pprof_writer *pw = (struct pprof_writer *)arg;
+    struct ip_array ips;
+    size_t sum, cnt;
+    sum = mem_sites_estimate(sites, n, &cnt);
+    if (stack_depot_fetch(sites[0]->stack_id, &ips))
+        return false;
+    return pprof_writer_add_sample(pw, ips.ip, ips.n, cnt, sum) != 0;
+}
+
+int mem_tracer_export_pprof(void *context, int fd) {
+    ASSERT_TRUE(context != NULL);
+    struct path_class *path = (struct path_class *)context;
+    struct pprof_writer *pw;
+    size_t period = 0;
+    int err;
+    if (path->options & MEM_SAMPLE_BYTES)
+        period = ATOMIC_LOAD_RELAXED(&path->sample_interval);
+    err = pprof_writer_open(&pw, fd, &path->tracer, path->meta_allocator, period);
+    if (err)
+        return err;
+    mem_lock_all(path);
+    mem_sorted_visitor(path, true, pprof_iterator, pw);
+    pprof_writer_symbolize(pw);
+    if (!path->symbol_persist)
+        backtrace_symbol_cache_flush(&path->tracer);
+    mem_unlock_all(path);
+    return pprof_writer_close(pw);
+}
+
+struct mem_top_entry {
+    struct mem_callsite_stats stats;
+    stack_id_t stack_id;
+    size_t key;
+};
+
+struct mem_top_argument {
+    struct mem_top_entry *heap;
+    size_t count;
+    size_t capacity;
+    enum mem_top_metric metric;
+};
+
+/* Min-heap on @key, the root is the smallest of the current winners */
+static void mem_top_sift_down(struct mem_top_entry *heap, size_t n, size_t i) {
+    struct mem_top_entry tmp = heap[i];
+    for ( ; ; ) {
+        size_t child = 2 * i + 1;
+        if (child >= n)
+            break;
+        if (child + 1 < n && heap[child + 1].key < heap[child].key)
+            child++;
+        if (heap[child].key >= tmp.key)
+            break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = tmp;
+}
+
+static void mem_top_sift_up(struct mem_top_entry *heap, size_t i) {
+    struct mem_top_entry tmp = heap[i];
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (heap[parent].key <= tmp.key)
+            break;
+        heap[i] = heap[parent];
+        i = parent;
+    }
+    heap[i] = tmp;
+}
+
+static bool top_iterator(struct mem_callsite *sites[], size_t n, void *arg) {
+    struct mem_top_argument *ta = (struct mem_top_argument *)arg;
+    size_t alloc_bytes = 0, alloc_count = 0, free_bytes = 0, free_count = 0;
+    struct mem_top_entry *e;
+    size_t key;
+    for (size_t i = 0; i < n; i++) {
+        alloc_bytes += sites[i]->alloc_bytes;
+        alloc_count += sites[i]->alloc_count;
+        free_bytes += sites[i]->free_bytes;
+        free_count += sites[i]->free_count;
+    }
+    switch (ta->metric) {
+    case MEM_TOP_LIVE_COUNT:
+        key = alloc_count - free_count;
+        break;
+    case MEM_TOP_ALLOC_BYTES:
+        key = alloc_bytes;
+        break;
+    case MEM_TOP_FREE_COUNT:
+        key = free_count;
+        break;
+    default:
+        key = alloc_bytes - free_bytes;
+        break;
+    }
+    /* The entry is only filled in once it makes it into the heap */
+    if (ta->count < ta->capacity)
+        e = &ta->heap[ta->count];
+    else if (key > ta->heap[0].key)
+        e = &ta->heap[0];
+    else
+        return false;
+    e->key = key;
+    e->stack_id = sites[0]->stack_id;
+    e->stats.path = NULL;
+    e->stats.alloc_bytes = alloc_bytes;
+    e->stats.alloc_count = alloc_count;
+    e->stats.live_bytes = alloc_bytes - free_bytes;
+    e->stats.live_count = alloc_count - free_count;
+    e->stats.free_count = free_count;
+    mem_hist_merge(e->stats.lifetime, sites, n, false);
+    mem_hist_merge(e->stats.sizes, sites, n, true);
+    if (ta->count < ta->capacity)
+        mem_top_sift_up(ta->heap, ta->count++);
+    else
+        mem_top_sift_down(ta->heap, ta->count, 0);
+    return false;
+}
+
+/* One pass over the merged callsites, the @n largest are kept in a heap */
+int mem_tracer_top(void *context, enum mem_top_metric metric, size_t n, 
+    void (*callback)(const struct mem_callsite_stats *stats, void *arg), 
+    void *arg) {
+    ASSERT_TRUE(context != NULL);
+    struct path_class *path = (struct path_class *)context;
+    struct mem_top_argument ta;
+    int reported = 0;
+    size_t i;
+
+    if (callback == NULL || n == 0)
+        return -EINVAL;
+    ta.heap = memory_allocate(path->meta_allocator, n * sizeof(*ta.heap), NULL);
+    if (ta.heap == NULL)
+        return -ENOMEM;
+    ta.count = 0;
+    ta.capacity = n;
+    ta.metric = metric;
+    mem_lock_all(path);
+    mem_sorted_visitor(path, metric == MEM_TOP_LIVE_BYTES || 
+        metric == MEM_TOP_LIVE_COUNT, top_iterator, &ta);
+    /* Heap sort, leaves the winners largest first */
+    for (i = ta.count; i > 1; i--) {
+        struct mem_top_entry tmp = ta.heap[0];
+        ta.heap[0] = ta.heap[i - 1];
+        ta.heap[i - 1] = tmp;
+        mem_top_sift_down(ta.heap, i - 1, 0);
+    }
+    for (i = 0; i < ta.count; i++)
+        ta.heap[i].stats.path = mem_stack_path(path, ta.heap[i].stack_id);
+    if (!path->symbol_persist)
+        backtrace_symbol_cache_flush(&path->tracer);
+    mem_unlock_all(path);
+    for (i = 0; i < ta.count; i++) {
+        char *str = (char *)ta.heap[i].stats.path;
+        if (str != NULL) {
+            callback(&ta.heap[i].stats, arg);
+            memory_free(path->meta_allocator, str, NULL);
+            reported++;
+        }
+    }
+    memory_free(path->meta_allocator, ta.heap, NULL);
+    return reported;
+}
+
+int mem_tracer_snapshot(void *context, struct mem_snapshot **psnap) {
+    ASSERT_TRUE(context != NULL);
+    if (psnap == NULL)
+        return -EINVAL;
+    return mem_snapshot_take((struct path_class *)context, psnap);
+}
+
+int mem_tracer_snapshot_diff(void *context, const struct mem_snapshot *a, 
+    const struct mem_snapshot *b, size_t n, 
+    void (*callback)(const struct mem_snapshot_delta *delta, const char *path, 
+    void *arg), void *arg) {
+    ASSERT_TRUE(context != NULL);
+    struct path_class *path = (struct path_class *)context;
+    struct mem_snapshot_delta *delta;
+    char **paths;
+    size_t count, i;
+    int err;
+
+    if (callback == NULL)
+        return -EINVAL;
+    err = mem_snapshot_diff(a, b, &delta, &count);
+    if (err)
+        return err;
+    if (n == 0 || n > count)
+        n = count;
+    paths = memory_allocate(path->meta_allocator, (n + 1) * sizeof(char *), NULL);
+    if (paths == NULL) {
+        free(delta);
+        return -ENOMEM;
+    }
+    mem_lock_all(path);
+    for (i = 0; i < n; i++)
+        paths[i] = mem_stack_path(path, delta[i].stack_id);
+    if (!path->symbol_persist)
+        backtrace_symbol_cache_flush(&path->tracer);
+    mem_unlock_all(path);
+    for (i = 0; i < n; i++) {
+        callback(&delta[i], paths[i], arg);
+        if (paths[i])
+            memory_free(path->meta_allocator, paths[i], NULL);
+    }
+    memory_free(path->meta_allocator, paths, NULL);
+    free(delta);
+    return (int)n;
+}
+
+/* Live block of a leak check, the blocks are sorted by address */
+struct mem_leak_block {
+    uintptr_t start;
+    uintptr_t end;
+    struct mem_record_node *node;
+    int state;
+#define LEAK_UNREACHED 0
+#define LEAK_REACHABLE 1
+#define LEAK_INDIRECT  2
+#define LEAK_DEFINITE  3
+};
+
+struct mem_leak_scan {
+    struct mem_leak_block *blocks;
+    size_t count;
+    size_t *stack;      /* Blocks marked but not scanned yet */
+    size_t top;
+    uintptr_t low;
+    uintptr_t high;
+};
+
+static int leak_block_compare(const void *a, const void *b) {
+    const struct mem_leak_block *b1 = (const struct mem_leak_block *)a;
+    const struct mem_leak_block *b2 = (const struct mem_leak_block *)b;
+    return b1->start < b2->start? -1: b1->start > b2->start;
+}
+
+static inline struct mem_leak_block *leak_find(struct mem_leak_scan *scan, 
+    uintptr_t p) {
+    size_t lo = 0, hi = scan->count;
+    if (p < scan->low || p >= scan->high)
+        return NULL;
+    /* Last block that starts at or below @p */
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if (scan->blocks[mid].start <= p)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    if (p >= scan->blocks[lo].start && p < scan->blocks[lo].end)
+        return &scan->blocks[lo];
+    return NULL;
+}
+
+/*
+ * Mark the unreached blocks that the words of [@start, @end) point 
+ * into. A definitely lost block found from the lost block @self is 
+ * only indirectly lost, its own blocks were marked already.
+ */
+static __nosanitize void leak_scan_range(struct mem_leak_scan *scan, 
+    uintptr_t start, uintptr_t end, int state, struct mem_leak_block *self) {
+    const uintptr_t *p = (const uintptr_t *)((start + sizeof(uintptr_t) - 1) & 
+        ~(uintptr_t)(sizeof(uintptr_t) - 1));
+    for ( ; (uintptr_t)(p + 1) <= end; p++) {
+        struct mem_leak_block *b = leak_find(scan, *p);
+        if (b == NULL || b == self)
+            continue;
+        if (b->state == LEAK_UNREACHED) {
+            b->state = state;
+            scan->stack[scan->top++] = b - scan->blocks;
+        } else if (b->state == LEAK_DEFINITE && state == LEAK_INDIRECT) {
+            b->state = LEAK_INDIRECT;
+        }
+    }
+}
+
+static void leak_drain(struct mem_leak_scan *scan, int state, 
+    struct mem_leak_block *self) {
+    while (scan->top > 0) {
+        struct mem_leak_block *b = &scan->blocks[scan->stack[--scan->top]];
+        leak_scan_range(scan, b->start, b->end, state, self);
+    }
+}
+
+static int leak_root_visit(const void *start, const void *end, void *arg) {
+    struct mem_leak_scan *scan = (struct mem_leak_scan *)arg;
+    leak_scan_range(scan, (uintptr_t)start, (uintptr_t)end, LEAK_REACHABLE, NULL);
+    leak_drain(scan, LEAK_REACHABLE, NULL);
+    return 0;
+}
+
+/* Copy out the live blocks in address order */
+static int leak_collect(struct path_class *path, struct mem_leak_scan *scan) {
+    size_t total = 0, i;
+    for (i = 0; i < path->nshards; i++)
+        total += path->shards[i].nblocks;
+    scan->blocks = memory_allocate(path->meta_allocator, 
+        (total + 1) * sizeof(*scan->blocks), NULL);
+    scan->stack = memory_allocate(path->meta_allocator, 
+        (total + 1) * sizeof(*scan->stack), NULL);
+    if (scan->blocks == NULL || scan->stack == NULL)
+        return -ENOMEM;
+    scan->count = 0;
+    scan->top = 0;
+    for (i = 0; i < path->nshards; i++) {
+        struct mem_site_chunk *chunk;
+        for (chunk = path->shards[i].chunks; chunk; chunk = chunk->next) {
+            for (size_t k = 0; k < chunk->count; k++) {
+                struct list_head *pos;
+                list_for_each(pos, &chunk->sites[k].blocks) {
+                    struct mem_record_node *mrn = 
+                        CONTAINER_OF(pos, struct mem_record_node, node);
+                    struct mem_leak_block *b = &scan->blocks[scan->count++];
+                    b->start = (uintptr_t)mrn->ptr;
+                    b->end = b->start + (mrn->size? mrn->size: 1);
+                    b->node = mrn;
+                    b->state = LEAK_UNREACHED;
+                }
+            }
+        }
+    }
+    qsort(scan->blocks, scan->count, sizeof(*scan->blocks), leak_block_compare);
+    if (scan->count > 0) {
+        scan->low = scan->blocks[0].start;
+        scan->high = 0;
+        for (i = 0; i < scan->count; i++)
+            scan->high = MAX(scan->high, scan->blocks[i].end);
+    }
+    return 0;
+}
+
+struct mem_leak_entry {
+    struct mem_leak_stats stats;
+    stack_id_t stack_id;
+};
+
+static int leak_entry_compare(const void *a, const void *b) {
+    const struct mem_leak_stats *s1 = &((const struct mem_leak_entry *)a)->stats;
+    const struct mem_leak_stats *s2 = &((const struct mem_leak_entry *)b)->stats;
+    if (s1->definite_bytes != s2->definite_bytes)
+        return s1->definite_bytes < s2->definite_bytes? 1: -1;
+    if (s1->indirect_bytes != s2->indirect_bytes)
+        return s1->indirect_bytes < s2->indirect_bytes? 1: -1;
+    if (s1->reachable_bytes != s2->reachable_bytes)
+        return s1->reachable_bytes < s2->reachable_bytes? 1: -1;
+    return 0;
+}
+
+/*
+ * The live blocks are copied into an address ordered array so that an 
+ * interior pointer is resolved by one binary search, instead of one 
+ * lower bound lookup per shard index. Lost blocks are then taken in 
+ * turn as roots of their own scan to tell indirect losses apart.
+ */
+int mem_tracer_leak_check(void *context, bool reachable, 
+    struct mem_leak_stats *total, 
+    void (*callback)(const struct mem_leak_stats *stats, void *arg), void *arg) {
+    ASSERT_TRUE(context != NULL);
+    struct path_class *path = (struct path_class *)context;
+    struct mem_leak_scan scan = {0};
+    struct stack_depot_stats depot;
+    struct mem_leak_entry *table = NULL;
+    struct mem_leak_stats sum = {0};
+    size_t nids = 0, count = 0, i;
+    int err;
+
+    if (path->options & MEM_SAMPLE_BYTES)
+        return -ENOTSUP;
+    mem_lock_all(path);
+    err = leak_collect(path, &scan);
+    if (!err)
+        err = backtrace_root_iterate(leak_root_visit, &scan);
+    for (i = 0; i < scan.count && !err; i++) {
+        struct mem_leak_block *b = &scan.blocks[i];
+        if (b->state != LEAK_UNREACHED)
+            continue;
+        b->state = LEAK_DEFINITE;
+        leak_scan_range(&scan, b->start, b->end, LEAK_INDIRECT, b);
+        leak_drain(&scan, LEAK_INDIRECT, b);
+    }
+    if (!err) {
+        stack_depot_get_stats(&depot);
+        nids = depot.nstacks + 1;
+        table = memory_allocate(path->meta_allocator, nids * sizeof(*table), NULL);
+        if (table == NULL)
+            err = -ENOMEM;
+    }
+    if (!err) {
+        memset(table, 0, nids * sizeof(*table));
+        for (i = 0; i < scan.count; i++) {
+            struct mem_leak_block *b = &scan.blocks[i];
+            stack_id_t id = b->node->site->stack_id;
+            struct mem_leak_stats *st;
+            if (id >= nids)
+                continue;
+            st = &table[id].stats;
+            switch (b->state) {
+            case LEAK_DEFINITE:
+                st->definite_bytes += b->node->size;
+                st->definite_count++;
+                break;
+            case LEAK_INDIRECT:
+                st->indirect_bytes += b->node->size;
+                st->indirect_count++;
+                break;
+            default:
+                st->reachable_bytes += b->node->size;
+                st->reachable_count++;
+                break;
+            }
+        }
+        for (i = 0; i < nids; i++) {
+            struct mem_leak_stats *st = &table[i].stats;
+            sum.definite_bytes += st->definite_bytes;
+            sum.definite_count += st->definite_count;
+            sum.indirect_bytes += st->indirect_bytes;
+            sum.indirect_count += st->indirect_count;
+            sum.reachable_bytes += st->reachable_bytes;
+            sum.reachable_count += st->reachable_count;
+            if (st->definite_count || st->indirect_count || 
+                (reachable && st->reachable_count)) {
+                table[count].stats = *st;
+                table[count++].stack_id = (stack_id_t)i;
+            }
+        }
+        qsort(table, count, sizeof(*table), leak_entry_compare);
+        for (i = 0; i < count && callback; i++)
+            table[i].stats.path = mem_stack_path(path, table[i].stack_id);
+        if (!path->symbol_persist)
+            backtrace_symbol_cache_flush(&path->tracer);
+    }
+    mem_unlock_all(path);
+    if (scan.blocks)
+        memory_free(path->meta_allocator, scan.blocks, NULL);
+    if (scan.stack)
+        memory_free(path->meta_allocator, scan.stack, NULL);
+    if (err)
+        return err;
+    if (total)
+        *total = sum;
+    for (i = 0; i < count && callback; i++) {
+        char *str = (char *)table[i].stats.path;
+        callback(&table[i].stats, arg);
+        if (str != NULL)
+            memory_free(path->meta_allocator, str, NULL);
+    }
+    memory_free(path->meta_allocator, table, NULL);
+    return (int)count;
+}
+
+/*
+ * The last capture, or a fresh one when the heap has since grown back 
+ * past it and is now closer to the peak.
+ */
+int mem_tracer_peak_snapshot(void *context, struct mem_snapshot **psnap) {
+    ASSERT_TRUE(context != NULL);
+    struct path_class *path = (struct path_class *)context;
+    struct mem_peak *peak = path->peak;
+    struct mem_snapshot *snap = NULL;
+    int err = 0;
+
+    if (psnap == NULL)
+        return -EINVAL;
+    MUTEX_LOCK(peak);
+    if (peak->snap != NULL && 
+        peak->snap->hdr.live_bytes >= ATOMIC_LOAD_RELAXED(&peak->live_bytes)) {
+        size_t count = (size_t)peak->snap->hdr.count;
+        snap = mem_snapshot_allocate(count);
+        if (snap != NULL) {
+            memcpy(snap, peak->snap, 
+                sizeof(*snap) + count * sizeof(struct mem_snapshot_entry));
+        } else {
+            err = -ENOMEM;
+        }
+    }
+    MUTEX_UNLOCK(peak);
+    if (err)
+        return err;
+    if (snap == NULL)
+        return mem_snapshot_take(path, psnap);
+    *psnap = snap;
+    return 0;
+}
+
+size_t mem_tracer_get_peak(void *context) {
+    ASSERT_TRUE(context != NULL);
+    struct path_class *path = (struct path_class *)context;
+    return ATOMIC_LOAD_RELAXED(&path->peak->peak_bytes);
+}
+
+void mem_tracer_reset_peak(void *context) {
+    ASSERT_TRUE(context != NULL);
+    struct path_class *path = (struct path_class *)context;
+    struct mem_peak *peak = path->peak;
+    struct mem_snapshot *old;
+    ATOMIC_STORE_RELAXED(&peak->peak_bytes, ATOMIC_LOAD_RELAXED(&peak->live_bytes));
+    ATOMIC_STORE_RELAXED(&peak->next_capture, 0);
+    MUTEX_LOCK(peak);
+    old = peak->snap;
+    peak->snap = NULL;
+    MUTEX_UNLOCK(peak);
+    mem_snapshot_free(old);
+}
+
+int mem_tracer_set_guard_cache(void *context, size_t bytes) {
+    ASSERT_TRUE(context != NULL);
+    struct path_class *path = (struct path_class *)context;
+    if (path->guard == NULL)
+        return -EINVAL;
+    guard_pool_set_cache(path->guard, bytes);
+    return 0;
+}
+
+int mem_tracer_set_guard_fd(void *context, int fd) {
+    ASSERT_TRUE(context != NULL);
+    struct path_class *path = (struct path_class *)context;
+    if (fd < 0)
+        return -EINVAL;
+    path->guard_fd = fd;
+    return 0;
+}
+
+int mem_tracer_check_redzones(void *context) {
+    ASSERT_TRUE(context != NULL);
+    struct path_class *path = (struct path_class *)context;
+    int bad = 0;
+    if (path->protmem == NULL)
+        return -EINVAL;
+    mem_lock_all(path);
+    for (size_t i = 0; i < path->nshards; i++) {
+        struct mem_site_chunk *chunk;
+        for (chunk = path->shards[i].chunks; chunk; chunk = chunk->next) {
+            for (size_t k = 0; k < chunk->count; k++) {
+                struct list_head *pos;
+                list_for_each(pos, &chunk->sites[k].blocks) {
+                    struct mem_record_node *mrn = 
+                        CONTAINER_OF(pos, struct mem_record_node, node);
+                    ptrdiff_t ofs = protmem_verify(path->protmem, mrn->ptr);
+                    if (ofs != 0) {
+                        protmem_report(path->vio, mrn->ptr, mrn->size, ofs);
+                        mem_path_print(path, mrn, path->separator);
+                        bad++;
+                    }
+                }
+            }
+        }
+    }
+    if (bad && !path->symbol_persist)
+        backtrace_symbol_cache_flush(&path->tracer);
+    mem_unlock_all(path);
+    return bad;
+}
+
+#if !defined(_WIN32)
+struct mem_scan_report {
+    void *ptr;
+    size_t size;
+    ptrdiff_t ofs;
+    stack_id_t stack_id;
+};
+
+/*
+ * Verifies up to @budget blocks of @shard from the cursor. Returns 
+ * the budget left, @done is set once the shard is finished.
+ */
+static size_t mem_scan_shard(struct path_class *path, struct mem_shard *shard, 
+    size_t budget, struct mem_scan_report *reports, size_t *nreports, bool *done) {
+    struct mem_scanner *scan = path->scanner;
+    MUTEX_LOCK(shard);
+    if (scan->chunk == NULL) {
+        scan->chunk = shard->chunks;
+        scan->site = 0;
+        shard->scan_pos = NULL;
+    }
+    while (scan->chunk != NULL && budget > 0) {
+        struct mem_callsite *site;
+        if (scan->site >= scan->chunk->count) {
+            scan->chunk = scan->chunk->next;
+            scan->site = 0;
+            continue;
+        }
+        site = &scan->chunk->sites[scan->site];
+        if (shard->scan_pos == NULL)
+            shard->scan_pos = site->blocks.next;
+        budget--;
+        while (shard->scan_pos != &site->blocks && budget > 0) {
+            struct mem_record_node *mrn = CONTAINER_OF(shard->scan_pos, 
+                struct mem_record_node, node);
+            ptrdiff_t ofs = protmem_verify(path->protmem, mrn->ptr);
+            if (ofs != 0 && !mrn->scan_bad && *nreports < MEM_SCAN_REPORTS) {
+                struct mem_scan_report *r = &reports[(*nreports)++];
+                r->ptr = mrn->ptr;
+                r->size = mrn->size;
+                r->ofs = ofs;
+                r->stack_id = mrn->base.stack_id;
+                mrn->scan_bad = 1;
+            }
+            shard->scan_pos = shard->scan_pos->next;
+            budget--;
+        }
+        if (shard->scan_pos == &site->blocks) {
+            shard->scan_pos = NULL;
+            scan->site++;
+        }
+    }
+    *done = scan->chunk == NULL;
+    MUTEX_UNLOCK(shard);
+    return budget;
+}
+
+static void mem_scan_tick(struct path_class *path) {
+    struct mem_scanner *scan = path->scanner;
+    struct mem_scan_report reports[MEM_SCAN_REPORTS];
+    size_t nreports = 0, budget = scan->batch;
+    while (budget > 0) {
+        bool done;
+        budget = mem_scan_shard(path, &path->shards[scan->shard], budget, 
+            reports, &nreports, &done);
+        if (!done)
+            break;
+        if (++scan->shard == path->nshards) {
+            scan->shard = 0;
+            ATOMIC_ADD(&scan->passes, 1);
+            break;
+        }
+    }
+    if (nreports == 0)
+        return;
+    ATOMIC_ADD(&scan->corrupted, nreports);
+    mem_lock_all(path);
+    for (size_t i = 0; i < nreports; i++) {
+        char *str = mem_stack_path(path, reports[i].stack_id);
+        protmem_report(path->vio, reports[i].ptr, reports[i].size, reports[i].ofs);
+        virt_print(path->vio, "<Path>: %s\n", str? str: "");
+        if (str != NULL)
+            memory_free(path->meta_allocator, str, NULL);
+    }
+    if (!path->symbol_persist)
+        backtrace_symbol_cache_flush(&path->tracer);
+    mem_unlock_all(path);
+}
+
+static int mem_scan_thread(void *arg) {
+    struct path_class *path = (struct path_class *)arg;
+    struct mem_scanner *scan = path->scanner;
+    unsigned int step = MIN(scan->interval_ms, MEM_SCAN_DEFAULT_INTERVAL);
+    struct timespec slice = {0, (long)step * 1000000};
+    unsigned int elapsed = 0;
+    while (ATOMIC_LOAD(&scan->running)) {
+        thrd_sleep(&slice, NULL);
+        elapsed += step;
+        if (elapsed >= scan->interval_ms) {
+            mem_scan_tick(path);
+            elapsed = 0;
+        }
+    }
+    return 0;
+}
+
+/* The scanner is dropped if its thread cannot be started */
+static int mem_scan_resume(struct path_class *path) {
+    struct mem_scanner *scan = path->scanner;
+    ATOMIC_STORE(&scan->running, true);
+    if (thrd_create(&scan->thread, mem_scan_thread, path) != thrd_success) {
+        path->scanner = NULL;
+        memory_free(path->meta_allocator, scan, NULL);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+static void mem_scan_pause(struct path_class *path) {
+    struct mem_scanner *scan = path->scanner;
+    ATOMIC_STORE(&scan->running, false);
+    thrd_join(scan->thread, NULL);
+}
+
+int mem_tracer_scan_start(void *context, unsigned int interval_ms, size_t batch) {
+    ASSERT_TRUE(context != NULL);
+    struct path_class *path = (struct path_class *)context;
+    struct mem_scanner *scan;
+    if (path->protmem == NULL)
+        return -EINVAL;
+    if (path->scanner != NULL)
+        return -EBUSY;
+    scan = memory_allocate(path->meta_allocator, sizeof(*scan), NULL);
+    if (scan == NULL)
+        return -ENOMEM;
+    memset(scan, 0, sizeof(*scan));
+    scan->interval_ms = interval_ms? interval_ms: MEM_SCAN_DEFAULT_INTERVAL;
+    scan->batch = batch? batch: MEM_SCAN_DEFAULT_BATCH;
+    path->scanner = scan;
+    return mem_scan_resume(path);
+}
+
+int mem_tracer_scan_stop(void *context) {
+    ASSERT_TRUE(context != NULL);
+    struct path_class *path = (struct path_class *)context;
+    struct mem_scanner *scan = path->scanner;
+    if (scan == NULL)
+        return -EINVAL;
+    mem_scan_pause(path);
+    path->scanner = NULL;
+    memory_free(path->meta_allocator, scan, NULL);
+    return 0;
+}
+
+int mem_tracer_scan_stats(void *context, size_t *passes, size_t *corrupted) {
+    ASSERT_TRUE(context != NULL);
+    struct path_class *path = (struct path_class *)context;
+    struct mem_scanner *scan = path->scanner;
+    if (scan == NULL)
+        return -EINVAL;
+    if (passes)
+        *passes = ATOMIC_LOAD_RELAXED(&scan->passes);
+    if (corrupted)
+        *corrupted = ATOMIC_LOAD_RELAXED(&scan->corrupted);
+    return 0;
+}
+#else /* _WIN32 */
+static int mem_scan_resume(struct path_class *path) {
+    (void) path;
+    return -ENOTSUP;
+}
+
+static void mem_scan_pause(struct path_class *path) {
+    (void) path;
+}
+
+int mem_tracer_scan_start(void *context, unsigned int interval_ms, size_t batch) {
+    (void) context;
+    (void) interval_ms;
+    (void) batch;
+    return -ENOTSUP;
+}
+
+int mem_tracer_scan_stop(void *context) {
+    (void) context;
+    return -EINVAL;
+}
+
+int mem_tracer_scan_stats(void *context, size_t *passes, size_t *corrupted) {
+    (void) context;
+    (void) passes;
+    (void) corrupted;
+    return -EINVAL;
+}
+#endif /* _WIN32 */
+
+int mem_tracer_set_redzone(void *context, size_t head, size_t tail) {
+    ASSERT_TRUE(context != NULL);
+    struct path_class *path = (struct path_class *)context;
+    if (path->protmem == NULL)
+        return -EINVAL;
+    if (ATOMIC_LOAD_RELAXED(&path->protmem->used))
+        return -EBUSY;
+    path->protmem->head = PROTMEM_ALIGN_SIZE(head);
+    path->protmem->tail = tail;
+    return 0;
+}
+
+void mem_tracer_set_peak_granularity(void *context, size_t bytes) {
+    ASSERT_TRUE(context != NULL);
+    struct path_class *path = (struct path_class *)context;
+    ATOMIC_STORE_RELAXED(&path->peak->granularity, bytes);
 }
 
 int mem_tracer_set_path_separator(void *context, const char *separator) {
@@ -386,42 +2517,132 @@ int mem_tracer_set_path_separator(void *context, const char *separator) {
     struct path_class *path = (struct path_class *)context;
     if (separator == NULL)
         return -EINVAL;
-    MUTEX_LOCK(path);
-    backtrace_set_path_separator(&path->base.tracer, separator);
-    MUTEX_UNLOCK(path);
+    mem_lock_all(path);
+    backtrace_set_path_separator(&path->tracer, separator);
+    mem_unlock_all(path);
     return 0;
 }
 
 void mem_tracer_set_path_limits(void *context, int min, int max) {
     ASSERT_TRUE(context != NULL);
     struct path_class* path = (struct path_class*)context;
-    MUTEX_LOCK(path);
-    backtrace_set_path_window(&path->base.tracer, min, max);
-    MUTEX_UNLOCK(path);
+    mem_lock_all(path);
+    backtrace_set_path_window(&path->tracer, min, max);
+    mem_unlock_all(path);
+}
+
+struct mem_module_lookup {
+    uintptr_t addr;
+    uintptr_t start;
+    uintptr_t end;
+};
+
+static int mem_module_find(const struct backtrace_module *m, void *arg) {
+    struct mem_module_lookup *ml = (struct mem_module_lookup *)arg;
+    if (ml->addr < m->start || ml->addr >= m->end)
+        return 0;
+    ml->start = m->start;
+    ml->end = m->end;
+    return 1;
+}
+
+int mem_tracer_set_path_skip(void *context, const void *addr) {
+    ASSERT_TRUE(context != NULL);
+    struct path_class *path = (struct path_class *)context;
+    struct mem_module_lookup ml = {(uintptr_t)addr, 0, 0};
+    backtrace_module_iterate(mem_module_find, &ml);
+    if (ml.end == 0)
+        return -ENOENT;
+    mem_lock_all(path);
+    backtrace_set_path_skip(&path->tracer, ml.start, ml.end);
+    mem_unlock_all(path);
+    return 0;
 }
 
 void mem_tracer_set_printer(void *context, const struct printer *vio) {
     ASSERT_TRUE(context != NULL);
     if (vio) {
         struct path_class* path = (struct path_class*)context;
-        MUTEX_LOCK(path);
+        mem_lock_all(path);
         path->vio = vio;
-        MUTEX_UNLOCK(path);
+        mem_unlock_all(path);
+    }
+}
+
+int mem_tracer_set_symbol_cache(void *context, size_t max_bytes, bool persist) {
+    ASSERT_TRUE(context != NULL);
+    struct path_class* path = (struct path_class*)context;
+    int err = 0;
+    mem_lock_all(path);
+    if (max_bytes > 0)
+        err = backtrace_symbol_cache_enable(&path->tracer, max_bytes);
+    else
+        backtrace_symbol_cache_disable(&path->tracer);
+    path->symbol_persist = persist;
+    mem_unlock_all(path);
+    return err;
+}
+
+int mem_tracer_event_open(void *context, int fd, size_t ring_size, 
+    unsigned int drain_ms) {
+    ASSERT_TRUE(context != NULL);
+    struct path_class *path = (struct path_class *)context;
+    struct mem_event_stream *stream;
+    int err;
+    if (path->events)
+        return -EBUSY;
+    err = mem_event_stream_open(&stream, fd, ring_size, drain_ms, path->options);
+    if (!err)
+        ATOMIC_STORE(&path->events, stream);
+    return err;
+}
+
+int mem_tracer_event_drain(void *context) {
+    ASSERT_TRUE(context != NULL);
+    struct path_class *path = (struct path_class *)context;
+    struct mem_event_stream *stream = ATOMIC_LOAD(&path->events);
+    if (stream == NULL)
+        return -EINVAL;
+    return mem_event_stream_drain(stream);
+}
+
+void mem_tracer_event_close(void *context) {
+    ASSERT_TRUE(context != NULL);
+    struct path_class *path = (struct path_class *)context;
+    struct mem_event_stream *stream = ATOMIC_LOAD(&path->events);
+    if (stream) {
+        ATOMIC_STORE(&path->events, NULL);
+        mem_event_stream_close(stream);
     }
 }
 
 size_t mem_tracer_get_used(void* context, size_t *nblk) {
     ASSERT_TRUE(context != NULL);
     struct path_class* path = (struct path_class*)context;
-    struct mem_argument ia = {0};
-    MUTEX_LOCK(path);
-    ia.path = path;
-    ia.dis_print = true;
-    core_record_visitor(&path->base, iterator, &ia);
+    size_t bytes = 0, count = 0;
+    for (size_t i = 0; i < path->nshards; i++) {
+        bytes += ATOMIC_LOAD_RELAXED(&path->shards[i].live_bytes);
+        count += ATOMIC_LOAD_RELAXED(&path->shards[i].live_count);
+    }
     if (nblk)
-        *nblk = ia.mcount;
-    MUTEX_UNLOCK(path);
-    return ia.msize;
+        *nblk = count;
+    return bytes;
+}
+
+static void mem_shard_init(struct path_class *path, struct mem_shard *shard, 
+    struct mem_allocator *alloc, unsigned int options) {
+    memset(shard, 0, sizeof(*shard));
+    MUTEX_INIT(shard);
+    INIT_LIST_HEAD(&shard->base.head);
+    INIT_LIST_HEAD(&shard->quarantine);
+    shard->base.allocator = alloc;
+    shard->base.tree.compare = ptr_compare;
+    ptrhash_init(&shard->base.hash.map, alloc);
+    if (options & MEM_INDEX_HASH)
+        shard->base.hash.key = ptr_key;
+    shard->base.node_size = sizeof(struct mem_record_node);
+    shard->base.tracer = &path->tracer;
+    shard->tree.compare = site_compare;
 }
 
 void mem_tracer_init(void *context, struct mem_allocator *alloc, 
@@ -429,41 +2650,149 @@ void mem_tracer_init(void *context, struct mem_allocator *alloc,
     ASSERT_TRUE(context != NULL);
     struct path_class *path = (struct path_class *)context;
     memset(path, 0, sizeof(*path));
-    MUTEX_INIT(path);
-    MUTEX_LOCK(path);
     if (alloc == NULL)
         alloc = &allocator;
-    INIT_LIST_HEAD(&path->base.head);
-    if (options & MEM_CHECK_OVERFLOW) {
-        protmem_allocator.context = alloc;
-        path->allocator = &protmem_allocator;
+    path->nshards = (options & MEM_SHARDED)? MEM_SHARD_COUNT: 1;
+    path->shards = memory_allocate(alloc, 
+        path->nshards * sizeof(struct mem_shard), NULL);
+    ASSERT_TRUE(path->shards != NULL);
+    for (size_t i = 0; i < path->nshards; i++)
+        mem_shard_init(path, &path->shards[i], alloc, options);
+    if ((options & MEM_CHECK_GUARDPAGE) && 
+        !guard_pool_create(&path->guard, alloc, MEM_GUARD_CACHE_SIZE)) {
+        path->allocator = guard_pool_allocator(path->guard);
+        path->guard_fd = 2;
+        mem_guard_install(path);
+    } else if (options & MEM_CHECK_OVERFLOW) {
+        path->protmem = memory_allocate(alloc, sizeof(*path->protmem), NULL);
+        ASSERT_TRUE(path->protmem != NULL);
+        path->protmem->base.allocate = protmem_alloc;
+        path->protmem->base.free = protmem_free;
+        path->protmem->base.context = alloc;
+        path->protmem->head = PROTMEM_DEFAULT_REDZONE;
+        path->protmem->tail = PROTMEM_DEFAULT_REDZONE;
+        path->protmem->used = false;
+        path->allocator = &path->protmem->base;
     } else {
         path->allocator = alloc;
     }
-    path->base.allocator = alloc;
-    path->base.tree.compare = ptr_compare;
-    path->base.node_size = sizeof(struct mem_record_node);
-    path->tree.compare = sum_compare;
+    if (options & MEM_SAMPLE_BYTES) {
+        size_t size = MEM_SAMPLE_FILTER_SIZE * sizeof(uint32_t);
+        path->sample_filter = memory_allocate(alloc, size, NULL);
+        ASSERT_TRUE(path->sample_filter != NULL);
+        memset(path->sample_filter, 0, size);
+        path->sample_interval = MEM_SAMPLE_DEFAULT_INTERVAL;
+    }
+    path->peak = memory_allocate(alloc, sizeof(struct mem_peak), NULL);
+    ASSERT_TRUE(path->peak != NULL);
+    memset(path->peak, 0, sizeof(struct mem_peak));
+    MUTEX_INIT(path->peak);
+    path->peak->granularity = MEM_PEAK_DEFAULT_GRANULARITY;
+    path->quarantine_limit = MEM_QUARANTINE_SIZE / path->nshards;
+    path->meta_allocator = alloc;
     path->path_size = BACKTRACE_MAX_LIMIT;
     path->separator[0] = '/';
     path->options = options;
     path->vio = &mem_printer;
     printf_printer_init(&mem_printer);
-    backtrace_init(FAST_BACKTRACE, &path->base.tracer);
-    MUTEX_UNLOCK(path);
+    backtrace_init((options & MEM_BACKTRACE_FP)? FRAMEPOINTER_BACKTRACE: 
+        FAST_BACKTRACE, &path->tracer);
+    if (options & MEM_SYMBOL_ELF)
+        backtrace_set_symbolizer(&path->tracer, ELF_SYMBOLIZER);
+    backtrace_symbol_cache_enable(&path->tracer, MEM_SYMBOL_CACHE_SIZE);
+    path->symbol_persist = true;
+}
+
+int mem_tracer_quarantine_flush(void *context) {
+    ASSERT_TRUE(context != NULL);
+    struct path_class *path = (struct path_class *)context;
+    int bad = 0;
+    for (size_t i = 0; i < path->nshards; i++) {
+        struct mem_shard *shard = &path->shards[i];
+        struct list_head evicted;
+        INIT_LIST_HEAD(&evicted);
+        MUTEX_LOCK(shard);
+        list_splice_init(&shard->quarantine, &evicted);
+        shard->quarantine_bytes = 0;
+        MUTEX_UNLOCK(shard);
+        bad += mem_quarantine_release(path, shard, &evicted);
+    }
+    return bad;
+}
+
+int mem_tracer_set_quarantine(void *context, size_t bytes) {
+    ASSERT_TRUE(context != NULL);
+    struct path_class *path = (struct path_class *)context;
+    if (!(path->options & MEM_QUARANTINE))
+        return -EINVAL;
+    ATOMIC_STORE_RELAXED(&path->quarantine_limit, bytes / path->nshards);
+    return 0;
 }
 
 void mem_tracer_destory(void *context) {
     ASSERT_TRUE(context != NULL);
     struct path_class *path = (struct path_class *)context;
-    MUTEX_LOCK(path);
-    core_record_visitor(&path->base, free_iterator, path);
-    core_record_destroy(&path->base);
-    MUTEX_UNLOCK(path);
+    mem_tracer_quarantine_flush(context);
+    if (path->scanner) {
+        mem_scan_pause(path);
+        path->scanner->shard = 0;
+        path->scanner->chunk = NULL;
+        path->scanner->site = 0;
+    }
+    mem_lock_all(path);
+    for (size_t i = 0; i < path->nshards; i++) {
+        struct mem_shard *shard = &path->shards[i];
+        struct mem_site_chunk *chunk;
+        core_record_visitor(&shard->base, free_iterator, path);
+        core_record_destroy(&shard->base);
+        while ((chunk = shard->chunks) != NULL) {
+            shard->chunks = chunk->next;
+            memory_free(path->meta_allocator, chunk, NULL);
+        }
+        rbtree_initialize_empty(&shard->tree.root);
+        shard->nsites = 0;
+        shard->nblocks = 0;
+        shard->scan_pos = NULL;
+        ATOMIC_STORE_RELAXED(&shard->live_bytes, 0);
+        ATOMIC_STORE_RELAXED(&shard->live_count, 0);
+    }
+    ATOMIC_STORE_RELAXED(&path->peak->live_bytes, 0);
+    /* free_iterator() leaves the slots of the dropped blocks set */
+    if (path->sample_filter)
+        memset(path->sample_filter, 0, MEM_SAMPLE_FILTER_SIZE * sizeof(uint32_t));
+    mem_unlock_all(path);
+    if (path->scanner)
+        mem_scan_resume(path);
 }
 
 void mem_tracer_deinit(void* context) {
     struct path_class* path = (struct path_class*)context;
+    if (path->options & MEM_LEAK_CHECK)
+        mem_leak_dump(path);
+    mem_tracer_scan_stop(context);
+    mem_tracer_event_close(context);
     mem_tracer_destory(context);
-    MUTEX_DEINIT(path);
+    backtrace_deinit(&path->tracer);
+    for (size_t i = 0; i < path->nshards; i++)
+        MUTEX_DEINIT(&path->shards[i]);
+    memory_free(path->meta_allocator, path->shards, NULL);
+    if (path->sample_filter) {
+        memory_free(path->meta_allocator, path->sample_filter, NULL);
+        path->sample_filter = NULL;
+    }
+    if (path->guard) {
+        mem_guard_uninstall(path);
+        guard_pool_destroy(path->guard);
+        path->guard = NULL;
+    }
+    if (path->protmem) {
+        memory_free(path->meta_allocator, path->protmem, NULL);
+        path->protmem = NULL;
+    }
+    mem_snapshot_free(path->peak->snap);
+    MUTEX_DEINIT(path->peak);
+    memory_free(path->meta_allocator, path->peak, NULL);
+    path->peak = NULL;
+    path->shards = NULL;
+    path->nshards = 0;
 }
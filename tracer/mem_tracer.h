@@ -4,6 +4,7 @@
 #ifndef MEM_TRACER_H_
 #define MEM_TRACER_H_
 
+#include <stdbool.h>
 #include <stddef.h>
 
 #ifdef __cplusplus
@@ -18,24 +19,260 @@ extern "C"{
 
 struct printer;
 struct mem_allocator;
+struct mem_snapshot;
+struct mem_snapshot_delta;
 
 /* Tracer Options */
 #define MEM_CHECK_OVERFLOW 0x1
 #define MEM_CHECK_INVALID  0x2
+#define MEM_SHARDED        0x4 /* Address-hashed shards, one lock per shard */
+#define MEM_INDEX_HASH     0x8 /* Hash table instead of rbtree for address lookup */
+#define MEM_BACKTRACE_FP   0x10 /* Walk frame pointers instead of glibc backtrace() */
+#define MEM_SAMPLE_BYTES   0x20 /* Record one allocation per sample interval bytes */
+#define MEM_SYMBOL_ELF     0x40 /* Resolve symbols from the ELF symbol tables */
+#define MEM_LIFETIME       0x80 /* Timestamp blocks, per-callsite lifetime histograms */
+#define MEM_SIZE_HIST      0x100 /* Per-callsite requested size histograms */
+#define MEM_LEAK_CHECK     0x200 /* MEM_DUMP_LEAKS report from mem_tracer_deinit() */
+/*
+ * Every block ends flush against a PROT_NONE page, the first access 
+ * past it faults and the SIGSEGV handler prints the block and its 
+ * allocation path. At least two pages per block, falls back to 
+ * MEM_CHECK_OVERFLOW where mmap is not available.
+ */
+#define MEM_CHECK_GUARDPAGE 0x400
+/*
+ * Freed blocks are poisoned and held back in a per-shard FIFO (16MB in 
+ * total by default). Writes into them are reported with the allocation 
+ * and the free path when they leave the quarantine.
+ */
+#define MEM_QUARANTINE      0x800
+#define MEM_QUARANTINE_PATTERN 0xFB
+
+enum mem_alloc_family {
+    MEM_ALLOC_MALLOC,
+    MEM_ALLOC_NEW,
+    MEM_ALLOC_NEW_ARRAY
+};
 
 enum mem_dumper {
     MEM_DUMP_SORTED,
-    MEM_DUMP_SEQUENCE
+    MEM_DUMP_SEQUENCE,
+    /* 
+     * Bare instruction pointers and the module map, no symbols. 
+     * Shards are copied one at a time, tools/mtrace_symbolize resolves 
+     * the output offline.
+     */
+    MEM_DUMP_RAW,
+    /*
+     * Folded stacks for flame graphs, "frame;frame;... bytes" per call 
+     * path without the block list. Each frame is resolved once.
+     */
+    MEM_DUMP_FOLDED,
+    /*
+     * Callsites live at the heap high watermark, from the breakdown 
+     * kept by peak tracking (mem_tracer_peak_snapshot).
+     */
+    MEM_DUMP_PEAK,
+    /*
+     * The 64 callsites that freed the most blocks with their lifetime 
+     * histograms, needs MEM_LIFETIME.
+     */
+    MEM_DUMP_LIFETIME,
+    /*
+     * Callsites of the blocks that mem_tracer_leak_check() finds lost, 
+     * and the lost and still reachable totals.
+     */
+    MEM_DUMP_LEAKS
+};
+
+enum mem_top_metric {
+    MEM_TOP_LIVE_BYTES,
+    MEM_TOP_LIVE_COUNT,
+    MEM_TOP_ALLOC_BYTES, /* Cumulative, includes callsites with no live block */
+    MEM_TOP_FREE_COUNT   /* Churn, the blocks allocated and freed again */
+};
+
+/*
+ * Log2 lifetime buckets (MEM_LIFETIME): bucket 0 counts blocks freed 
+ * within 1024ns, bucket i those freed within [2^(i+9), 2^(i+10)) ns and 
+ * the last one everything older.
+ */
+#define MEM_LIFETIME_BUCKETS 32
+
+/*
+ * Log2 size classes of the requested sizes (MEM_SIZE_HIST): bucket 0 
+ * counts requests of up to 8 bytes, bucket i those in (4 << i, 8 << i] 
+ * and the last one everything larger.
+ */
+#define MEM_SIZE_BUCKETS 24
+
+struct mem_callsite_stats {
+    const char *path;
+    size_t live_bytes;
+    size_t live_count;
+    size_t alloc_bytes;
+    size_t alloc_count;
+    size_t free_count;
+    size_t lifetime[MEM_LIFETIME_BUCKETS];
+    size_t sizes[MEM_SIZE_BUCKETS];
 };
 
+struct mem_leak_stats {
+    const char *path;
+    size_t definite_bytes;  /* No pointer to the block is left */
+    size_t definite_count;
+    size_t indirect_bytes;  /* Only pointed to from lost blocks */
+    size_t indirect_count;
+    size_t reachable_bytes;
+    size_t reachable_count;
+};
+
+/* Read from running totals, no lock is taken and no block is visited */
 size_t mem_tracer_get_used(void* context, size_t *nblk);
 void *mem_tracer_alloc(void *context, size_t size);
 void mem_tracer_free(void *context, void *ptr);
+/*
+ * Blocks remember the family that allocated them, releasing one with 
+ * another family is reported with both paths. A non zero @size (sized 
+ * delete) must match the allocated size.
+ */
+void *mem_tracer_alloc_as(void *context, size_t size, enum mem_alloc_family family);
+void mem_tracer_free_as(void *context, void *ptr, enum mem_alloc_family family, 
+    size_t size);
+/* 
+ * Reports @ptr as an invalid free (MEM_CHECK_INVALID), for wrappers that 
+ * know a pointer is bad before it reaches the tracer, e.g. double frees.
+ */
+void mem_tracer_report_invalid(void *context, void *ptr);
 void mem_tracer_dump(void *context, enum mem_dumper type);
 void mem_tracer_set_path_length(void *context, size_t maxlen);
+/*
+ * Mean number of allocated bytes between two samples (MEM_SAMPLE_BYTES).
+ * Sizes and counts reported in this mode are estimates scaled from the 
+ * samples. Frees of unknown pointers are not reported as invalid.
+ */
+void mem_tracer_set_sample_interval(void *context, size_t bytes);
 void mem_tracer_set_path_limits(void *context, int min, int max);
+/*
+ * Frames at the top of every path that lie in the module holding @addr 
+ * are left out, so that the paths of a wrapper linked with the tracer 
+ * (libmtrace_preload.so) start at its caller.
+ */
+int mem_tracer_set_path_skip(void *context, const void *addr);
 void mem_tracer_set_printer(void *context, const struct printer *vio);
 int mem_tracer_set_path_separator(void *context, const char *separator);
+/*
+ * Symbols are cached per instruction pointer (4MB by default). A zero 
+ * size disables the cache, @persist false drops it after every dump.
+ */
+int mem_tracer_set_symbol_cache(void *context, size_t max_bytes, bool persist);
+/*
+ * Freed MEM_CHECK_GUARDPAGE mappings are reused without a system call, 
+ * up to @bytes of them (64MB by default).
+ */
+int mem_tracer_set_guard_cache(void *context, size_t bytes);
+/*
+ * MEM_CHECK_GUARDPAGE faults are written to @fd (stderr by default) 
+ * from the signal handler, with the stack id and raw addresses of the 
+ * allocation path.
+ */
+int mem_tracer_set_guard_fd(void *context, int fd);
+/*
+ * MEM_CHECK_OVERFLOW redzone widths in bytes before and after every 
+ * block (16 by default), the head is rounded up to 16. Only before the 
+ * first allocation, -EBUSY afterwards.
+ */
+int mem_tracer_set_redzone(void *context, size_t head, size_t tail);
+/* Verifies the redzones of all live blocks, returns how many are corrupted */
+int mem_tracer_check_redzones(void *context);
+/*
+ * Background thread verifying the MEM_CHECK_OVERFLOW redzones of the 
+ * live blocks, @batch blocks every @interval_ms (zero for 4096 blocks 
+ * every 10ms) under one shard lock at a time. Corrupted blocks are 
+ * reported once with their allocation path.
+ */
+int mem_tracer_scan_start(void *context, unsigned int interval_ms, size_t batch);
+int mem_tracer_scan_stop(void *context);
+/* Completed passes over all live blocks and corrupted blocks found */
+int mem_tracer_scan_stats(void *context, size_t *passes, size_t *corrupted);
+/* MEM_QUARANTINE budget in bytes, spread evenly over the shards */
+int mem_tracer_set_quarantine(void *context, size_t bytes);
+/* Releases all quarantined blocks, returns how many were written after free */
+int mem_tracer_quarantine_flush(void *context);
+/*
+ * Event stream: every alloc/free appends a fixed-size binary record 
+ * (tracer/mem_event.h) to a ring buffer of the calling thread. The rings 
+ * are written to @fd by mem_tracer_event_drain() or, with a non zero 
+ * @drain_ms, by a background thread; a full ring is written out by its 
+ * own thread so no event is dropped. Close only when no other thread 
+ * is inside the tracer.
+ */
+int mem_tracer_event_open(void *context, int fd, size_t ring_size, 
+    unsigned int drain_ms);
+int mem_tracer_event_drain(void *context);
+void mem_tracer_event_close(void *context);
+/*
+ * Report the @n largest callsites by @metric, largest first. Only the 
+ * reported call paths are symbolized, the histograms are filled in 
+ * with MEM_LIFETIME and MEM_SIZE_HIST. @callback runs without any 
+ * tracer lock held. Returns the number of callsites reported.
+ */
+int mem_tracer_top(void *context, enum mem_top_metric metric, size_t n, 
+    void (*callback)(const struct mem_callsite_stats *stats, void *arg), 
+    void *arg);
+/*
+ * Per-callsite totals (tracer/mem_snapshot.h), only one shard lock is 
+ * held at a time. Released with mem_snapshot_free().
+ */
+int mem_tracer_snapshot(void *context, struct mem_snapshot **psnap);
+/*
+ * Report the @n callsites that grew most from @a to @b (all changed 
+ * callsites when @n is 0) with their symbolized paths. Both snapshots 
+ * must come from this process. Returns the number reported.
+ */
+int mem_tracer_snapshot_diff(void *context, const struct mem_snapshot *a, 
+    const struct mem_snapshot *b, size_t n, 
+    void (*callback)(const struct mem_snapshot_delta *delta, const char *path, 
+    void *arg), void *arg);
+/*
+ * Peak tracking: the high watermark of the live bytes is kept on every 
+ * alloc/free. The per-callsite breakdown is captured only when the live 
+ * total grows past the last capture by max(@granularity, 1/16 of it) 
+ * (64KB by default), by the allocating thread. The breakdown is thus 
+ * within one step of the true peak. mem_tracer_peak_snapshot() returns 
+ * a copy of it, released with mem_snapshot_free().
+ */
+size_t mem_tracer_get_peak(void *context);
+int mem_tracer_peak_snapshot(void *context, struct mem_snapshot **psnap);
+void mem_tracer_set_peak_granularity(void *context, size_t bytes);
+/* Restart from the current live bytes and drop the kept breakdown */
+void mem_tracer_reset_peak(void *context);
+/*
+ * Conservative reachability scan. Every aligned word of the writable 
+ * module segments, the calling thread's stack and the reachable blocks 
+ * that falls inside a live block marks it reachable, interior pointers 
+ * included. Blocks left over are definitely lost, or indirectly lost 
+ * when another lost block points to them. Other threads' stacks and 
+ * thread local storage are not scanned, run it from the last thread. 
+ * All tracer locks are held during the scan. 
+ *
+ * @callback gets the callsites with lost blocks, most definitely lost 
+ * bytes first, and with @reachable also those whose blocks are all 
+ * still reachable. @total, if not NULL, receives the sums. Returns the 
+ * number of callsites reported, -ENOTSUP with MEM_SAMPLE_BYTES.
+ */
+int mem_tracer_leak_check(void *context, bool reachable, 
+    struct mem_leak_stats *total, 
+    void (*callback)(const struct mem_leak_stats *stats, void *arg), void *arg);
+/*
+ * Write the live blocks as a gzip-compressed pprof heap profile 
+ * (inuse_objects/inuse_space), one sample per call path.
+ */
+int mem_tracer_export_pprof(void *context, int fd);
+/*
+ * The allocator is invoked without any tracer lock held, so it must be 
+ * thread safe when the tracer is shared between threads.
+ */
 void mem_tracer_init(void *context, struct mem_allocator *alloc, 
     unsigned int options);
 void mem_tracer_deinit(void* context);
@@ -0,0 +1,358 @@
+/*
+ * Copyright 2022 wtcat
+ */
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "base/allocator.h"
+#include "base/backtrace.h"
+#include "base/gzip.h"
+#include "base/protobuf.h"
+#include "base/ptrhash.h"
+#include "base/utils.h"
+#include "tracer/pprof_writer.h"
+
+/* profile.proto field numbers */
+#define PROFILE_SAMPLE_TYPE   1
+#define PROFILE_SAMPLE        2
+#define PROFILE_MAPPING       3
+#define PROFILE_LOCATION      4
+#define PROFILE_FUNCTION      5
+#define PROFILE_STRING_TABLE  6
+#define PROFILE_TIME_NANOS    9
+#define PROFILE_PERIOD_TYPE   11
+#define PROFILE_PERIOD        12
+#define PROFILE_DEFAULT_TYPE  14
+
+#define PPROF_MESSAGE_SIZE   (BACKTRACE_MAX_LIMIT * 10 + 64)
+#define PPROF_SYMBOL_SIZE    256
+
+struct pprof_mapping {
+    uintptr_t start;
+    uintptr_t end;
+};
+
+struct pprof_writer {
+    struct backtrace_class *tracer;
+    struct mem_allocator *alloc;
+    struct ptrhash locations;   /* ip -> location id */
+    struct ptrhash functions;   /* name hash -> function id */
+    void **ips;
+    size_t nips;
+    size_t ips_capacity;
+    char **names;
+    size_t nnames;
+    size_t names_capacity;
+    struct pprof_mapping *mappings;
+    size_t nmappings;
+    size_t mappings_capacity;
+    uint64_t nstrings;
+    int err;
+    struct gzip_writer gz;
+};
+
+static int pprof_grow(struct pprof_writer *pw, void **array, size_t *capacity,
+    size_t count, size_t elem) {
+    size_t ncap = *capacity? *capacity * 2: 64;
+    void *p;
+    if (count < *capacity)
+        return 0;
+    p = memory_allocate(pw->alloc, ncap * elem, NULL);
+    if (p == NULL)
+        return pw->err = -ENOMEM;
+    if (*array) {
+        memcpy(p, *array, count * elem);
+        memory_free(pw->alloc, *array, NULL);
+    }
+    *array = p;
+    *capacity = ncap;
+    return 0;
+}
+
+/* Top level field of the profile message */
+static int pprof_emit(struct pprof_writer *pw, unsigned int field,
+    const void *data, size_t len) {
+    uint8_t buf[16];
+    struct pb_buffer hdr;
+    if (pw->err)
+        return pw->err;
+    pb_init(&hdr, buf, sizeof(buf));
+    pb_put_tag(&hdr, field, PB_WIRE_BYTES);
+    pb_put_varint(&hdr, len);
+    if (gzip_write(&pw->gz, hdr.data, hdr.len) ||
+        gzip_write(&pw->gz, data, len))
+        pw->err = pw->gz.err;
+    return pw->err;
+}
+
+static int pprof_emit_message(struct pprof_writer *pw, unsigned int field,
+    const struct pb_buffer *msg) {
+    if (msg->overflow)
+        return pw->err = -ENOSPC;
+    return pprof_emit(pw, field, msg->data, msg->len);
+}
+
+static int pprof_emit_varint(struct pprof_writer *pw, unsigned int field,
+    uint64_t v) {
+    uint8_t buf[24];
+    struct pb_buffer pb;
+    if (pw->err)
+        return pw->err;
+    pb_init(&pb, buf, sizeof(buf));
+    pb_put_uint64(&pb, field, v);
+    if (gzip_write(&pw->gz, pb.data, pb.len))
+        pw->err = pw->gz.err;
+    return pw->err;
+}
+
+/* Strings are indexed in the order they are written */
+static uint64_t pprof_string(struct pprof_writer *pw, const char *s, size_t len) {
+    pprof_emit(pw, PROFILE_STRING_TABLE, s, len);
+    return pw->nstrings++;
+}
+
+static int pprof_value_type(struct pprof_writer *pw, unsigned int field,
+    const char *type, const char *unit) {
+    uint8_t buf[32];
+    struct pb_buffer pb;
+    uint64_t t = pprof_string(pw, type, strlen(type));
+    uint64_t u = pprof_string(pw, unit, strlen(unit));
+    pb_init(&pb, buf, sizeof(buf));
+    pb_put_uint64(&pb, 1, t);
+    pb_put_uint64(&pb, 2, u);
+    pprof_emit_message(pw, field, &pb);
+    return (int)t;
+}
+
+static int pprof_mapping_add(const struct backtrace_module *m, void *arg) {
+    static const char hex[] = "0123456789abcdef";
+    struct pprof_writer *pw = (struct pprof_writer *)arg;
+    char build_id[BACKTRACE_BUILD_ID_SIZE * 2];
+    uint8_t buf[64];
+    struct pb_buffer pb;
+    uint64_t file, id;
+
+    if (pprof_grow(pw, (void **)&pw->mappings, &pw->mappings_capacity,
+        pw->nmappings, sizeof(*pw->mappings)))
+        return pw->err;
+    for (size_t i = 0; i < m->build_id_size; i++) {
+        build_id[2 * i] = hex[m->build_id[i] >> 4];
+        build_id[2 * i + 1] = hex[m->build_id[i] & 0xF];
+    }
+    file = pprof_string(pw, m->path, strlen(m->path));
+    id = m->build_id_size? pprof_string(pw, build_id, m->build_id_size * 2): 0;
+    pw->mappings[pw->nmappings].start = m->start;
+    pw->mappings[pw->nmappings].end = m->end;
+    pw->nmappings++;
+    pb_init(&pb, buf, sizeof(buf));
+    pb_put_uint64(&pb, 1, pw->nmappings);
+    pb_put_uint64(&pb, 2, m->start);
+    pb_put_uint64(&pb, 3, m->end);
+    pb_put_uint64(&pb, 4, m->offset);
+    pb_put_uint64(&pb, 5, file);
+    pb_put_uint64(&pb, 6, id);
+    pb_put_uint64(&pb, 7, 1);
+    return pprof_emit_message(pw, PROFILE_MAPPING, &pb);
+}
+
+static uint64_t pprof_mapping_find(struct pprof_writer *pw, uintptr_t addr) {
+    for (size_t i = 0; i < pw->nmappings; i++) {
+        if (addr >= pw->mappings[i].start && addr < pw->mappings[i].end)
+            return i + 1;
+    }
+    return 0;
+}
+
+static uint64_t pprof_location(struct pprof_writer *pw, void *ip) {
+    uintptr_t id = (uintptr_t)ptrhash_find(&pw->locations, (uintptr_t)ip);
+    if (id)
+        return id;
+    if (pprof_grow(pw, (void **)&pw->ips, &pw->ips_capacity, pw->nips,
+        sizeof(*pw->ips)))
+        return 0;
+    id = pw->nips + 1;
+    if (ptrhash_insert(&pw->locations, (uintptr_t)ip, (void *)id)) {
+        pw->err = -ENOMEM;
+        return 0;
+    }
+    pw->ips[pw->nips++] = ip;
+    return id;
+}
+
+static uintptr_t pprof_name_hash(const char *name, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (uint8_t)name[i];
+        h *= 0x100000001b3ull;
+    }
+    return (uintptr_t)h;
+}
+
+/* Collisions probe the next key, key 0 and 1 are reserved by ptrhash */
+static uint64_t pprof_function(struct pprof_writer *pw, const char *name,
+    size_t len) {
+    uintptr_t key = pprof_name_hash(name, len);
+    uint8_t buf[48];
+    struct pb_buffer pb;
+    uint64_t sid;
+    uintptr_t id;
+    char *copy;
+
+    for ( ; ; key++) {
+        if (key < 2)
+            continue;
+        id = (uintptr_t)ptrhash_find(&pw->functions, key);
+        if (id == 0)
+            break;
+        copy = pw->names[id - 1];
+        if (!strncmp(copy, name, len) && copy[len] == '\0')
+            return id;
+    }
+    if (pprof_grow(pw, (void **)&pw->names, &pw->names_capacity, pw->nnames,
+        sizeof(*pw->names)))
+        return 0;
+    copy = memory_allocate(pw->alloc, len + 1, NULL);
+    if (copy == NULL) {
+        pw->err = -ENOMEM;
+        return 0;
+    }
+    memcpy(copy, name, len);
+    copy[len] = '\0';
+    id = pw->nnames + 1;
+    if (ptrhash_insert(&pw->functions, key, (void *)id)) {
+        memory_free(pw->alloc, copy, NULL);
+        pw->err = -ENOMEM;
+        return 0;
+    }
+    pw->names[pw->nnames++] = copy;
+    sid = pprof_string(pw, name, len);
+    pb_init(&pb, buf, sizeof(buf));
+    pb_put_uint64(&pb, 1, id);
+    pb_put_uint64(&pb, 2, sid);
+    pb_put_uint64(&pb, 3, sid);
+    pprof_emit_message(pw, PROFILE_FUNCTION, &pb);
+    return id;
+}
+
+int pprof_writer_open(struct pprof_writer **ppw, int fd,
+    struct backtrace_class *tracer, struct mem_allocator *alloc,
+    uint64_t period) {
+    struct pprof_writer *pw;
+    int space;
+    int err;
+
+    if (ppw == NULL || tracer == NULL || alloc == NULL || fd < 0)
+        return -EINVAL;
+    pw = memory_allocate(alloc, sizeof(*pw), NULL);
+    if (pw == NULL)
+        return -ENOMEM;
+    memset(pw, 0, offsetof(struct pprof_writer, gz));
+    pw->tracer = tracer;
+    pw->alloc = alloc;
+    err = gzip_writer_open(&pw->gz, fd);
+    if (err) {
+        memory_free(alloc, pw, NULL);
+        return err;
+    }
+    ptrhash_init(&pw->locations, alloc);
+    ptrhash_init(&pw->functions, alloc);
+
+    pprof_string(pw, "", 0);
+    pprof_value_type(pw, PROFILE_SAMPLE_TYPE, "inuse_objects", "count");
+    space = pprof_value_type(pw, PROFILE_SAMPLE_TYPE, "inuse_space", "bytes");
+    backtrace_module_iterate(pprof_mapping_add, pw);
+    pprof_value_type(pw, PROFILE_PERIOD_TYPE, "space", "bytes");
+    if (period)
+        pprof_emit_varint(pw, PROFILE_PERIOD, period);
+    pprof_emit_varint(pw, PROFILE_TIME_NANOS, (uint64_t)time(NULL) * 1000000000);
+    pprof_emit_varint(pw, PROFILE_DEFAULT_TYPE, space);
+    if (pw->err)
+        return pprof_writer_close(pw);
+    *ppw = pw;
+    return 0;
+}
+
+int pprof_writer_add_sample(struct pprof_writer *pw, void *const ip[],
+    size_t n, int64_t objects, int64_t bytes) {
+    uint8_t lbuf[PPROF_MESSAGE_SIZE], vbuf[24], buf[PPROF_MESSAGE_SIZE + 32];
+    struct pb_buffer loc, val, pb;
+
+    if (pw == NULL)
+        return -EINVAL;
+    pb_init(&loc, lbuf, sizeof(lbuf));
+    /* pprof wants the leaf first */
+    while (n-- > 0 && !pw->err) {
+        if ((uintptr_t)ip[n] < 2)
+            continue;
+        pb_put_varint(&loc, pprof_location(pw, ip[n]));
+    }
+    pb_init(&val, vbuf, sizeof(vbuf));
+    pb_put_varint(&val, (uint64_t)objects);
+    pb_put_varint(&val, (uint64_t)bytes);
+    pb_init(&pb, buf, sizeof(buf));
+    pb_put_message(&pb, 1, &loc);
+    pb_put_message(&pb, 2, &val);
+    return pprof_emit_message(pw, PROFILE_SAMPLE, &pb);
+}
+
+int pprof_writer_symbolize(struct pprof_writer *pw) {
+    char symbol[PPROF_SYMBOL_SIZE];
+    uint8_t buf[64], lbuf[16];
+    struct pb_buffer pb, line;
+
+    if (pw == NULL)
+        return -EINVAL;
+    for (size_t i = 0; i < pw->nips && !pw->err; i++) {
+        uintptr_t addr = (uintptr_t)pw->ips[i];
+        uint64_t func = 0;
+        ssize_t ret;
+
+        ret = backtrace_transform_symbol(pw->tracer, pw->ips[i], symbol,
+            sizeof(symbol));
+        if (ret > 0) {
+            const char *name;
+            size_t len = backtrace_symbol_name(symbol, &name);
+            if (len > 0)
+                func = pprof_function(pw, name, len);
+        }
+        pb_init(&pb, buf, sizeof(buf));
+        pb_put_uint64(&pb, 1, i + 1);
+        pb_put_uint64(&pb, 2, pprof_mapping_find(pw, addr));
+        pb_put_uint64(&pb, 3, addr);
+        if (func) {
+            pb_init(&line, lbuf, sizeof(lbuf));
+            pb_put_uint64(&line, 1, func);
+            pb_put_message(&pb, 4, &line);
+        }
+        pprof_emit_message(pw, PROFILE_LOCATION, &pb);
+    }
+    return pw->err;
+}
+
+int pprof_writer_close(struct pprof_writer *pw) {
+    struct mem_allocator *alloc;
+    int err;
+
+    if (pw == NULL)
+        return -EINVAL;
+    alloc = pw->alloc;
+    err = gzip_writer_close(&pw->gz);
+    if (!pw->err)
+        pw->err = err;
+    err = pw->err;
+    ptrhash_destroy(&pw->locations);
+    ptrhash_destroy(&pw->functions);
+    for (size_t i = 0; i < pw->nnames; i++)
+        memory_free(alloc, pw->names[i], NULL);
+    if (pw->names)
+        memory_free(alloc, pw->names, NULL);
+    if (pw->ips)
+        memory_free(alloc, pw->ips, NULL);
+    if (pw->mappings)
+        memory_free(alloc, pw->mappings, NULL);
+    memory_free(alloc, pw, NULL);
+    return err;
+}
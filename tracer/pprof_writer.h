@@ -0,0 +1,39 @@
+/*
+ * Copyright 2022 wtcat
+ */
+#ifndef TRACER_PPROF_WRITER_H_
+#define TRACER_PPROF_WRITER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+struct backtrace_class;
+struct mem_allocator;
+struct pprof_writer;
+
+/*
+ * Gzip-compressed profile.proto written as it is built: samples go out
+ * as they are added, only the distinct instruction pointers and
+ * function names are kept until the location and function tables are
+ * written by pprof_writer_symbolize().
+ *
+ * Call paths are passed outermost frame first, as the stack depot
+ * stores them. pprof_writer_symbolize() uses the backtrace class, the
+ * caller serializes it with other symbol lookups.
+ */
+int pprof_writer_open(struct pprof_writer **pw, int fd,
+    struct backtrace_class *tracer, struct mem_allocator *alloc,
+    uint64_t period);
+int pprof_writer_add_sample(struct pprof_writer *pw, void *const ip[],
+    size_t n, int64_t objects, int64_t bytes);
+int pprof_writer_symbolize(struct pprof_writer *pw);
+int pprof_writer_close(struct pprof_writer *pw);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* TRACER_PPROF_WRITER_H_ */
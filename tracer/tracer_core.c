@@ -13,44 +13,13 @@
 #include "base/printer.h"
 #include "tracer/tracer_core.h"
 
-static uint32_t ipkey_generate(uint32_t crc, const uint8_t* data, size_t len) {
-    static const uint32_t table[16] = {
-        0x00000000U, 0x1db71064U, 0x3b6e20c8U, 0x26d930acU,
-        0x76dc4190U, 0x6b6b51f4U, 0x4db26158U, 0x5005713cU,
-        0xedb88320U, 0xf00f9344U, 0xd6d6a3e8U, 0xcb61b38cU,
-        0x9b64c2b0U, 0x86d3d2d4U, 0xa00ae278U, 0xbdbdf21cU,
-    };
-    crc = ~crc;
-    for (size_t i = 0; i < len; i++) {
-        uint8_t byte = data[i];
-        crc = (crc >> 4) ^ table[(crc ^ byte) & 0x0f];
-        crc = (crc >> 4) ^ table[(crc ^ ((uint32_t)byte >> 4)) & 0x0f];
-    }
-    return ~crc;
-}
-
-static void mem_tracer_begin(struct backtrace_class *cls, void *user) {
-    (void) cls;
-    (void) user;
-}
-
-static void mem_tracer_end(struct backtrace_class *cls, void *user, int err) {
-    struct record_node *d = (struct record_node *)user;
-    if (!err) {
-        struct record_class *rc = CONTAINER_OF(cls, struct record_class, tracer);
-        core_record_add(rc, d);
-    }
-}
-
 static void mem_tracer_entry(const struct backtrace_entry *entry, void *user) {
-    struct record_node *d = (struct record_node *)user;
-    ip_copy(&d->ipr, entry->ip, entry->n);
+    struct ip_record *ipr = (struct ip_record *)user;
+    ip_copy(ipr, entry->ip, entry->n);
 }
 
 static struct backtrace_callbacks callbacks = {
-    .begin = mem_tracer_begin,
-    .callback = mem_tracer_entry,
-    .end = mem_tracer_end
+    .callback = mem_tracer_entry
 };
 
 rbtree_compare_result core_record_ip_compare(struct record_node *ln, 
@@ -58,8 +27,25 @@ rbtree_compare_result core_record_ip_compare(struct record_node *ln,
     return (long)((intptr_t)ln->ipkey - (intptr_t)rn->ipkey);
 }
 
-int core_record_backtrace(struct record_class *rc, struct record_node *node) {
-    return backtrace_extract_path(&rc->tracer, &callbacks, node);
+int core_record_backtrace(struct record_class *rc, struct record_node *node, 
+    size_t max_depth) {
+    void *ip[BACKTRACE_MAX_LIMIT];
+    struct ip_record ipr;
+    int ret;
+
+    ipr.ip = ip;
+    ipr.max_depth = ipr.sp = MIN(max_depth, BACKTRACE_MAX_LIMIT);
+    /* 
+     * A path that cannot be walked (foreign stack) or stored (out of 
+     * depot memory) is recorded as unknown, the block is still kept.
+     */
+    ret = backtrace_extract_path(rc->tracer, &callbacks, &ipr);
+    if (ret)
+        node->stack_id = STACK_DEPOT_UNKNOWN;
+    else
+        node->stack_id = stack_depot_put(ip_first(&ipr), ip_size(&ipr));
+    node->ipkey = node->stack_id;
+    return 0;
 }
 
 void core_record_print_path(struct record_class *path, struct record_node *node, 
@@ -67,53 +53,115 @@ void core_record_print_path(struct record_class *path, struct record_node *node,
     struct ip_array ips;
     char str[1024];
 
-    ips.ip = ip_first(&node->ipr);
-    ips.n = ip_size(&node->ipr);
-    int ret = backtrace_transform_path(&path->tracer, &ips, str, sizeof(str));
+    if (stack_depot_fetch(node->stack_id, &ips))
+        return;
+    int ret = backtrace_transform_path(path->tracer, &ips, str, sizeof(str));
     if (ret > 0)
         virt_print(vio, "%s", str);
 }
 
-struct record_node *core_record_node_allocate(struct record_class *rc, 
-    size_t max_depth) {
+/*
+ * Call paths are interned in the stack depot, the node itself only 
+ * keeps the stack id.
+ */
+struct record_node *core_record_node_allocate(struct record_class *rc) {
     ASSERT_TRUE(rc->node_size >= sizeof(struct record_node));
-    size_t node_size = (rc->node_size + (sizeof(void *) - 1)) & ~(sizeof(void *) - 1);
-    struct record_node *rn = memory_allocate(rc->allocator, 
-        node_size + max_depth * sizeof(void *), NULL);
+    struct record_node *rn = memory_allocate(rc->allocator, rc->node_size, NULL);
     if (rn != NULL) {
         memset(rn, 0, rc->node_size);
         rbtree_set_off_tree(&rn->node);
-        rn->ipr.max_depth = max_depth;
-        rn->ipr.ip = (void **)((char *)rn + node_size);
-        rn->ipr.sp = max_depth;
     }
     return rn;
 }
 
+static inline bool core_record_hashed(const struct record_class *rc) {
+    return rc->hash.key != NULL;
+}
+
 int core_record_add(struct record_class *rc, struct record_node *node) {
     RBTree_Node *found;
     if (rc == NULL || node == NULL)
         return -EINVAL;
-    found = rbtree_insert(&rc->tree.root, &node->node, rc->tree.compare, true);
+    if (core_record_hashed(rc)) {
+        if (ptrhash_insert(&rc->hash.map, rc->hash.key(node), node))
+            return -ENOMEM;
+        found = NULL;
+    } else {
+        found = rbtree_insert(&rc->tree.root, &node->node, rc->tree.compare, true);
+    }
     ASSERT_TRUE(found == NULL);
     if (!found) {
-        node->ipkey = ipkey_generate(0, (void*)ip_first(&node->ipr), 
-            ip_size(&node->ipr) * sizeof(void *));
         list_add_tail(&node->link, &rc->head);
         return 0;
     }
     return -EEXIST;
 }
 
-int core_record_del(struct record_class *rc, struct record_node *node) {
+struct record_node *core_record_find(struct record_class *rc, 
+    const struct record_node *key) {
+    rbtree_node *found;
+    if (core_record_hashed(rc))
+        return ptrhash_find(&rc->hash.map, rc->hash.key(key));
+    found = rbtree_find(&rc->tree.root, &key->node, rc->tree.compare, true);
+    if (found)
+        return CONTAINER_OF(found, struct record_node, node);
+    return NULL;
+}
+
+int core_record_remove(struct record_class *rc, struct record_node *node) {
     if (rc == NULL || node == NULL)
         return -EINVAL;
-    rbtree_extract(&rc->tree.root, &node->node);
+    if (core_record_hashed(rc))
+        ptrhash_remove(&rc->hash.map, rc->hash.key(node));
+    else
+        rbtree_extract(&rc->tree.root, &node->node);
     list_del(&node->link);
-    memory_free(rc->allocator, node, NULL);
     return 0;
 }
 
+void core_record_node_free(struct record_class *rc, struct record_node *node) {
+    memory_free(rc->allocator, node, NULL);
+}
+
+int core_record_del(struct record_class *rc, struct record_node *node) {
+    int ret = core_record_remove(rc, node);
+    if (!ret)
+        core_record_node_free(rc, node);
+    return ret;
+}
+
+/*
+ * Find the greatest record that is ordered before @key. The hash index 
+ * has no order, so it falls back to a scan of all records.
+ */
+struct record_node *core_record_lower(struct record_class *rc, 
+    struct record_node *key) {
+    rbtree_node *iter = rbtree_root(&rc->tree.root);
+    rbtree_node *found = NULL;
+    if (core_record_hashed(rc)) {
+        struct list_head *pos;
+        list_for_each(pos, &rc->head) {
+            struct record_node *rn = CONTAINER_OF(pos, struct record_node, link);
+            if (rbtree_is_greater(rc->tree.compare(&key->node, &rn->node)) && 
+                (found == NULL || 
+                rbtree_is_greater(rc->tree.compare(&rn->node, found))))
+                found = &rn->node;
+        }
+        iter = NULL;
+    }
+    while (iter != NULL) {
+        if (rbtree_is_greater(rc->tree.compare(&key->node, iter))) {
+            found = iter;
+            iter = rbtree_right(iter);
+        } else {
+            iter = rbtree_left(iter);
+        }
+    }
+    if (found)
+        return CONTAINER_OF(found, struct record_node, node);
+    return NULL;
+}
+
 void core_record_destroy(struct record_class *rc) {
     struct list_head *pos, *next;
     list_for_each_safe(pos, next, &rc->head) {
@@ -121,6 +169,8 @@ void core_record_destroy(struct record_class *rc) {
         list_del(pos);
         memory_free(rc->allocator, rn, NULL);
     }
+    rbtree_initialize_empty(&rc->tree.root);
+    ptrhash_destroy(&rc->hash.map);
 }
 
 void core_record_visitor(struct record_class *rc,
@@ -10,8 +10,10 @@
 
 #include "base/rb.h"
 #include "base/list.h"
+#include "base/ptrhash.h"
 #include "base/allocator.h"
 #include "base/backtrace.h"
+#include "base/stack_depot.h"
 
 #ifdef __cplusplus
 extern "C"{
@@ -28,35 +30,45 @@ struct record_node {
     struct list_head link;
     rbtree_node node;
     uintptr_t ipkey;
-    struct ip_record ipr;
+    stack_id_t stack_id;
     /* For tracer */
     void *context;
 };
 
+/* 
+ * Optional address index, replaces the rbtree lookup when @key is set
+ */
+struct record_hash {
+    struct ptrhash map;
+    uintptr_t (*key)(const struct record_node *node);
+};
+
 struct record_class {
     struct record_tree tree;
+    struct record_hash hash;
     struct list_head head;
-    struct backtrace_class tracer;
+    struct backtrace_class *tracer;
     struct mem_allocator *allocator;
     size_t node_size;
     void *pnode; /* for record_node */
     void *user;
 };
 
-static inline struct record_node *core_record_lessthen_node(struct record_node *n) {
-    rbtree_node *node = rbtree_left(&n->node);
-    return CONTAINER_OF(node, struct record_node, node);
-}
-
 rbtree_compare_result core_record_ip_compare(struct record_node *ln, 
     struct record_node *rn);
-struct record_node *core_record_node_allocate(struct record_class *rc, 
-    size_t max_depth);
+struct record_node *core_record_node_allocate(struct record_class *rc);
 void core_record_print_path(struct record_class *rc, struct record_node *node, 
     const struct printer *vio, const char *separator);
-int core_record_backtrace(struct record_class *rc, struct record_node *node);
+int core_record_backtrace(struct record_class *rc, struct record_node *node, 
+    size_t max_depth);
 int core_record_add(struct record_class *rc, struct record_node *node);
+struct record_node *core_record_find(struct record_class *rc, 
+    const struct record_node *key);
 int core_record_del(struct record_class *rc, struct record_node *node);
+int core_record_remove(struct record_class *rc, struct record_node *node);
+void core_record_node_free(struct record_class *rc, struct record_node *node);
+struct record_node *core_record_lower(struct record_class *rc, 
+    struct record_node *key);
 void core_record_destroy(struct record_class *rc);
 void core_record_visitor(struct record_class *rc,
     bool (*iterator)(struct record_node *n, void *u), 
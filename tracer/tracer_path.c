@@ -64,5 +64,6 @@ void* tracer_create(const char *separator, int min_limit, int max_limit) {
 }
 
 void tracer_destory(void* tracer) {
+    backtrace_deinit(tracer);
     free(tracer);
 }
@@ -1,14 +1,23 @@
 /*
  * Copyright 2022 wtcat
  */
+#define _GNU_SOURCE
 #include <errno.h>
+#include <limits.h>
+#include <link.h>
 #include <string.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <setjmp.h>
 #include <execinfo.h>
+#include <unistd.h>
 #include <libunwind.h>
 
 #include "base/utils.h"
 #include "base/backtrace.h"
+#include "tracer/elf_symtab.h"
+#include "tracer/elf_symbolizer.h"
 
 static int unix_backtrace(struct backtrace_class *cls, struct backtrace_callbacks *cb, 
     void *user) {
@@ -25,13 +34,15 @@ static int unix_backtrace(struct backtrace_class *cls, struct backtrace_callback
             n++;
             continue;
         }
+        if (n - cls->min_limit >= BACKTRACE_MAX_LIMIT)
+            break;
         unw_get_reg(&cursor, UNW_REG_IP, &ip);
         ip_array[n - cls->min_limit] = (void *)ip;
         n++;
     }
     if (n > cls->min_limit) {
         struct backtrace_entry e;
-        e.ip = ip_array + cls->min_limit;
+        e.ip = ip_array;
         e.n = MIN(cls->max_limit, n - cls->min_limit);
         cb->callback(&e, user);
         return 0;
@@ -81,7 +92,7 @@ static int fast_backtrace(struct backtrace_class *cls, struct backtrace_callback
     struct backtrace_entry e;
     void *ip_array[BACKTRACE_MAX_LIMIT*2];
     int min = cls->min_limit;
-    int ret = backtrace(ip_array, sizeof(ip_array));
+    int ret = backtrace(ip_array, BACKTRACE_MAX_LIMIT*2);
     if (ret > min) {
         int max = cls->max_limit;
         e.ip = ip_array + min;
@@ -108,9 +119,86 @@ static ssize_t fast_symbol_transform(struct backtrace_class *cls, void *ip,
     return -ENOENT;
 }
 
+struct stack_range {
+    uintptr_t low;
+    uintptr_t high;
+};
+
+/*
+ * The stack range is queried on the first walk of each thread, later 
+ * walks only read it. That first query allocates: pthread_getattr_np() 
+ * mallocs, and on the main thread it parses /proc/self/maps via stdio.
+ */
+static const struct stack_range *thread_stack_range(void) {
+    static _Thread_local struct stack_range range;
+    if (range.high == 0) {
+        pthread_attr_t attr;
+        void *addr;
+        size_t size;
+        if (pthread_getattr_np(pthread_self(), &attr))
+            return NULL;
+        if (!pthread_attr_getstack(&attr, &addr, &size)) {
+            range.low = (uintptr_t)addr;
+            range.high = (uintptr_t)addr + size;
+        }
+        pthread_attr_destroy(&attr);
+    }
+    return range.high? &range: NULL;
+}
+
+/*
+ * Follow the saved frame pointer chain (the code is built with 
+ * -fno-omit-frame-pointer). Every frame is checked against the 
+ * thread's stack so a broken chain ends the walk instead of faulting. 
+ * Frames on other stacks (makecontext, sigaltstack) are not walked, 
+ * -ENOENT is returned.
+ */
+static int framepointer_backtrace(struct backtrace_class *cls, 
+    struct backtrace_callbacks *cb, void *user) {
+    const struct stack_range *range = thread_stack_range();
+    void *ip_array[BACKTRACE_MAX_LIMIT];
+    struct backtrace_entry e;
+    uintptr_t *fp;
+    int skip = cls->min_limit;
+    int max = MIN(cls->max_limit, BACKTRACE_MAX_LIMIT);
+    int n = 0;
+
+    if (range == NULL)
+        return -ENOENT;
+    fp = (uintptr_t *)__builtin_frame_address(0);
+    while (n < max) {
+        uintptr_t addr = (uintptr_t)fp;
+        uintptr_t *next;
+        if (addr < range->low || addr > range->high - 2 * sizeof(uintptr_t) || 
+            (addr & (sizeof(uintptr_t) - 1)))
+            break;
+        if (fp[1] == 0)
+            break;
+        if (skip > 0)
+            skip--;
+        else
+            ip_array[n++] = (void *)fp[1];
+        next = (uintptr_t *)fp[0];
+        /* The stack grows down, callers live at higher addresses */
+        if (next <= fp)
+            break;
+        fp = next;
+    }
+    if (n > 0) {
+        e.ip = ip_array;
+        e.n = n;
+        cb->callback(&e, user);
+        return 0;
+    }
+    return -ENOENT;
+}
+
 int backtrace_init(enum bracktrace_type type, struct backtrace_class *cls) {
     memset(cls, 0, sizeof(*cls));
-    if (type == UNWIND_BACKTRACE) {
+    if (type == FRAMEPOINTER_BACKTRACE) {
+        cls->backtrace = framepointer_backtrace;
+        cls->transform = fast_symbol_transform;
+    } else if (type == UNWIND_BACKTRACE) {
         cls->backtrace = unix_backtrace;
         cls->transform = unix_symbol_transform;
         cls->transform_prepare = unix_transform_prepare;
@@ -124,3 +212,128 @@ int backtrace_init(enum bracktrace_type type, struct backtrace_class *cls) {
     strcpy(cls->separator, "/");
     return 0;
 }
+
+int backtrace_set_symbolizer(struct backtrace_class *cls, 
+    enum backtrace_symbolizer type) {
+    if (cls == NULL)
+        return -EINVAL;
+    backtrace_symbol_cache_flush(cls);
+    if (type == ELF_SYMBOLIZER)
+        return elf_symbolizer_attach(cls);
+    if (cls->backtrace == unix_backtrace) {
+        cls->transform = unix_symbol_transform;
+        cls->transform_prepare = unix_transform_prepare;
+        cls->transform_post = unix_transform_post;
+    } else {
+        cls->transform = fast_symbol_transform;
+        cls->transform_prepare = NULL;
+        cls->transform_post = NULL;
+    }
+    return 0;
+}
+
+struct module_iterator {
+    int (*iterator)(const struct backtrace_module *m, void *arg);
+    void *arg;
+    char exe[PATH_MAX];
+    int err;
+};
+
+static int module_phdr_callback(struct dl_phdr_info *info, size_t size, void *data) {
+    struct module_iterator *mi = (struct module_iterator *)data;
+    struct backtrace_module m;
+    (void) size;
+
+    memset(&m, 0, sizeof(m));
+    m.bias = info->dlpi_addr;
+    m.path = info->dlpi_name;
+    /* The main program has no name */
+    if (m.path == NULL || m.path[0] == '\0')
+        m.path = mi->exe;
+    for (int i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+        if (ph->p_type == PT_NOTE && m.build_id_size == 0) {
+            m.build_id_size = elf_note_build_id((const void *)(m.bias + ph->p_vaddr), 
+                ph->p_memsz, m.build_id, BACKTRACE_BUILD_ID_SIZE);
+        }
+    }
+    for (int i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+        if (ph->p_type != PT_LOAD || !(ph->p_flags & PF_X))
+            continue;
+        m.start = m.bias + ph->p_vaddr;
+        m.end = m.start + ph->p_memsz;
+        m.offset = ph->p_offset;
+        mi->err = mi->iterator(&m, mi->arg);
+        if (mi->err)
+            return mi->err;
+    }
+    return 0;
+}
+
+int backtrace_module_iterate(
+    int (*iterator)(const struct backtrace_module *m, void *arg), void *arg) {
+    struct module_iterator mi;
+    ssize_t len;
+    if (iterator == NULL)
+        return -EINVAL;
+    mi.iterator = iterator;
+    mi.arg = arg;
+    mi.err = 0;
+    len = readlink("/proc/self/exe", mi.exe, sizeof(mi.exe) - 1);
+    mi.exe[len > 0? len: 0] = '\0';
+    dl_iterate_phdr(module_phdr_callback, &mi);
+    return mi.err;
+}
+
+struct root_iterator {
+    int (*iterator)(const void *start, const void *end, void *arg);
+    void *arg;
+    int err;
+};
+
+static int root_phdr_callback(struct dl_phdr_info *info, size_t size, void *arg) {
+    struct root_iterator *ri = (struct root_iterator *)arg;
+    (void) size;
+    for (int i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+        uintptr_t start;
+        if (ph->p_type != PT_LOAD || !(ph->p_flags & PF_W))
+            continue;
+        start = info->dlpi_addr + ph->p_vaddr;
+        ri->err = ri->iterator((const void *)start, 
+            (const void *)(start + ph->p_memsz), ri->arg);
+        if (ri->err)
+            return ri->err;
+    }
+    return 0;
+}
+
+/* Kept out of line so that the register spill stays below the frames scanned */
+static __attribute__((noinline)) int root_stack_scan(struct root_iterator *ri, 
+    const struct stack_range *range) {
+    jmp_buf regs;
+    uintptr_t low;
+    setjmp(regs);
+    low = (uintptr_t)&regs & ~(uintptr_t)(sizeof(void *) - 1);
+    if (low < range->low || low >= range->high)
+        return -EFAULT;
+    return ri->iterator((const void *)low, (const void *)range->high, ri->arg);
+}
+
+int backtrace_root_iterate(
+    int (*iterator)(const void *start, const void *end, void *arg), void *arg) {
+    const struct stack_range *range = thread_stack_range();
+    struct root_iterator ri;
+    if (iterator == NULL)
+        return -EINVAL;
+    ri.iterator = iterator;
+    ri.arg = arg;
+    ri.err = 0;
+    dl_iterate_phdr(root_phdr_callback, &ri);
+    if (ri.err)
+        return ri.err;
+    if (range == NULL)
+        return -ENOTSUP;
+    return root_stack_scan(&ri, range);
+}
@@ -68,3 +68,26 @@ int backtrace_init(enum bracktrace_type type, struct backtrace_class *cls) {
     strcpy(cls->separator, "/");
     return 0;
 }
+
+int backtrace_set_symbolizer(struct backtrace_class *cls, 
+    enum backtrace_symbolizer type) {
+    if (cls == NULL)
+        return -EINVAL;
+    if (type != DEFAULT_SYMBOLIZER)
+        return -ENOTSUP;
+    return 0;
+}
+
+int backtrace_module_iterate(
+    int (*iterator)(const struct backtrace_module *m, void *arg), void *arg) {
+    (void) iterator;
+    (void) arg;
+    return -ENOTSUP;
+}
+
+int backtrace_root_iterate(
+    int (*iterator)(const void *start, const void *end, void *arg), void *arg) {
+    (void) iterator;
+    (void) arg;
+    return -ENOTSUP;
+}